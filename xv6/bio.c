@@ -12,6 +12,7 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * Call bcow before modifying the data of a buffer.
 // 
 // The implementation uses three state flags internally:
 // * B_BUSY: the block has been returned from bread
@@ -19,13 +20,20 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+// * B_MAPPED: b->data points straight at the disk image
+//     (memide.c) instead of b->cache.  The buffer is a
+//     read-only view until bcow gives it a private copy.
+// * B_ASYNC: the buffer is being read by breadahead(), and
+//     is released by the disk interrupt when the read is done.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "fs.h"
 #include "buf.h"
+#include "mount.h"
 
 // A Queue (A LRU collection of Queue Nodes)
 struct {
@@ -36,18 +44,20 @@ struct {
 } bcache;
 
 // A hash table (Collection of pointers to cache block)
+// Buckets are chained through buf->hnext, so the table size
+// only depends on NBUF and not on the size of the disk.
 typedef struct Hash_t {
-  uint capacity;  // how many blocks in total
-  struct buf *htable[HASHSIZE];  // an array of buf nodes
+  uint capacity;  // how many buckets in total
+  struct buf *htable[HASHSIZE];  // an array of buf chains
 } Hash_t;
 
 Hash_t hash_t;
 
 // hash function
-static uint hash_func(uint blockno)
+static uint hash_func(uint dev, uint blockno)
 {
 
-	uint bval = blockno % hash_t.capacity;
+	uint bval = (blockno ^ (dev << 24)) % hash_t.capacity;
 	return bval;
 }
 
@@ -68,16 +78,34 @@ static struct buf* blookup(uint dev, uint blockno)
 {
 	//dbgprint("before lookup");
 	struct buf *b;
-	uint bval = hash_func(blockno);
-	b = hash_t.htable[bval];
-	// TODO: handle collision and wander to next location
-	if (b != NULL && b->dev == dev && b->blockno == blockno) {
-		return b;
+	uint bval = hash_func(dev, blockno);
+
+	for (b = hash_t.htable[bval]; b != NULL; b = b->hnext) {
+		if (b->dev == dev && b->blockno == blockno) {
+			return b;
+		}
 	}
 
 	return NULL;
 }
 
+// Unlink b from the chain of the block it used to cache.
+static void bunhash(struct buf *b)
+{
+	struct buf **pp;
+
+	if (b->dev == -1)  // never hashed
+		return;
+
+	for (pp = &hash_t.htable[hash_func(b->dev, b->blockno)]; *pp; pp = &(*pp)->hnext) {
+		if (*pp == b) {
+			*pp = b->hnext;
+			break;
+		}
+	}
+	b->hnext = NULL;
+}
+
 void
 binit(void)
 {
@@ -96,12 +124,43 @@ binit(void)
       b->next = bcache.head.next;
       b->prev = &bcache.head;
       b->dev = -1;
+      b->data = b->cache;
       bcache.head.next->prev = b;
       bcache.head.next = b;
     }
 }
 
 
+// Take the least recently used clean buffer for block blockno
+// of dev, which is not cached.  "clean" because B_DIRTY and
+// !B_BUSY means log.c hasn't yet committed the changes to the
+// buffer.  Returns it B_BUSY, or NULL if every buffer is in use.
+// Caller holds bcache.lock.
+static struct buf*
+brecycle(uint dev, uint blockno)
+{
+  struct buf *b;
+
+	for(b = bcache.head.prev; b != &bcache.head; b = b->prev) {
+		if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
+			// keep a copy on the cache disk, if there is one
+			if(b->flags & B_VALID)
+				l2evict(b);
+			// move to the chain of the new block
+			bunhash(b);
+			b->dev = dev;
+			b->blockno = blockno;
+			b->flags = B_BUSY;
+			b->data = b->cache;
+			b->hnext = hash_t.htable[hash_func(dev, blockno)];
+			hash_t.htable[hash_func(dev, blockno)] = b;
+			return b;
+		}
+	}
+
+  return NULL;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return B_BUSY buffer.
@@ -127,24 +186,94 @@ bget(uint dev, uint blockno)
 
   // Not cached; enqueue to queue and hash table,
   // recycle and return new buf.
-  // "clean" because B_DIRTY and !B_BUSY means log.c
-  // hasn't yet committed the changes to the buffer.
-	for(b = bcache.head.next; b != &bcache.head; b = b->next) {
-		if((b->flags & B_BUSY) == 0 && (b->flags & B_DIRTY) == 0){
-			// add to hash table
-			b->dev = dev;
-			b->blockno = blockno;
-			b->flags = B_BUSY;
-			// TODO: insert b into hashtable
-			hash_t.htable[hash_func(blockno)] = b;
-			release(&bcache.lock);
-			return b;
-		}
+	if((b = brecycle(dev, blockno)) != NULL) {
+		release(&bcache.lock);
+		return b;
 	}
 
   panic("bget: no buffers");
 }
 
+// Take buffers for the blocks of dev in bns that are not cached,
+// at most NBUF/2 of them, and fill those that the cache disk
+// (l2arc.c) has.  The rest are left in bv, B_BUSY, for the caller
+// to read; returns how many.  Blocks that are cached or busy are
+// skipped, and so is the rest if the cache runs out of free
+// buffers; the prefetch never waits for a buffer.
+static int
+bgrab(uint dev, uint *bns, int n, struct buf **bv)
+{
+  int i, j, k;
+
+  acquire(&bcache.lock);
+  for(i = k = 0; i < n && k < NBUF/2; i++){
+    if(bns[i] == 0 || blookup(dev, bns[i]) != NULL)
+      continue;
+    if((bv[k] = brecycle(dev, bns[i])) == NULL)
+      break;
+    k++;
+  }
+  release(&bcache.lock);
+
+  // Read what the cache disk has, and move the rest to the front.
+  for(i = j = 0; i < k; i++){
+    if(l2read(bv[i]))
+      brelse(bv[i]);
+    else
+      bv[j++] = bv[i];
+  }
+  return j;
+}
+
+// Read the blocks of dev in bns that are not cached into the
+// cache, with one iderwv() so that blocks on different disks
+// are read at the same time.
+void
+bprefetch(uint dev, uint *bns, int n)
+{
+  struct buf *bv[NBUF/2];
+  int i, k;
+
+  if((k = bgrab(dev, bns, n, bv)) == 0)
+    return;
+  iderwv(bv, k);
+  for(i = 0; i < k; i++)
+    brelse(bv[i]);
+}
+
+// Like bprefetch(), but only start the reads: the disk works
+// through them while the caller goes on, and ideintr() hands
+// each buffer back with bdone().  A bread() of one that is
+// still on its way waits for it like for any busy buffer.  On
+// a disk set raidrw() has to wait for the member disks, so
+// there this is bprefetch().
+void
+breadahead(uint dev, uint *bns, int n)
+{
+  struct buf *bv[NBUF/2];
+  int i, k;
+
+  if(raidwidth(dev) > 0){
+    bprefetch(dev, bns, n);
+    return;
+  }
+
+  if((k = bgrab(dev, bns, n, bv)) == 0)
+    return;
+  for(i = 0; i < k; i++)
+    bv[i]->flags |= B_ASYNC;
+  ideiostart(bv, k);
+}
+
+// The read of b started by breadahead() is done.  Called from
+// the disk interrupt, without idelock.
+void
+bdone(struct buf *b)
+{
+  b->flags &= ~B_ASYNC;
+  brelse(b);
+}
+
 // Return a B_BUSY buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
@@ -153,11 +282,147 @@ bread(uint dev, uint blockno)
 
   b = bget(dev, blockno);
   if(!(b->flags & B_VALID)) {
-    iderw(b);
+    if(ISSNAPDEV(dev))
+      snapread(b);
+    else if(!l2read(b))
+      iderw(b);
   }
   return b;
 }
 
+// Read block blockno of dev as it is on disk into dst.  Bypasses
+// the cache, whose copy may hold changes not yet committed.
+void
+bdiskread(uint dev, uint blockno, uchar *dst)
+{
+  struct buf *b;
+
+  if((b = (struct buf*)kalloc()) == 0)
+    panic("bdiskread");
+  memset(b, 0, sizeof(*b));
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = B_BUSY;
+  b->data = b->cache;
+  iderw(b);
+  memmove(dst, b->data, BSIZE);
+  kfree((char*)b);
+}
+
+// Move n blocks of dev from blockno on between the disk and
+// data, around the cache, with one iderwv() for each page's worth
+// of buf headers.  For the records of files with a record size
+// (fs.c), which are only ever written this way and never logged,
+// so the disk always has their current content.  A write drops
+// cached copies of the blocks, which could only be stale.  data
+// must be kernel memory, since ideintr() fills it.
+void
+bdirect(uint dev, uint blockno, uchar *data, int n, int write)
+{
+  struct buf *b, *pg, *bv[PGSIZE / sizeof(struct buf)];
+  int i, j, k;
+
+  // A snapshot's blocks are wherever snapread() finds them.
+  if(ISSNAPDEV(dev)){
+    if(write)
+      panic("bdirect: snapshot");
+    for(i = 0; i < n; i++){
+      b = bread(dev, blockno + i);
+      memmove(data + i*BSIZE, b->data, BSIZE);
+      brelse(b);
+    }
+    return;
+  }
+
+  if(write){
+    acquire(&bcache.lock);
+    for(i = 0; i < n; i++){
+      while((b = blookup(dev, blockno + i)) != NULL && (b->flags & B_BUSY))
+        sleep(b, &bcache.lock);
+      if(b != NULL){
+        if(b->flags & B_DIRTY)
+          panic("bdirect: logged block");
+        b->flags &= ~B_VALID;
+      }
+      l2inval(dev, blockno + i);
+    }
+    release(&bcache.lock);
+  }
+
+  if((pg = (struct buf*)kalloc()) == 0)
+    panic("bdirect");
+  for(i = 0; i < n; i += k){
+    k = n - i < NELEM(bv) ? n - i : NELEM(bv);
+    for(j = 0; j < k; j++){
+      b = bv[j] = &pg[j];
+      b->dev = dev;
+      b->blockno = blockno + i + j;
+      b->flags = write ? B_BUSY|B_DIRTY : B_BUSY;
+      b->data = data + (i + j)*BSIZE;
+    }
+    iderwv(bv, k);
+
+    // memide.c points a buffer at its image instead of copying.
+    for(j = 0; j < k; j++){
+      if(bv[j]->data != data + (i + j)*BSIZE)
+        memmove(data + (i + j)*BSIZE, bv[j]->data, BSIZE);
+    }
+  }
+  kfree((char*)pg);
+}
+
+// Forget the cached blocks of dev, which is being unmounted.
+// Waits for those still busy, such as a read-ahead.
+void
+binval(uint dev)
+{
+  struct buf *b;
+
+  acquire(&bcache.lock);
+ loop:
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    if(b->dev != dev)
+      continue;
+    if(b->flags & B_BUSY){
+      sleep(b, &bcache.lock);
+      goto loop;
+    }
+    b->flags &= ~B_VALID;
+  }
+  release(&bcache.lock);
+}
+
+// Return a B_BUSY buf for a block that the caller is going to
+// overwrite completely, filled with zeros.  Skips the disk read.
+struct buf*
+bblank(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->data = b->cache;
+  b->flags &= ~B_MAPPED;
+  memset(b->data, 0, BSIZE);
+  b->flags |= B_VALID;
+  return b;
+}
+
+// Copy-on-write: make b->data private before the caller
+// modifies it, so that a buffer mapped onto a memory disk
+// does not change the disk behind the log's back.
+// A no-op for buffers that already own their data.  Must be B_BUSY.
+void
+bcow(struct buf *b)
+{
+  if((b->flags & B_BUSY) == 0)
+    panic("bcow");
+  if(b->flags & B_MAPPED){
+    memmove(b->cache, b->data, BSIZE);
+    b->data = b->cache;
+    b->flags &= ~B_MAPPED;
+  }
+}
+
 // Write b's contents to disk.  Must be B_BUSY.
 void
 bwrite(struct buf *b)
@@ -165,6 +430,7 @@ bwrite(struct buf *b)
   if((b->flags & B_BUSY) == 0)
     panic("bwrite");
   b->flags |= B_DIRTY;
+  l2inval(b->dev, b->blockno);
   iderw(b);
 }
 
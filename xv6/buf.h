@@ -10,10 +10,14 @@ struct buf {
   struct buf *prev; // LRU cache list
   struct buf *next;
   struct buf *qnext; // disk queue
-  uchar data[BSIZE];
+  struct buf *hnext; // hash chain
+  uchar *data;       // block contents: cache[] or the memory disk itself
+  uchar cache[BSIZE];
 };
 #define B_BUSY  0x1  // buffer is locked by some process
 #define B_VALID 0x2  // buffer has been read from disk
 #define B_DIRTY 0x4  // buffer needs to be written to disk
+#define B_MAPPED 0x8 // data aliases the backing memory; bcow() before writing
+#define B_ASYNC 0x10 // read-ahead in flight; ideintr() releases the buffer
 
 #endif
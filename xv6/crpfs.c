@@ -22,6 +22,8 @@ void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
+uint emap(struct dinode *din, uint bn);
+uint bmap(struct dinode *din, uint bn);
 
 // convert to intel byte order
 ushort
@@ -117,26 +119,32 @@ int corrupt(uint inum, uint n, int pct)
 	struct dinode din;
 	uint fbn, x;
 	uint off, tot, m;
-	uint indirect[NINDIRECT];
 	char buf[512], *cbuf;
 	int counter = 0;
 
 	// read inode
 	rinode(inum, &din);
 
+	// content stored in the inode itself
+	if (xint(din.iflags) & IF_INLINE) {
+		counter = set_bits((char *) din.addrs, min(n, NINLINE), pct);
+		winode(inum, &din);
+		return counter;
+	}
+
 	off = 0;
 	for (tot=0; tot<n; tot+=m, off+=m) {
 		fbn = off / 512;  // find the block num in inode
-		assert(fbn < MAXFILE);
 
 		// get sector number
-		if (fbn < NDIRECT) {
-			x = xint(din.addrs[fbn]);
+		if (xint(din.iflags) & IF_EXTENT) {
+			x = emap(&din, fbn);
 		} else {
-			rsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-			x = xint(indirect[fbn - NDIRECT]);
+			x = bmap(&din, fbn);
 		}
 		m = min(n, (fbn + 1) * 512 -off);
+		if (x == 0)  // a hole has no data to corrupt
+			continue;
 		rsect(x, buf);	// read data
 		cbuf = (char *) &buf;
 		counter += set_bits(cbuf, m, pct);
@@ -148,6 +156,58 @@ int corrupt(uint inum, uint n, int pct)
 	return counter;
 }
 
+// Disk block holding file block bn of a block-mapped inode,
+// through up to three levels of indirect blocks; 0 for a hole.
+uint bmap(struct dinode *din, uint bn)
+{
+	uint indirect[NINDIRECT];
+	uint addr, span;
+	int level;
+
+	if (bn < NDIRECT)
+		return xint(din->addrs[bn]);
+
+	bn -= NDIRECT;
+	span = NINDIRECT;
+	for (level = 0; bn >= span; level++) {
+		assert(level < 2);
+		bn -= span;
+		span *= NINDIRECT;
+	}
+
+	addr = xint(din->addrs[NDIRECT + level]);
+	for (; level >= 0 && addr != 0; level--) {
+		span /= NINDIRECT;
+		rsect(addr, (char *)indirect);
+		addr = xint(indirect[bn / span]);
+		bn %= span;
+	}
+	return addr;
+}
+
+// Disk block holding file block bn of an extent-mapped inode,
+// or 0 for a hole: walk down the extent tree rooted in din->addrs.
+uint emap(struct dinode *din, uint bn)
+{
+	uint node[BSIZE / sizeof(uint)];
+	struct extenthdr *h = (struct extenthdr *)din->addrs;
+	struct extent *e;
+	int i;
+
+	for (;;) {
+		e = EXTENTS(h);
+		for (i = xshort(h->nent) - 1; i >= 0 && xint(e[i].lblk) > bn; i--)
+			;
+		if (xshort(h->depth) == 0)
+			break;
+		rsect(xint(e[i < 0 ? 0 : i].pblk), (char *)node);
+		h = (struct extenthdr *)node;
+	}
+
+	if (i < 0 || bn - xint(e[i].lblk) >= xint(e[i].len))
+		return 0;  // a hole
+	return xint(e[i].pblk) + bn - xint(e[i].lblk);
+}
 
 void
 wsect(uint sec, void *buf)
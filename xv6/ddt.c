@@ -0,0 +1,218 @@
+// Dedup table (DDT).
+//
+// A record of an IF_DEDUP file (see fs.c) whose stored blocks
+// are byte for byte the same as a run already in the table
+// shares that run instead of taking new blocks.  The table lives
+// on disk, in the sb.nddt blocks from sb.ddtstart that mkfs
+// reserves: the entry for blocks with hash h is in block
+// h % nddt, a bucket of DDTPB entries.  A record that finds its
+// bucket full is stored unshared.  So the table needs no memory
+// beyond the buffer cache however much is deduplicated, and a
+// lookup reads one bucket, plus the candidate blocks to make
+// sure they match.
+//
+// An entry counts the extents that use its run.  They carry
+// EXT_DDT, and when the last one lets go (ddtunref()) the entry
+// is removed and the blocks are freed.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+#include "mount.h"
+
+struct {
+    struct spinlock lock;
+    uint nhit;      // records that found an identical run
+    uint nsaved;    // blocks those did not need
+} ddt;
+
+void ddtinit (void)
+{
+    initlock(&ddt.lock, "ddt");
+}
+
+// FNV-1a, continued from h over n bytes at p.
+static uint ddthash (uint h, uchar *p, uint n)
+{
+    while (n-- > 0) {
+        h = (h ^ *p++) * 16777619;
+    }
+
+    return h;
+}
+
+// Bucket block for blocks with hash h, or 0 if dev has no DDT.
+static uint ddtbucket (uint dev, uint h)
+{
+    struct mount *mp;
+
+    mp = getmount(dev);
+
+    if (mp->sb.nddt == 0) {
+        return 0;
+    }
+
+    return mp->sb.ddtstart + h % mp->sb.nddt;
+}
+
+// Do the n blocks from pblk hold data?
+static int ddtsame (uint dev, uint pblk, uchar *data, uint n)
+{
+    struct buf *bp;
+    uint b;
+    int same;
+
+    same = 1;
+
+    for (b = 0; b < n && same; b++) {
+        bp = bread(dev, pblk + b);
+        same = memcmp(bp->data, data + b * BSIZE, BSIZE) == 0;
+        brelse(bp);
+    }
+
+    return same;
+}
+
+// Look for a run of n blocks holding data.  If there is one,
+// take a reference to it, set *pblk to its first block and
+// return 1.
+int ddtref (uint dev, uchar *data, uint n, uint *pblk)
+{
+    struct ddtent *e;
+    struct buf *bp;
+    uint h, bn;
+    int i;
+
+    h = ddthash(2166136261U, data, n * BSIZE);
+
+    if ((bn = ddtbucket(dev, h)) == 0) {
+        return 0;
+    }
+
+    bp = bread(dev, bn);
+
+    for (i = 0; i < DDTPB; i++) {
+        e = (struct ddtent*) bp->data + i;
+
+        if (e->ref == 0 || e->hash != h || e->nblk != n || !ddtsame(dev, e->pblk, data, n)) {
+            continue;
+        }
+
+        bcow(bp);
+        e = (struct ddtent*) bp->data + i;
+        e->ref++;
+        *pblk = e->pblk;
+        log_write(bp);
+        brelse(bp);
+
+        acquire(&ddt.lock);
+        ddt.nhit++;
+        ddt.nsaved += n;
+        release(&ddt.lock);
+        return 1;
+    }
+
+    brelse(bp);
+    return 0;
+}
+
+// Enter the n blocks from pblk, just written with data, with
+// one reference.  Returns 0 if there is no room for them.
+int ddtadd (uint dev, uchar *data, uint n, uint pblk)
+{
+    struct ddtent *e;
+    struct buf *bp;
+    uint h, bn;
+    int i;
+
+    h = ddthash(2166136261U, data, n * BSIZE);
+
+    if ((bn = ddtbucket(dev, h)) == 0) {
+        return 0;
+    }
+
+    bp = bread(dev, bn);
+
+    for (i = 0; i < DDTPB; i++) {
+        e = (struct ddtent*) bp->data + i;
+
+        if (e->ref != 0) {
+            continue;
+        }
+
+        bcow(bp);
+        e = (struct ddtent*) bp->data + i;
+        e->hash = h;
+        e->pblk = pblk;
+        e->nblk = n;
+        e->ref = 1;
+        log_write(bp);
+        brelse(bp);
+        return 1;
+    }
+
+    brelse(bp);
+    return 0;
+}
+
+// Drop a reference to the run of n blocks from pblk, freeing
+// it with the last one.  The blocks are read again to find
+// their bucket.
+void ddtunref (uint dev, uint pblk, uint n)
+{
+    struct ddtent *e;
+    struct buf *bp;
+    uint h, b, bn;
+    int i;
+
+    h = 2166136261U;
+
+    for (b = 0; b < n; b++) {
+        bp = bread(dev, pblk + b);
+        h = ddthash(h, bp->data, BSIZE);
+        brelse(bp);
+    }
+
+    if ((bn = ddtbucket(dev, h)) == 0) {
+        panic("ddtunref: no table");
+    }
+
+    bp = bread(dev, bn);
+
+    for (i = 0; i < DDTPB; i++) {
+        e = (struct ddtent*) bp->data + i;
+
+        if (e->ref != 0 && e->pblk == pblk) {
+            break;
+        }
+    }
+
+    if (i == DDTPB) {
+        panic("ddtunref: not in table");
+    }
+
+    bcow(bp);
+    e = (struct ddtent*) bp->data + i;
+
+    if (--e->ref == 0) {
+        for (b = 0; b < n; b++) {
+            bfree(dev, pblk + b);
+        }
+    }
+
+    log_write(bp);
+    brelse(bp);
+}
+
+// Report how much dedup has saved since boot.
+void ddtstat (struct fsstat *st)
+{
+    acquire(&ddt.lock);
+    st->ndedup = ddt.nhit;
+    st->ndedupblk = ddt.nsaved;
+    release(&ddt.lock);
+}
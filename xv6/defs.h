@@ -22,14 +22,25 @@ struct proc;
 struct rtcdate;
 struct spinlock;
 struct stat;
+struct mount;
+struct fsstat;
 struct superblock;
+struct snapent;
 
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bblank(uint, uint);
+void            bcow(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bdiskread(uint, uint, uchar*);
+void            binval(uint);
+void            bprefetch(uint, uint*, int);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
+void            bdirect(uint, uint, uchar*, int, int);
 
 /*
 // buddy.c
@@ -49,6 +60,13 @@ void            cprintf(char*, ...);
 void            consoleintr(int(*)(void));
 void            panic(char*) __attribute__((noreturn));
 
+// ddt.c
+void            ddtinit(void);
+int             ddtref(uint, uchar*, uint, uint*);
+int             ddtadd(uint, uchar*, uint, uint);
+void            ddtunref(uint, uint, uint);
+void            ddtstat(struct fsstat*);
+
 // exec.c
 int             exec(char*, char**);
 
@@ -58,19 +76,36 @@ void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, char*, int n);
+int             fileseek(struct file*, int, int);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            fsinit(int dev);
+struct mount*   getmount(uint dev);
+int             ismountdev(uint dev);
+int             fsmount(uint, struct inode*);
+struct inode*   fsumount(uint);
+int             ismounted(struct inode*);
+uint            balloc(uint dev, uint goal);
+void            bfree(int dev, uint b);
+void            bfreenow(int dev, uint b);
+uint            bnextused(uint dev, uint b);
+int             idevrelease(uint dev);
+int             dasync(void);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+uint            dirahead(struct inode*, uint);
+void            dcinval(struct inode*, char*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
 void            iinit(void);
 int            ilock(struct inode*);
 int            ilock_ext(struct inode *, int checksum);
 int            ilock_trans(struct inode *);
+int            ilock_shared(struct inode*);
+int            ilock_shared_trans(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
@@ -87,15 +122,24 @@ struct inode*  nameiparent_ext(char*, char*, int);
 struct inode*  namei_trans(char*);
 struct inode*  nameiparent_trans(char*, char*);
 int             readi(struct inode*, char*, uint, uint);
+uint            irecsize(struct inode*);
 void            stati(struct inode*, struct stat*);
+void            fsstat(struct fsstat*);
 int             writei(struct inode*, char*, uint, uint);
 int            writei_ext(struct inode*, char*, uint, uint, uint);
 int 		   dist2root(char *path);
 
 // ide.c
 void            ideinit(void);
-void            ideintr(void);
+void            ideintr(int);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
+void            ideio(struct buf**, int);
+void            ideiostart(struct buf**, int);
+int             ideread0(int, uint, void*);
+int             ideclaim(int);
+void            ideunclaim(int);
+uint            idesize(int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -107,12 +151,20 @@ char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+int             kfreepages(void);
 
 // log.c
-void            initlog(void);
+void            initlog(int dev);
+void            logdrop(int dev);
 void            log_write(struct buf*);
+void            logstat(struct fsstat*);
 void            begin_op();
 void            end_op();
+void            begin_snapread(void);
+void            end_snapread(void);
+int             logn(uint);
+uint            logblockno(int);
+int             loghas(uint, uint);
 //void 			begin_trans();
 //void			commit_trans();
 
@@ -128,6 +180,17 @@ void            lapicinit(void);
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
+// l2arc.c
+void            l2init(void);
+void            l2evict(struct buf*);
+int             l2read(struct buf*);
+void            l2inval(uint, uint);
+void            l2stat(struct fsstat*);
+
+// lz.c
+int             lzcompress(uchar*, uint, uchar*, uint, ushort*);
+int             lzdecompress(uchar*, uint, uchar*, uint);
+
 // mp.c
 extern int      ismp;
 int             mpbcpu(void);
@@ -164,6 +227,32 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// raid.c
+void            raidinit(void);
+int             raidwidth(uint);
+void            raidrw(struct buf**, int);
+int             raidrebuild(uint, uint, uchar*);
+void            raidfix(uint, uint, uchar*);
+void            raidstat(struct fsstat*);
+int             raidresilver(int);
+
+// snapshot.c
+void            snapinit(struct mount*);
+int             snapcost(void);
+int             snapkeep(uint dev, uint b);
+void            snapcommit(void);
+int             snapcreate(char*);
+int             snapdestroy(char*);
+int             snapinfo(int, struct snapent*);
+void            snapread(struct buf*);
+int             snapmount(char*, struct inode*);
+int             snapumount(uint dev);
+struct inode*   snapcross(struct inode*);
+int             snapmounted(uint dev);
+int             snapcovers(struct inode*);
+int             snapany(uint);
+int             snapsend(char*, char*, struct file*);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
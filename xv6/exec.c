@@ -23,7 +23,7 @@ exec(char *path, char **argv)
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilock_shared(ip);
   pgdir = 0;
 
   // Check ELF header
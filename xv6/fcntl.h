@@ -2,3 +2,9 @@
 #define O_WRONLY  0x001
 #define O_RDWR    0x002
 #define O_CREATE  0x200
+#define O_COMPRESS 0x400  // with O_CREATE: store the new file compressed
+#define O_DEDUP   0x800  // with O_CREATE: share blocks with identical ones
+
+#define SEEK_SET  0  // lseek whence
+#define SEEK_CUR  1
+#define SEEK_END  2
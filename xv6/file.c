@@ -5,9 +5,11 @@
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
 #include "fs.h"
 #include "file.h"
 #include "spinlock.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
 struct {
@@ -31,6 +33,7 @@ filealloc(void)
   for(f = ftable.file; f < ftable.file + NFILE; f++){
     if(f->ref == 0){
       f->ref = 1;
+      f->ramark = 0;
       release(&ftable.lock);
       return f;
     }
@@ -83,7 +86,7 @@ int
 filestat(struct file *f, struct stat *st)
 {
   if(f->type == FD_INODE){
-    if (ilock_trans(f->ip) == E_CORRUPTED)
+    if (ilock_shared_trans(f->ip) == E_CORRUPTED)
       return E_CORRUPTED;
     stati(f->ip, st);
     iunlock(f->ip);
@@ -92,6 +95,32 @@ filestat(struct file *f, struct stat *st)
   return -1;
 }
 
+// Move the offset of file f, as lseek.
+// Seeking past the end is allowed; a write there leaves a hole.
+int
+fileseek(struct file *f, int off, int whence)
+{
+  int base;
+
+  if(f->type != FD_INODE)
+    return -1;
+  if(whence == SEEK_SET)
+    base = 0;
+  else if(whence == SEEK_CUR)
+    base = f->off;
+  else if(whence == SEEK_END){
+    ilock_shared(f->ip);
+    base = f->ip->size;
+    iunlock(f->ip);
+  } else
+    return -1;
+  if(base + off < 0)
+    return -1;
+  f->off = base + off;
+  f->ramark = f->off;
+  return f->off;
+}
+
 // Read from file f.
 int
 fileread(struct file *f, char *addr, int n)
@@ -103,9 +132,19 @@ fileread(struct file *f, char *addr, int n)
   if(f->type == FD_PIPE)
     return piperead(f->pipe, addr, n);
   if(f->type == FD_INODE){
-    ilock_trans(f->ip);
+    // The inode lock also guards f->off and f->ramark.  A file
+    // shared with another process since fork() is read under
+    // the exclusive lock, so that no two read at one offset.
+    // With f->ref 1 no one else holds f to share it meanwhile.
+    if(f->ref > 1)
+      ilock_trans(f->ip);
+    else
+      ilock_shared_trans(f->ip);
     if((r = readi(f->ip, addr, f->off, n)) > 0)
       f->off += r;
+    // Whoever reads a directory is about to look its entries up.
+    if(f->ip->type == T_DIR && f->off >= f->ramark)
+      f->ramark = dirahead(f->ip, f->off);
     iunlock(f->ip);
     return r;
   }
@@ -130,8 +169,11 @@ filewrite(struct file *f, char *addr, int n)
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((LOGSIZE-1-1-2) / 2) * 512;
+    // While there are snapshots commit() copies old blocks
+    // into the same log (snapshot.c), leaving less room.
+    int max = ((LOGSIZE/snapcost()-1-1-2) / 2) * 512;
     int i = 0;
+    int rs;
 
 
     // First, call ilock_trans once to make sure that the
@@ -145,6 +187,15 @@ filewrite(struct file *f, char *addr, int n)
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
+      // A record file rewrites a whole record for any part
+      // of it, so write at most one record per op.  Records
+      // of a file with a record size do not go through the
+      // log (see rwrite() in fs.c), so they can be bigger.
+      rs = irecsize(f->ip);
+      if(rs > BSIZE && !(f->ip->iflags & (IF_COMPRESS|IF_DEDUP)))
+        n1 = n - i;
+      if(rs > BSIZE && n1 > rs - f->off % rs)
+        n1 = rs - f->off % rs;
 
       begin_op();
       ilock(f->ip);
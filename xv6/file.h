@@ -6,6 +6,7 @@ struct file {
     struct pipe  *pipe;
     struct inode *ip;
     uint         off;
+    uint         ramark;  // directory offset to call dirahead() at
 };
 
 
@@ -21,13 +22,27 @@ struct inode {
     short   minor;
     short   nlink;
     uint    size;
-    uint    addrs[NDIRECT+1];
+    uint    addrs[NDIRECT+3];
     // add by hgp
     short child1;
     short child2;
     uint checksum;
+    uint    iflags;     // IF_* format flags
+    uint    gen;        // copy of dinode gen
+    uint    recblks;    // copy of dinode recblks
+    int     cdirty;     // content changed since checksum was computed
+    uint    csize;      // size of the content the checksum covers
+    struct extent ecache;  // last extent looked up (IF_EXTENT)
+    uint    indblk;     // last single indirect block bmap used, or 0
+    uint    indbase;    // first file block mapped by indblk
+    int     ndelalloc;  // blocks waiting in delalloc buffers
+    int     readers;    // holders of the shared lock
+    int     wwait;      // processes waiting for the exclusive lock
+    struct inode *hnext;  // icache hash chain
+    struct inode *prev;   // icache LRU list of unreferenced inodes
+    struct inode *next;
 };
-#define I_BUSY 0x1
+#define I_BUSY 0x1   // locked exclusively
 #define I_VALID 0x2
 
 // table mapping major device number to
@@ -19,9 +19,30 @@
 #include "buf.h"
 #include "fs.h"
 #include "file.h"
+#include "mount.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+
+// Files kept in records, one extent each: compressed and dedup
+// files (see zwrite()) and files with a record size of more than
+// a block (see rwrite()).
+#define IZRECORDS(ip) ((ip)->iflags & (IF_COMPRESS | IF_DEDUP))
+#define IRECORDS(ip) (IZRECORDS(ip) || ((ip)->type == T_FILE && (ip)->recblks > 1))
+#define IRECBLKS(ip) (IZRECORDS(ip) ? CRECBLKS : (ip)->recblks)
 static void itrunc (struct inode*);
+static void dainit (void);
+static int daflush (struct inode*, int);
+static uint dadisksize (struct inode*);
+static uint bmap_ext (struct inode*, uint, int);
+static void imapinit (struct mount*);
+static void dcinit (void);
+static void dcpurge (uint dev, uint dinum);
+static void zinit (void);
+static void zcpurge (uint dev, uint inum);
+static int zread (struct inode*, char*, uint, uint);
+static int zwrite (struct inode*, char*, uint, uint);
+static int irepair (struct inode*);
+struct inode* iget (uint, uint);
 
 // Read the super block.
 void readsb (int dev, struct superblock *sb)
@@ -34,12 +55,12 @@ void readsb (int dev, struct superblock *sb)
 }
 
 // Zero a block.
+// The old contents are irrelevant, so the block is not read.
 static void bzero (int dev, int bno)
 {
     struct buf *bp;
 
-    bp = bread(dev, bno);
-    memset(bp->data, 0, BSIZE);
+    bp = bblank(dev, bno);
     log_write(bp);
     brelse(bp);
 }
@@ -53,50 +74,513 @@ void _dbgprint(const char *func, const char *file, char *msg)
 
 
 // Blocks.
+//
+// The on-disk bitmap is the truth, but balloc() does not scan it
+// from the start. fsinit() builds an in-memory free-space map:
+// the disk is split into metaslabs, one per bitmap block (BPB
+// blocks each), and fsmap.tree[] is a binary tree of free-block
+// counts with one leaf per metaslab. Finding the next metaslab
+// with free space after the allocation cursor takes O(log n), and
+// full metaslabs are never read. The cursor rotates forward, so
+// consecutive allocations land next to each other.
+//
+// A count is changed while the matching bitmap buffer is still
+// locked, so the two agree whenever the buffer is unlocked.
+
+// The maps live in the device's struct mount (mount.h) with
+// the cached super block, so allocation never reads block 1.
+
+// Mounted file systems.  m[0] is the root; the others are disks
+// mounted with fsmount() on a directory, which they cover.
+// namex() goes from a covered directory to the root of the disk
+// on it, and from that root's ".." back to the directory's
+// parent.  busy keeps mounts and unmounts one at a time.
+static struct {
+    struct spinlock lock;
+    int busy;
+    struct mount m[NMOUNT];
+} mtab;
+
+// The mount structure of device dev.
+struct mount* getmount (uint dev)
+{
+    struct mount *mp;
+
+    // A snapshot is a view of the root file system.
+    if (ISSNAPDEV(dev)) {
+        return &mtab.m[0];
+    }
+
+    for (mp = mtab.m; mp < &mtab.m[NMOUNT]; mp++) {
+        if (mp->dev == dev && dev != 0) {
+            return mp;
+        }
+    }
+
+    panic("getmount: not mounted");
+}
+
+// Is dev a mounted disk or a mounted snapshot?  For device
+// numbers that come from the user, which getmount() would
+// panic on.
+int ismountdev (uint dev)
+{
+    struct mount *mp;
+    int r;
+
+    if (ISSNAPDEV(dev)) {
+        return snapmounted(dev);
+    }
+
+    r = 0;
+    acquire(&mtab.lock);
+
+    for (mp = mtab.m; mp < &mtab.m[NMOUNT]; mp++) {
+        if (mp->dev == dev && dev != 0) {
+            r = 1;
+        }
+    }
+
+    release(&mtab.lock);
+    return r;
+}
+
+// Add delta to the free count of metaslab ms.
+// Caller holds mp->fsmap.lock.
+static void msadjust (struct mount *mp, uint ms, int delta)
+{
+    uint node;
+
+    for (node = mp->fsmap.nleaf + ms; node > 0; node /= 2) {
+        mp->fsmap.tree[node] += delta;
+    }
+}
+
+// First metaslab in [lo, hi) under node, at or after from,
+// that has free blocks; -1 if none.
+static int msfind1 (struct mount *mp, uint node, uint lo, uint hi, uint from)
+{
+    uint mid;
+    int r;
+
+    if (hi <= from || mp->fsmap.tree[node] == 0) {
+        return -1;
+    }
+
+    if (hi - lo == 1) {
+        return lo;
+    }
+
+    mid = (lo + hi) / 2;
+
+    if ((r = msfind1(mp, 2*node, lo, mid, from)) >= 0) {
+        return r;
+    }
+
+    return msfind1(mp, 2*node + 1, mid, hi, from);
+}
 
-// Allocate a zeroed disk block.
-static uint balloc (uint dev)
+// First metaslab at or after ms with free blocks, wrapping
+// around the end of the disk; -1 if the disk is full.
+// Caller holds mp->fsmap.lock.
+static int msfind (struct mount *mp, uint ms)
 {
-    int b, bi, m;
+    int r;
+
+    if ((r = msfind1(mp, 1, 0, mp->fsmap.nleaf, ms)) < 0) {
+        r = msfind1(mp, 1, 0, mp->fsmap.nleaf, 0);
+    }
+
+    return r;
+}
+
+// Set up mp for device dev: read the super block, recover the
+// log and build the free-space maps.
+static void mountfs (struct mount *mp, uint dev)
+{
+    uint b, bi, ms, nfree;
     struct buf *bp;
+
+    mp->dev = dev;
+    readsb(dev, &mp->sb);
+    mp->inodestart = 2;
+    mp->bmapstart = mp->sb.ninodes / IPB + 3;
+    mp->datastart = mp->bmapstart + mp->sb.size / BPB + 1;
+    mp->logstart = mp->sb.size - mp->sb.nlog;
+
+    initlog(dev);
+
+    initlock(&mp->fsmap.lock, "fsmap");
+
+    mp->fsmap.nms = (mp->sb.size + BPB - 1) / BPB;
+    if (mp->fsmap.nms > NMETASLAB) {
+        panic("fsinit: disk too large");
+    }
+
+    for (mp->fsmap.nleaf = 1; mp->fsmap.nleaf < mp->fsmap.nms; mp->fsmap.nleaf *= 2)
+        ;
+
+    for (ms = 0; ms < mp->fsmap.nms; ms++) {
+        bp = bread(dev, MBBLOCK(mp, ms * BPB));
+        nfree = 0;
+
+        for (bi = 0; bi < BPB; bi++) {
+            b = ms * BPB + bi;
+            if (b >= mp->sb.size) {
+                break;
+            }
+            if ((bp->data[bi / 8] & (1 << (bi % 8))) == 0) {
+                nfree++;
+            }
+        }
+
+        brelse(bp);
+        msadjust(mp, ms, nfree);
+    }
+
+    cprintf("fsinit: %d blocks, %d free in %d metaslabs\n",
+            mp->sb.size, mp->fsmap.tree[1], mp->fsmap.nms);
+
+    imapinit(mp);
+}
+
+// Mount the root, device dev.  Runs once, from the first process.
+void fsinit (int dev)
+{
+    initlock(&mtab.lock, "mtab");
+    mountfs(&mtab.m[0], dev);
+    snapinit(&mtab.m[0]);
+    ddtinit();
+}
+
+// Could the super block sb of disk dev be mounted?  The checks
+// are those whose failure fsinit() would panic over, or that
+// keep the disk from being read past its end.
+static int sbvalid (uint dev, struct superblock *sb)
+{
+    return sb->size > 0 && sb->size <= idesize(dev) / (BSIZE / 512)
+        && (sb->size + BPB - 1) / BPB <= NMETASLAB
+        && sb->ninodes > 0 && sb->ninodes <= MAXINODES
+        && sb->nlog >= LOGSIZE && sb->nlog < sb->size
+        && sb->ninodes / IPB + 3 + sb->size / BPB + 1 < sb->size - sb->nlog;
+}
+
+static void mtabenter (void)
+{
+    acquire(&mtab.lock);
+    while (mtab.busy) {
+        sleep(&mtab, &mtab.lock);
+    }
+    mtab.busy = 1;
+    release(&mtab.lock);
+}
+
+static void mtabexit (void)
+{
+    acquire(&mtab.lock);
+    mtab.busy = 0;
+    wakeup(&mtab);
+    release(&mtab.lock);
+}
+
+// Mount the file system on disk dev on directory dp, which keeps
+// the reference the caller passes in.  Not in a transaction,
+// since recovering dev's log writes to it directly.  Fails if
+// dev is not there, is in use, does not hold a file system, or
+// has snapshots: those belong to the root's snapshot.c.
+int fsmount (uint dev, struct inode *dp)
+{
     struct superblock sb;
+    struct mount *mp;
+    int i;
+
+    mtabenter();
+
+    mp = 0;
+    for (i = 1; i < NMOUNT; i++) {
+        if (mtab.m[i].covered == dp) {
+            mp = 0;
+            break;
+        }
+        if (mtab.m[i].dev == 0 && mp == 0) {
+            mp = &mtab.m[i];
+        }
+    }
+
+    if (mp == 0 || ideclaim(dev) < 0) {
+        mtabexit();
+        return -1;
+    }
 
-    bp = 0;
     readsb(dev, &sb);
+    if (!sbvalid(dev, &sb) || snapany(dev)) {
+        binval(dev);
+        ideunclaim(dev);
+        mtabexit();
+        return -1;
+    }
+
+    mountfs(mp, dev);
+
+    acquire(&mtab.lock);
+    mp->covered = dp;
+    release(&mtab.lock);
+
+    mtabexit();
+    return 0;
+}
+
+// Unmount the disk dev, unless a file or directory in it is
+// still in use.  Returns the directory it covered, whose
+// reference passes to the caller, or 0.  Not in a transaction,
+// since it waits for the last changes to dev to be committed.
+struct inode* fsumount (uint dev)
+{
+    struct mount *mp;
+    struct inode *dp;
+
+    if (dev == ROOTDEV || ISSNAPDEV(dev)) {
+        return 0;
+    }
+
+    mtabenter();
+
+    for (mp = &mtab.m[1]; mp < &mtab.m[NMOUNT] && mp->dev != dev; mp++)
+        ;
+
+    if (mp == &mtab.m[NMOUNT]) {
+        mtabexit();
+        return 0;
+    }
+
+    // Out of the name space first, so that nothing new can
+    // get into dev while its inodes are checked.
+    acquire(&mtab.lock);
+    dp = mp->covered;
+    mp->covered = 0;
+    release(&mtab.lock);
+
+    if (idevrelease(dev) < 0) {
+        acquire(&mtab.lock);
+        mp->covered = dp;
+        release(&mtab.lock);
+        mtabexit();
+        return 0;
+    }
+
+    logdrop(dev);
+    binval(dev);
+    ideunclaim(dev);
+
+    acquire(&mtab.lock);
+    mp->dev = 0;
+    release(&mtab.lock);
+
+    mtabexit();
+    return dp;
+}
+
+// Is a disk mounted on directory ip?  unlink() must not
+// remove it.
+int ismounted (struct inode *ip)
+{
+    int i, r;
+
+    r = 0;
+    acquire(&mtab.lock);
+
+    for (i = 1; i < NMOUNT; i++) {
+        if (mtab.m[i].covered == ip) {
+            r = 1;
+        }
+    }
+
+    release(&mtab.lock);
+    return r;
+}
+
+// If ip is a directory with a disk mounted on it, return the
+// disk's root instead.
+static struct inode* mountcross (struct inode *ip)
+{
+    struct inode *next;
+    int i;
+
+    next = 0;
+    acquire(&mtab.lock);
+
+    for (i = 1; i < NMOUNT; i++) {
+        if (mtab.m[i].covered == ip) {
+            next = iget(mtab.m[i].dev, ROOTINO);
+            break;
+        }
+    }
+
+    release(&mtab.lock);
 
-    // for bitmap
-    for (b = 0; b < sb.size; b += BPB) {
-    	// hgp: BBLOCK to find the block containing bit for block b
-    	// bread read this bitmap block
-        bp = bread(dev, BBLOCK(b, sb.ninodes));
+    if (next == 0) {
+        return ip;
+    }
+
+    iput(ip);
+    return next;
+}
+
+// If ip is the root of a mounted disk, return the directory
+// it covers, where ".." is looked up instead.
+static struct inode* mountup (struct inode *ip)
+{
+    struct inode *next;
+    int i;
+
+    if (ip->inum != ROOTINO || ip->dev == ROOTDEV || ISSNAPDEV(ip->dev)) {
+        return ip;
+    }
+
+    next = 0;
+    acquire(&mtab.lock);
+
+    for (i = 1; i < NMOUNT; i++) {
+        if (mtab.m[i].dev == ip->dev && mtab.m[i].covered != 0) {
+            next = idup(mtab.m[i].covered);
+            break;
+        }
+    }
+
+    release(&mtab.lock);
+
+    if (next == 0) {
+        return ip;
+    }
+
+    iput(ip);
+    return next;
+}
+
+// Mark block b, whose bit is in the bitmap block bp, in use.
+static void btake (struct mount *mp, struct buf *bp, uint b)
+{
+    uint bi;
+
+    bi = b % BPB;
+    bcow(bp);
+    bp->data[bi / 8] |= 1 << (bi % 8);  // Mark block in use.
+    acquire(&mp->fsmap.lock);
+    msadjust(mp, b / BPB, -1);
+    mp->fsmap.cursor = b + 1;
+    if (mp->fsmap.cursor >= mp->sb.size) {
+        mp->fsmap.cursor = 0;
+    }
+    release(&mp->fsmap.lock);
+    log_write(bp);
+}
+
+// Take up to *n free blocks in a row starting at b, whose bit is
+// in the bitmap block bp, stopping at the end of that block.
+// Sets *n to the number taken.
+static void btakerun (struct mount *mp, struct buf *bp, uint b, uint *n)
+{
+    uint i, bi;
+
+    for (i = 0; i < *n && b + i < mp->sb.size; i++) {
+        bi = (b + i) % BPB;
+
+        if ((i > 0 && bi == 0) || (bp->data[bi / 8] & (1 << (bi % 8)))) {
+            break;
+        }
 
-        for (bi = 0; bi < BPB && b + bi < sb.size; bi++) {
+        btake(mp, bp, b + i);
+    }
+
+    *n = i;
+}
+
+// Allocate up to *n contiguous disk blocks, preferably starting
+// at goal (0 for no preference), so that a file can grow in place.
+// Sets *n to the number allocated, at least 1.  The blocks are
+// not zeroed.
+static uint ballocrun (uint dev, uint goal, uint *n)
+{
+    uint b, bi, i, ms;
+    int m, r;
+    struct buf *bp;
+    struct mount *mp;
+
+    mp = getmount(dev);
+
+    if (goal > 0 && goal < mp->sb.size) {
+        bp = bread(dev, MBBLOCK(mp, goal));
+        bi = goal % BPB;
+
+        if ((bp->data[bi / 8] & (1 << (bi % 8))) == 0) {
+            btakerun(mp, bp, goal, n);
+            brelse(bp);
+            return goal;
+        }
+
+        brelse(bp);
+    }
+
+    for (;;) {
+        acquire(&mp->fsmap.lock);
+        if ((r = msfind(mp, mp->fsmap.cursor / BPB)) < 0) {
+            release(&mp->fsmap.lock);
+            panic("balloc: out of blocks");
+        }
+        ms = r;
+        // Start at the cursor if it is inside this metaslab.
+        b = (ms == mp->fsmap.cursor / BPB) ? mp->fsmap.cursor : ms * BPB;
+        release(&mp->fsmap.lock);
+
+        // hgp: MBBLOCK to find the block containing bit for block b
+        // bread read this bitmap block
+        bp = bread(dev, MBBLOCK(mp, b));
+
+        for (i = 0; i < BPB; i++) {
+            bi = (b + i) % BPB;
             m = 1 << (bi % 8);
 
+            if (bi % 8 == 0 && bp->data[bi / 8] == 0xff) {  // skip full bytes
+                i += 7;
+                continue;
+            }
+
+            if (ms * BPB + bi >= mp->sb.size) {
+                continue;
+            }
+
             if ((bp->data[bi / 8] & m) == 0) {  // Is block free?
-                bp->data[bi / 8] |= m;  // Mark block in use.
-                log_write(bp);
+                btakerun(mp, bp, ms * BPB + bi, n);
                 brelse(bp);
-                bzero(dev, b + bi);
-                return b + bi;
+                return ms * BPB + bi;
             }
         }
 
+        // Another process took the last free block first.
         brelse(bp);
     }
+}
 
-    panic("balloc: out of blocks");
+// Allocate a zeroed disk block, preferably goal.
+uint balloc (uint dev, uint goal)
+{
+    uint b, n;
+
+    n = 1;
+    b = ballocrun(dev, goal, &n);
+    bzero(dev, b);
+    return b;
 }
 
-// Free a disk block.
-static void bfree (int dev, uint b)
+// Free a disk block that a snapshot no longer needs.
+void bfreenow (int dev, uint b)
 {
     struct buf *bp;
-    struct superblock sb;
+    struct mount *mp;
     int bi, m;
 
-    readsb(dev, &sb);
-    bp = bread(dev, BBLOCK(b, sb.ninodes));
+    mp = getmount(dev);
+    bp = bread(dev, MBBLOCK(mp, b));
     bi = b % BPB;
     m = 1 << (bi % 8);
 
@@ -104,11 +588,58 @@ static void bfree (int dev, uint b)
         panic("freeing free block");
     }
 
+    bcow(bp);
     bp->data[bi / 8] &= ~m;  // hgp: set bit to 0
+    acquire(&mp->fsmap.lock);
+    msadjust(mp, b / BPB, 1);
+    release(&mp->fsmap.lock);
     log_write(bp);
     brelse(bp);
 }
 
+// Free a disk block, unless a snapshot still needs it.
+void bfree (int dev, uint b)
+{
+    if (!snapkeep(dev, b)) {
+        bfreenow(dev, b);
+    }
+}
+
+// The first block of dev from b on that is in use, or the size of
+// dev if there is none.  Metaslabs with nothing in use are skipped
+// without reading their bitmap block, so walking a disk with this
+// costs in proportion to what is in use.
+uint bnextused (uint dev, uint b)
+{
+    struct buf *bp;
+    struct mount *mp;
+    uint ms, bi, n;
+
+    mp = getmount(dev);
+
+    while (b < mp->sb.size) {
+        ms = b / BPB;
+        n = min(BPB, mp->sb.size - ms * BPB);
+
+        if (mp->fsmap.tree[mp->fsmap.nleaf + ms] == n) {
+            b = (ms + 1) * BPB;
+            continue;
+        }
+
+        bp = bread(dev, MBBLOCK(mp, b));
+        for (bi = b % BPB; bi < n; bi++, b++) {
+            if (bp->data[bi / 8] & (1 << (bi % 8))) {
+                brelse(bp);
+                return b;
+            }
+        }
+        brelse(bp);
+        b = (ms + 1) * BPB;
+    }
+
+    return mp->sb.size;
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -135,23 +666,28 @@ static void bfree (int dev, uint b)
 //   the link count has fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() to find or
+//   can be recycled if ip->ref is zero. Otherwise ip->ref
+//   tracks the number of in-memory pointers to the entry
+//   (open files and current directories). iget() to find or
 //   create a cache entry and increment its ref, iput()
 //   to decrement ref.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when the I_VALID bit
 //   is set in ip->flags. ilock() reads the inode from
-//   the disk and sets I_VALID, while iput() clears
-//   I_VALID if ip->ref has fallen to zero.
+//   the disk, verifies its checksum and sets I_VALID.
+//   An entry keeps I_VALID after its last iput(), so
+//   opening the file again needs no disk read and no
+//   checksum; only recycling the entry clears it.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
 //   has first locked the inode. The I_BUSY flag indicates
-//   that the inode is locked. ilock() sets I_BUSY,
-//   while iunlock clears it.
+//   that the inode is locked exclusively. ilock() sets I_BUSY,
+//   while iunlock clears it. Code that only reads the inode
+//   (readi, dirlookup, stati) can take ilock_shared() instead,
+//   which any number of processes may hold at once; ip->readers
+//   counts them, and iunlock() releases either kind.
 //
 // Thus a typical sequence is:
 //   ip = iget(dev, inum)
@@ -171,72 +707,257 @@ static void bfree (int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 
+// The cache is sized by iinit() from free memory. Entries are
+// found through a hash table on (dev, inum). Unreferenced entries
+// sit on an LRU list, most recently released first, and iget()
+// recycles the least recently released one.
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
+    uint ninode;                    // entries in the cache
+    struct inode *hash[IHASHSIZE];  // chains through ip->hnext
+    struct inode lru;               // unreferenced entries
 } icache;
 
-void iinit (void)
-{
-    initlock(&icache.lock, "icache");
-}
-
-struct inode* iget (uint dev, uint inum);
-
-//PAGEBREAK!
-// Allocate a new inode with the given type on device dev.
-// A free inode has a type of zero.
-struct inode* ialloc (uint dev, short type)
+// Free inodes.
+//
+// Like blocks, free inodes are found through an in-memory map
+// instead of by reading the inode table: imap.used has one bit
+// per inode, set when its type on disk is non-zero. imapinit()
+// fills it in at mount, ialloc() sets a bit and iput() clears it
+// once the freed inode has been logged. No inode below imap.hint
+// is free, so ialloc() usually reads only the block it allocates
+// from. The map is in struct mount too.
+
+// Build the free-inode map from the inode table.
+static void imapinit (struct mount *mp)
 {
-    int inum;
+    uint inum;
     struct buf *bp;
     struct dinode *dip;
-    struct superblock sb;
 
-    readsb(dev, &sb);
+    initlock(&mp->imap.lock, "imap");
+
+    if (mp->sb.ninodes > MAXINODES) {
+        panic("imapinit: too many inodes");
+    }
+
+    mp->imap.used[0] = 1;  // inode 0 is never allocated
+    bp = 0;
+
+    for (inum = 1; inum < mp->sb.ninodes; inum++) {
+        if (bp == 0 || inum % IPB == 0) {
+            if (bp) {
+                brelse(bp);
+            }
+            bp = bread(mp->dev, MIBLOCK(mp, inum));
+        }
 
-    for (inum = 1; inum < sb.ninodes; inum++) {
-        bp = bread(dev, IBLOCK(inum));
         dip = (struct dinode*) bp->data + inum % IPB;
 
-        if (dip->type == 0) {  // a free inode
-            memset(dip, 0, sizeof(*dip));
-            dip->type = type;
-            log_write(bp);   // mark it allocated on the disk
-            brelse(bp);
-            return iget(dev, inum);
+        if (dip->type != 0) {
+            mp->imap.used[inum / 8] |= 1 << (inum % 8);
+        } else {
+            mp->imap.nfree++;
         }
+    }
 
+    if (bp) {
         brelse(bp);
     }
 
-    panic("ialloc: no inodes");
+    mp->imap.hint = 1;
 }
 
-// compute inode checksum
-// Adler_32 algorithm
-//const int MOD_ADLER = 65521;
-//uint ichecksum(struct inode *ip)
-//{
-//	// do not compute device
-//	if (ip->type == T_DEV)
-//		return 0;
-//
-//	unsigned int buf[512];
-//	char *cbuf = (char*)buf;
-//	uint n = sizeof(buf);
-//	uint off = 0, r, i;
-//	uint a = 1, b = 0;
-//	memset((void*)cbuf, 0, n);
-//	unsigned int *bp;
-//
-//	while((r = readi(ip, cbuf, off, n)) > 0) {
-//		off += r;
-//		bp = (unsigned int *)buf;
-//		for(i = 0; i< sizeof(buf) / sizeof(uint); i++) {
-//			// Adler_32 algorithm
-//			a = (a + *bp) % MOD_ADLER;
-//			b = (b + a) % MOD_ADLER;
+// Claim the lowest free inode number; 0 if there is none.
+static uint imaptake (struct mount *mp)
+{
+    uint inum;
+
+    acquire(&mp->imap.lock);
+
+    for (inum = mp->imap.hint; mp->imap.nfree > 0 && inum < mp->sb.ninodes; inum++) {
+        if (inum % 8 == 0 && mp->imap.used[inum / 8] == 0xff) {  // skip full bytes
+            inum += 7;
+            continue;
+        }
+
+        if ((mp->imap.used[inum / 8] & (1 << (inum % 8))) == 0) {
+            mp->imap.used[inum / 8] |= 1 << (inum % 8);
+            mp->imap.nfree--;
+            mp->imap.hint = inum + 1;
+            release(&mp->imap.lock);
+            return inum;
+        }
+    }
+
+    mp->imap.hint = mp->sb.ninodes;
+    release(&mp->imap.lock);
+    return 0;
+}
+
+// Return inode inum to the map.
+static void imapfree (struct mount *mp, uint inum)
+{
+    acquire(&mp->imap.lock);
+
+    if ((mp->imap.used[inum / 8] & (1 << (inum % 8))) == 0) {
+        panic("imapfree: free inode");
+    }
+
+    mp->imap.used[inum / 8] &= ~(1 << (inum % 8));
+    mp->imap.nfree++;
+    if (inum < mp->imap.hint) {
+        mp->imap.hint = inum;
+    }
+
+    release(&mp->imap.lock);
+}
+
+static uint ihash (uint dev, uint inum)
+{
+    return (inum ^ (dev << 24)) % IHASHSIZE;
+}
+
+// Unlink ip from the chain of the inode it used to cache.
+static void iunhash (struct inode *ip)
+{
+    struct inode **pp;
+
+    if (ip->dev == -1) {  // never hashed
+        return;
+    }
+
+    for (pp = &icache.hash[ihash(ip->dev, ip->inum)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == ip) {
+            *pp = ip->hnext;
+            break;
+        }
+    }
+
+    ip->hnext = 0;
+}
+
+// Put an unreferenced ip at the head of the LRU list.
+static void ilruadd (struct inode *ip)
+{
+    ip->next = icache.lru.next;
+    ip->prev = &icache.lru;
+    icache.lru.next->prev = ip;
+    icache.lru.next = ip;
+}
+
+static void ilrudel (struct inode *ip)
+{
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+}
+
+// Set up the inode cache with 1/IMEMDIV of free memory, but
+// at least NINODE entries.  Must run after kinit2().
+void iinit (void)
+{
+    struct inode *ip;
+    char *page;
+    uint i, n;
+
+    initlock(&icache.lock, "icache");
+    dcinit();
+    icache.lru.next = &icache.lru;
+    icache.lru.prev = &icache.lru;
+
+    n = kfreepages() / IMEMDIV * (PGSIZE / sizeof(struct inode));
+    if (n < NINODE) {
+        n = NINODE;
+    }
+    if (n > MAXINODES) {
+        n = MAXINODES;
+    }
+
+    while (icache.ninode < n) {
+        if ((page = kalloc()) == 0) {
+            panic("iinit: out of memory");
+        }
+
+        memset(page, 0, PGSIZE);
+        ip = (struct inode*) page;
+
+        for (i = 0; i < PGSIZE / sizeof(struct inode); i++, ip++) {
+            ip->dev = -1;
+            ilruadd(ip);
+            icache.ninode++;
+        }
+    }
+
+    cprintf("iinit: %d inodes cached\n", icache.ninode);
+    dainit();
+    zinit();
+}
+
+struct inode* iget (uint dev, uint inum);
+
+//PAGEBREAK!
+// Allocate a new inode with the given type on device dev.
+// A free inode has a type of zero.
+struct inode* ialloc (uint dev, short type)
+{
+    uint inum;
+    struct buf *bp;
+    struct dinode *dip;
+    struct mount *mp;
+
+    mp = getmount(dev);
+    if ((inum = imaptake(mp)) == 0) {
+        panic("ialloc: no inodes");
+    }
+
+    bp = bread(dev, MIBLOCK(mp, inum));
+    dip = (struct dinode*) bp->data + inum % IPB;
+
+    if (dip->type != 0) {
+        panic("ialloc: imap out of date");
+    }
+
+    bcow(bp);
+    dip = (struct dinode*) bp->data + inum % IPB;
+    memset(dip, 0, sizeof(*dip));
+    dip->type = type;
+    // New files and directories keep their content in the inode
+    // until it outgrows NINLINE bytes.  Ditto replicas are
+    // always extent-mapped.
+    if (type == T_FILE || type == T_DIR) {
+        dip->iflags = IF_INLINE;
+    } else if (type == T_DITTO) {
+        dip->iflags = IF_EXTENT;
+    }
+    log_write(bp);   // mark it allocated on the disk
+    brelse(bp);
+    return iget(dev, inum);
+}
+
+// compute inode checksum
+// Adler_32 algorithm
+//const int MOD_ADLER = 65521;
+//uint ichecksum(struct inode *ip)
+//{
+//	// do not compute device
+//	if (ip->type == T_DEV)
+//		return 0;
+//
+//	unsigned int buf[512];
+//	char *cbuf = (char*)buf;
+//	uint n = sizeof(buf);
+//	uint off = 0, r, i;
+//	uint a = 1, b = 0;
+//	memset((void*)cbuf, 0, n);
+//	unsigned int *bp;
+//
+//	while((r = readi(ip, cbuf, off, n)) > 0) {
+//		off += r;
+//		bp = (unsigned int *)buf;
+//		for(i = 0; i< sizeof(buf) / sizeof(uint); i++) {
+//			// Adler_32 algorithm
+//			a = (a + *bp) % MOD_ADLER;
+//			b = (b + a) % MOD_ADLER;
 //			bp++;
 //		}
 //		memset((void *)cbuf, 0, n);
@@ -246,6 +967,22 @@ struct inode* ialloc (uint dev, short type)
 //}
 
 
+// The checksum is the XOR of the content as 32-bit words, so
+// the change from rewriting one block is the XOR of its words
+// before and after.
+static uint
+blockxor(struct buf *bp)
+{
+    uint *w, x;
+
+    x = 0;
+    for (w = (uint*) bp->data; w < (uint*) (bp->data + BSIZE); w++) {
+        x ^= *w;
+    }
+
+    return x;
+}
+
 uint
 ichecksum(struct inode *ip){
 
@@ -276,7 +1013,51 @@ ichecksum(struct inode *ip){
 }
 
 
+// The XOR of the words of ip's content from off, a multiple of
+// BSIZE, to its size, as ichecksum() sums them.
+static uint ixorfrom (struct inode *ip, uint off)
+{
+    uint buf[BSIZE / sizeof(uint)];
+    uint x, r, i;
+
+    x = 0;
+
+    while ((r = readi(ip, (char*) buf, off, sizeof(buf))) > 0) {
+        memset((char*) buf + r, 0, sizeof(buf) - r);
+        for (i = 0; i < BSIZE / sizeof(uint); i++) {
+            x ^= buf[i];
+        }
+        off += r;
+    }
+
+    return x;
+}
+
+// What ip's checksum changes by when its content grows from
+// size old to ip->size and nothing before old changes.  Only the
+// block old is in and those after it are read.
+static uint ixorgrow (struct inode *ip, uint old)
+{
+    uint size, x;
+
+    size = ip->size;
+    x = ixorfrom(ip, old - old % BSIZE);
+    ip->size = old;
+    x ^= ixorfrom(ip, old - old % BSIZE);
+    ip->size = size;
+
+    return x;
+}
+
+// Disk inode updates written and skipped because nothing
+// changed, for fsstat().  Not locked; the counts are advisory.
+static struct {
+	uint nwrite;
+	uint nskip;
+} iupdates;
+
 // Copy a modified in-memory inode to disk.
+// An update that would not change the disk inode is skipped.
 void iupdate (struct inode *ip)
 {
 	iupdate_ext(ip, 0);
@@ -285,32 +1066,66 @@ void iupdate (struct inode *ip)
 void iupdate_ext(struct inode *ip, uint skip)
 {
 	struct buf *bp;
-	struct dinode *dip;
+	struct dinode *dip, new;
+	uint size;
 
-	// IBLOCK find block based on inode number (inum)
+	// MIBLOCK find block based on inode number (inum)
 	// bread read this buffer block
-	bp = bread(ip->dev, IBLOCK(ip->inum));
+	bp = bread(ip->dev, MIBLOCK(getmount(ip->dev), ip->inum));
 
-	// find disk inode and then update
+	// find disk inode and build its new image
 	dip = (struct dinode *)bp->data + ip->inum % IPB;
-	dip->type = ip->type;
-	dip->major = ip->major;
-	dip->minor = ip->minor;
-	dip->nlink = ip->nlink;
-	dip->size = ip->size;
+	new = *dip;
+	new.type = ip->type;
+	new.major = ip->major;
+	new.minor = ip->minor;
+	new.nlink = ip->nlink;
 	// ext
-	dip->child1 = ip->child1;
-	dip->child2 = ip->child2;
-	ip->checksum = ichecksum(ip);
-//	if (ip->checksum != dip->checksum) {
-//		cprintf("update checksum of inode %d from %x to %x.\n", ip->inum, dip->checksum, ip->checksum);
-//	}
-	dip->checksum = ip->checksum;
-	memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-	// dbgprint("before log_write");
+	new.child1 = ip->child1;
+	new.child2 = ip->child2;
+
+	// Blocks waiting for delayed allocation are not on disk,
+	// so the disk inode's size and checksum stop short of them.
+	size = ip->size;
+	if (ip->ndelalloc > 0) {
+		ip->size = dadisksize(ip);
+	}
+	// writei keeps a directory's checksum up to date block by
+	// block, so adding a name does not read the whole directory.
+	// Other content is summed again only if it changed.
+	if (skip || (ip->type != T_DIR && ip->cdirty)) {
+		ip->checksum = ichecksum(ip);
+		ip->cdirty = 0;
+	} else if (ip->type == T_FILE && !IRECORDS(ip) && ip->size > ip->csize) {
+		// Only content past what the checksum covers was
+		// written, such as blocks daflush() just put on disk:
+		// sum just that.
+		ip->checksum ^= ixorgrow(ip, ip->csize);
+	}
+	ip->csize = ip->size;
+	new.size = ip->size;
+	ip->size = size;
+	new.checksum = ip->checksum;
+	new.iflags = ip->iflags;
+	new.recblks = ip->recblks;
+	memmove(new.addrs, ip->addrs, sizeof(ip->addrs));
+
+	// Nothing persistent changed: leave the block out of the
+	// log, and the ditto children, which copy the parent's
+	// size and checksum, are up to date too.
+	if (memcmp(&new, dip, sizeof(new)) == 0) {
+		brelse(bp);
+		iupdates.nskip++;
+		return;
+	}
+
+	new.gen = ip->gen = dip->gen + 1;
+	bcow(bp);
+	dip = (struct dinode *)bp->data + ip->inum % IPB;
+	*dip = new;
 	log_write(bp);
-	// dbgprint("after log_write");
 	brelse(bp);
+	iupdates.nwrite++;
 
 	// update children
 	if (skip == 0) {
@@ -319,7 +1134,6 @@ void iupdate_ext(struct inode *ip, uint skip)
 	}
 }
 
-// update child inode
 void cupdate(struct inode *ip, struct inode *ic)
 {
 	ilock_ext(ic, 0);
@@ -331,12 +1145,14 @@ void cupdate(struct inode *ip, struct inode *ic)
 	struct buf *bp;
 	struct dinode *dic;
 
-	bp = bread(ic->dev, IBLOCK(ic->inum));
+	bp = bread(ic->dev, MIBLOCK(getmount(ic->dev), ic->inum));
+	bcow(bp);
 	dic = (struct dinode *)bp->data + ic->inum % IPB;
 	dic->type = ic->type;
 	dic->major = ic->major;
 	dic->minor = ic->minor;
 	dic->nlink = 1;  // this is 1
+	ic->nlink = 1;  // so that dropping the reference does not free it
 	ic->size = ip->size;  // get size from ip, parent
 	dic->size = ic->size;
 	dic->child1 = ic->child1;
@@ -349,7 +1165,9 @@ void cupdate(struct inode *ip, struct inode *ic)
 	// dbgprint("after log_write");
 	brelse(bp);
 
-	iunlock(ic);
+	// ic came from iget(): drop the reference, or the inode stays
+	// busy and its disk can never be unmounted.
+	iunlockput(ic);
 }
 
 // Find the inode with number inum on device dev
@@ -357,40 +1175,80 @@ void cupdate(struct inode *ip, struct inode *ic)
 // the inode and does not read it from disk.
 struct inode* iget (uint dev, uint inum)
 {
-    struct inode *ip, *empty;
+    struct inode *ip;
+    uint h;
 
     acquire(&icache.lock);
 
     // Is the inode already cached?
-    empty = 0;
+    h = ihash(dev, inum);
 
-    for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    for (ip = icache.hash[h]; ip; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum) {
+            if (ip->ref == 0) {
+                ilrudel(ip);
+            }
             ip->ref++;
             release(&icache.lock);
             return ip;
         }
-
-        if (empty == 0 && ip->ref == 0) {   // Remember empty slot.
-            empty = ip;
-        }
     }
 
-    // Recycle an inode cache entry.
-    if (empty == 0) {
+    // Recycle the least recently used inode cache entry.
+    ip = icache.lru.prev;
+    if (ip == &icache.lru) {
         panic("iget: no inodes");
     }
 
-    ip = empty;
+    ilrudel(ip);
+    iunhash(ip);
     ip->dev = dev;
     ip->inum = inum;
     ip->ref = 1;
     ip->flags = 0;
+    ip->hnext = icache.hash[h];
+    icache.hash[h] = ip;
     release(&icache.lock);
 
     return ip;
 }
 
+// Drop the cached inodes and names of dev, which is being
+// unmounted.  Fails if any of its inodes is still in use.
+int idevrelease (uint dev)
+{
+    struct inode *ip, **pp;
+    uint h;
+
+    acquire(&icache.lock);
+    for (h = 0; h < IHASHSIZE; h++) {
+        for (ip = icache.hash[h]; ip; ip = ip->hnext) {
+            if (ip->dev == dev && ip->ref > 0) {
+                release(&icache.lock);
+                return -1;
+            }
+        }
+    }
+
+    for (h = 0; h < IHASHSIZE; h++) {
+        for (pp = &icache.hash[h]; (ip = *pp) != 0; ) {
+            if (ip->dev == dev) {
+                *pp = ip->hnext;
+                ip->hnext = 0;
+                ip->dev = -1;
+                ip->flags = 0;
+            } else {
+                pp = &ip->hnext;
+            }
+        }
+    }
+    release(&icache.lock);
+
+    dcpurge(dev, 0);
+    zcpurge(dev, 0);
+    return 0;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode* idup (struct inode *ip)
@@ -420,6 +1278,9 @@ int ilock_trans(struct inode *ip)
 	if (r == E_CORRUPTED)  // failure
 		return E_CORRUPTED;
 
+	if (r > 0 && ISSNAPDEV(ip->dev))  // read-only, cannot rescue
+		return E_CORRUPTED;
+
 	if (r > 0) {  // replica inode
 		ic = iget(ip->dev, r);
 		irescue(ip, ic);  // try to rescue
@@ -433,6 +1294,53 @@ int ilock_trans(struct inode *ip)
 	panic("ilock_trans attempted to recover but still failed");
 }
 
+// Lock ip in shared mode, for reading only.  An inode that
+// is not valid yet is read and verified under the exclusive
+// lock (ilock_trans if trans is set, else ilock), which is
+// then downgraded.  Returns what that call returned.
+static int ilock_shared_ext (struct inode *ip, int trans)
+{
+	int r;
+
+	if (ip == 0 || ip->ref < 1) {
+		panic("ilock_shared");
+	}
+
+	acquire(&icache.lock);
+	while ((ip->flags & I_BUSY) || ip->wwait > 0) {
+		sleep(ip, &icache.lock);
+	}
+
+	if (ip->flags & I_VALID) {
+		ip->readers++;
+		release(&icache.lock);
+		return 0;
+	}
+
+	release(&icache.lock);
+
+	if ((r = trans ? ilock_trans(ip) : ilock(ip)) != 0) {
+		return r;
+	}
+
+	acquire(&icache.lock);
+	ip->flags &= ~I_BUSY;
+	ip->readers++;
+	wakeup(ip);
+	release(&icache.lock);
+	return 0;
+}
+
+int ilock_shared (struct inode *ip)
+{
+	return ilock_shared_ext(ip, 0);
+}
+
+int ilock_shared_trans (struct inode *ip)
+{
+	return ilock_shared_ext(ip, 1);
+}
+
 int ilock_ext(struct inode *ip, int checksum)
 {
 	struct buf *bp;
@@ -443,16 +1351,18 @@ int ilock_ext(struct inode *ip, int checksum)
 	}
 
 	acquire(&icache.lock);
-	while (ip->flags & I_BUSY) {
+	ip->wwait++;  // hold off new readers
+	while ((ip->flags & I_BUSY) || ip->readers > 0) {
 		sleep(ip, &icache.lock);
 	}
 
+	ip->wwait--;
 	ip->flags |= I_BUSY;
 	release(&icache.lock);
 
 	// read inode from disk if not valid
 	if (!(ip->flags & I_VALID)) {
-		bp = bread(ip->dev, IBLOCK(ip->inum));
+		bp = bread(ip->dev, MIBLOCK(getmount(ip->dev), ip->inum));
 		dip = (struct dinode*) bp->data + ip->inum % IPB;
 		ip->type = dip->type;
 		ip->major = dip->major;
@@ -462,7 +1372,15 @@ int ilock_ext(struct inode *ip, int checksum)
 		ip->child1 = dip->child1;
 		ip->child2 = dip->child2;
 		ip->checksum = dip->checksum;
+		ip->iflags = dip->iflags;
+		ip->gen = dip->gen;
+		ip->recblks = dip->recblks;
 		memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+		ip->cdirty = 0;
+		ip->csize = ip->size;
+		ip->ecache.len = 0;
+		ip->indblk = 0;
+		ip->ndelalloc = 0;
 		brelse(bp);
 
 		uint replica = REPLICA_SELF;
@@ -477,6 +1395,9 @@ i_verify:
 		if (ichecksum(ip) == ip->checksum) {
 			goto i_success;
 		}
+		else if (replica == REPLICA_SELF && irepair(ip)) {
+			goto i_success;
+		}
 		else {
 			replica++;
 
@@ -537,343 +1458,2551 @@ i_success:
 // Unlock the given inode.
 void iunlock (struct inode *ip)
 {
-    if (ip == 0 || !(ip->flags & I_BUSY) || ip->ref < 1) {
+    if (ip == 0 || (!(ip->flags & I_BUSY) && ip->readers == 0) || ip->ref < 1) {
         panic("iunlock");
     }
 
     acquire(&icache.lock);
-    ip->flags &= ~I_BUSY;
+    if (ip->flags & I_BUSY) {
+        ip->flags &= ~I_BUSY;
+    } else {
+        ip->readers--;
+    }
     wakeup(ip);
     release(&icache.lock);
 }
 
-// Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
-// If that was the last reference and the inode has no links
-// to it, free the inode (and its content) on disk.
-void iput (struct inode *ip)
+// Drop a reference to an in-memory inode.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list and can be recycled.
+// If that was the last reference and the inode has no links
+// to it, free the inode (and its content) on disk.
+void iput (struct inode *ip)
+{
+    acquire(&icache.lock);
+
+    if (ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0) {
+        // inode has no links: truncate and free inode.
+        if (ip->flags & I_BUSY) {
+            panic("iput busy");
+        }
+
+        ip->flags |= I_BUSY;
+        release(&icache.lock);
+        if (ip->type == T_DIR) {
+            dcpurge(ip->dev, ip->inum);
+        }
+        itrunc(ip);
+        ip->type = 0;
+        iupdate(ip);
+        imapfree(getmount(ip->dev), ip->inum);
+
+        acquire(&icache.lock);
+        ip->flags = 0;
+        wakeup(ip);
+    } else if (ip->ref == 1 && ip->ndelalloc > 0) {
+        // last reference: write out delayed blocks.
+        if (ip->flags & I_BUSY) {
+            panic("iput busy");
+        }
+
+        ip->flags |= I_BUSY;
+        release(&icache.lock);
+        daflush(ip, -1);
+        iupdate(ip);
+
+        acquire(&icache.lock);
+        ip->flags &= ~I_BUSY;
+        wakeup(ip);
+    }
+
+    if (--ip->ref == 0) {
+        ilruadd(ip);
+    }
+    release(&icache.lock);
+}
+
+// Common idiom: unlock, then put.
+void iunlockput (struct inode *ip)
+{
+    iunlock(ip);
+    iput(ip);
+}
+
+// Copy from replica inode to parent
+void irescue(struct inode *ip, struct inode *rinode)
+{
+	int max = ((LOGSIZE/snapcost()-1-1-2) / 4) * 512;
+	int i = 0;
+	int n, n1;
+	uint off = 0;
+
+	ilock_ext(rinode, 0);
+	ilock_ext(ip, 0);
+
+	n = ip->size;
+
+	while (i < n) {
+		n1 = n - i;
+		if (n1 > max)
+			n1 = max;
+
+		begin_op();
+		iduplicate(rinode, ip, off, n1);
+		end_op();
+
+		off += n1;
+		i += n1;
+	}
+
+	iunlock(rinode);
+	iunlock(ip);
+}
+
+// Copy size, checksum, and inode data from source to dest
+// MUST BE SURROUNDED BY A TRANSACTION!
+void iduplicate(struct inode *src, struct inode *dst, uint off, uint tot)
+{
+	char buf[512];
+	uint n = sizeof(buf);
+	memset((void *)buf, 0, n);
+	uint r;
+	uint coff = off;
+
+	dst->checksum = src->checksum;
+	dst->size = src->size;
+
+	while (((r = readi(src, buf, off, n)) > 0) && (off < (tot + coff))) {
+		writei_ext(dst, buf, off, r, 1);
+		off += r;
+		memset((void *)buf, 0, n);
+	}
+}
+
+//PAGEBREAK!
+// Inode content
+//
+// The content (data) associated with each inode is stored
+// in blocks on the disk. The first NDIRECT block numbers
+// are listed in ip->addrs[].  The next NINDIRECT blocks are
+// listed in block ip->addrs[NDIRECT], the NDINDIRECT after
+// that under the double indirect block ip->addrs[NDIRECT+1],
+// and the rest under the triple indirect block ip->addrs[NDIRECT+2].
+//
+// A block number of 0 is a hole, left by writing past the end
+// of the file: it reads as zeros and gets a block when written.
+//
+// Regular files and their ditto replicas are mapped by extents
+// instead (IF_EXTENT, see fs.h), so they can grow to the size
+// of the disk and a sequential file needs only a few entries.
+
+// Index of the last of the n entries in e whose lblk is <= bn,
+// or -1 if bn is before all of them.
+static int esearch (struct extent *e, int n, uint bn)
+{
+    int lo, hi, mid, r;
+
+    r = -1;
+    lo = 0;
+    hi = n - 1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+
+        if (e[mid].lblk <= bn) {
+            r = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return r;
+}
+
+// Look up file block bn of an extent-mapped inode.
+// Returns 0 if bn is not mapped, and then sets *goal to the
+// disk block that would extend the extent before bn.
+static uint elookup (struct inode *ip, uint bn, uint *goal)
+{
+    struct extenthdr *h;
+    struct extent *e;
+    struct buf *bp;
+    uint addr, child;
+    int i;
+
+    if (bn - ip->ecache.lblk < ip->ecache.len) {
+        return ip->ecache.pblk + (bn - ip->ecache.lblk);
+    }
+
+    bp = 0;
+    h = (struct extenthdr*) ip->addrs;
+
+    for (;;) {
+        e = EXTENTS(h);
+        i = esearch(e, h->nent, bn);
+
+        if (h->depth == 0 || h->nent == 0) {
+            break;
+        }
+
+        child = e[i < 0 ? 0 : i].pblk;
+
+        if (bp) {
+            brelse(bp);
+        }
+
+        bp = bread(ip->dev, child);
+        h = (struct extenthdr*) bp->data;
+    }
+
+    addr = 0;
+    *goal = 0;
+
+    if (i >= 0) {
+        if (bn - e[i].lblk < e[i].len) {
+            if (ip->flags & I_BUSY) {  // readers must not race on it
+                ip->ecache = e[i];
+            }
+            addr = e[i].pblk + (bn - e[i].lblk);
+        } else {
+            *goal = e[i].pblk + (bn - e[i].lblk);
+        }
+    }
+
+    if (bp) {
+        brelse(bp);
+    }
+
+    return addr;
+}
+
+// Put entry x at index i of node h, which has room.
+static void eput (struct extenthdr *h, int i, struct extent *x)
+{
+    struct extent *e;
+
+    e = EXTENTS(h);
+    memmove(e + i + 1, e + i, (h->nent - i) * sizeof(*e));
+    e[i] = *x;
+    h->nent++;
+}
+
+// Put entry x at index i of node h, making room if h is full.
+// A full root moves all its entries down into a new node and
+// becomes an index one level higher; any other full node is
+// split in half.  Returns 1 after a split, with *split set to
+// the index entry for the new right half.
+static int eadd (struct inode *ip, struct extenthdr *h, int i,
+                 struct extent *x, struct extent *split)
+{
+    struct extenthdr *nh;
+    struct extent *e;
+    struct buf *bp;
+    int isroot, k;
+    uint nb;
+
+    isroot = (h == (struct extenthdr*) ip->addrs);
+
+    if (h->nent < (isroot ? NEXTROOT : NEXTNODE)) {
+        eput(h, i, x);
+        return 0;
+    }
+
+    e = EXTENTS(h);
+    nb = balloc(ip->dev, 0);
+    bp = bread(ip->dev, nb);
+    bcow(bp);
+    nh = (struct extenthdr*) bp->data;
+
+    k = isroot ? 0 : h->nent / 2;
+    nh->depth = h->depth;
+    nh->nent = h->nent - k;
+    memmove(EXTENTS(nh), e + k, nh->nent * sizeof(*e));
+    h->nent = k;
+
+    if (i < k) {
+        eput(h, i, x);
+    } else {
+        eput(nh, i - k, x);
+    }
+
+    split->lblk = EXTENTS(nh)[0].lblk;
+    split->pblk = nb;
+    split->len = 0;
+    log_write(bp);
+    brelse(bp);
+
+    if (isroot) {
+        h->depth++;
+        eput(h, 0, split);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Add the extent x, which must not overlap a mapped block, to the
+// subtree under node h, which lives in bp (0 for the root in
+// ip->addrs).  x is merged into the extent it continues if it can,
+// except in a record file, which keeps one extent per record.
+// Returns 1 if h was split; see eadd().
+static int einsert (struct inode *ip, struct buf *bp, struct extenthdr *h,
+                    struct extent *x, struct extent *split)
+{
+    struct extent *e, csplit;
+    struct buf *cbp;
+    int i, r, dirty;
+
+    e = EXTENTS(h);
+    i = esearch(e, h->nent, x->lblk);
+    r = 0;
+    dirty = 1;
+
+    if (h->depth == 0) {
+        if (i >= 0 && !IRECORDS(ip) &&
+            e[i].lblk + e[i].len == x->lblk && e[i].pblk + e[i].len == x->pblk) {
+            e[i].len += x->len;
+            ip->ecache = e[i];
+        } else {
+            if (!(x->len & EXT_FLAGS)) {
+                ip->ecache = *x;
+            }
+            r = eadd(ip, h, i + 1, x, split);
+        }
+    } else {
+        dirty = 0;
+
+        // x goes in front of every entry: it becomes
+        // the first block of the leftmost subtree.
+        if (i < 0) {
+            i = 0;
+            e[0].lblk = x->lblk;
+            dirty = 1;
+        }
+
+        cbp = bread(ip->dev, e[i].pblk);
+        bcow(cbp);
+
+        if (einsert(ip, cbp, (struct extenthdr*) cbp->data, x, &csplit)) {
+            r = eadd(ip, h, i + 1, &csplit, split);
+            dirty = 1;
+        }
+
+        brelse(cbp);
+    }
+
+    if (bp && dirty) {
+        log_write(bp);
+    }
+
+    return r;
+}
+
+// Log blocks that freeing one more run can take: its bitmap
+// block, a snapshot's dead list block and the block and bitmap
+// block snapalloc() may add to it, or a dedup table bucket.
+#define ETRIMCOST 4
+
+// Free the blocks mapped by the *n entries at e, and the tree
+// nodes below them if they are index entries of the given depth,
+// from the end: runs and *n shrink as their blocks go, so what is
+// left is always a valid tree.  Stops once the transaction's log
+// count for the device passes limit, having freed something.
+// Returns 1 when all are freed, 0 when out of room.
+static int etrim (struct inode *ip, struct extent *e, ushort *n, int depth,
+                  int limit, int *nfreed)
+{
+    struct extenthdr *h;
+    struct extent *x;
+    struct buf *bp;
+    int done;
+
+    while (*n > 0) {
+        x = &e[*n - 1];
+
+        if (depth > 0) {
+            bp = bread(ip->dev, x->pblk);
+            bcow(bp);
+            h = (struct extenthdr*) bp->data;
+            done = etrim(ip, EXTENTS(h), &h->nent, h->depth, limit, nfreed);
+            log_write(bp);
+            brelse(bp);
+
+            if (!done) {
+                return 0;
+            }
+        } else if ((x->len & ~EXT_FLAGS) > 0 && ip->size > x->lblk * BSIZE) {
+            ip->size = x->lblk * BSIZE;
+        }
+
+        while (depth == 0 && (x->len & ~EXT_FLAGS) > 0) {
+            if (*nfreed > 0 && logn(ip->dev) > limit) {
+                return 0;
+            }
+
+            (*nfreed)++;
+
+            if (x->len & EXT_DDT) {
+                ddtunref(ip->dev, x->pblk, x->len & ~EXT_FLAGS);
+                x->len = 0;
+            } else {
+                x->len--;
+                bfree(ip->dev, x->pblk + (x->len & ~EXT_FLAGS));
+            }
+        }
+
+        if (depth > 0) {
+            if (*nfreed > 0 && logn(ip->dev) > limit) {
+                return 0;
+            }
+
+            (*nfreed)++;
+            bfree(ip->dev, x->pblk);
+        }
+
+        (*n)--;
+    }
+
+    return 1;
+}
+
+// Return entry i of indirect block addr, allocating a block
+// for it if it is empty and alloc is set.
+static uint bindirect (struct inode *ip, uint addr, uint i, int alloc)
+{
+    struct buf *bp;
+    uint *a;
+
+    bp = bread(ip->dev, addr);
+    a = (uint*) bp->data;
+
+    if ((addr = a[i]) == 0 && alloc) {
+        addr = balloc(ip->dev, 0);
+        bcow(bp);
+        a = (uint*) bp->data;
+        a[i] = addr;
+        log_write(bp);
+    }
+
+    brelse(bp);
+    return addr;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+static uint bmap (struct inode *ip, uint bn)
+{
+    return bmap_ext(ip, bn, 1);
+}
+
+// Like bmap, but if alloc is 0 a block that is not there,
+// a hole, is returned as 0 and nothing is allocated.
+static uint bmap_ext (struct inode *ip, uint bn, int alloc)
+{
+    uint addr, goal, lbn, span;
+    struct extent x, split;
+    int level;
+
+    if (ip->iflags & IF_EXTENT) {
+        if ((addr = elookup(ip, bn, &goal)) == 0 && alloc) {
+            x.lblk = bn;
+            x.pblk = addr = balloc(ip->dev, goal);
+            x.len = 1;
+            einsert(ip, 0, (struct extenthdr*) ip->addrs, &x, &split);
+        }
+
+        return addr;
+    }
+
+    if (bn < NDIRECT) {
+        if ((addr = ip->addrs[bn]) == 0 && alloc) {
+            ip->addrs[bn] = addr = balloc(ip->dev, 0);
+        }
+
+        return addr;
+    }
+
+    // Sequential access stays within one single indirect
+    // block for NINDIRECT blocks; skip the chain above it.
+    if (ip->indblk != 0 && bn - ip->indbase < NINDIRECT) {
+        return bindirect(ip, ip->indblk, bn - ip->indbase, alloc);
+    }
+
+    // Find the level of indirection that maps bn.
+    lbn = bn - NDIRECT;
+    span = NINDIRECT;
+
+    for (level = 0; lbn >= span; level++) {
+        if (level == 2) {
+            panic("bmap: out of range");
+        }
+
+        lbn -= span;
+        span *= NINDIRECT;
+    }
+
+    // Load the top indirect block, allocating if necessary,
+    // and walk down to the single indirect block.
+    if ((addr = ip->addrs[NDIRECT + level]) == 0) {
+        if (!alloc) {
+            return 0;
+        }
+
+        ip->addrs[NDIRECT + level] = addr = balloc(ip->dev, 0);
+    }
+
+    for (; level > 0; level--) {
+        span /= NINDIRECT;
+
+        if ((addr = bindirect(ip, addr, lbn / span, alloc)) == 0) {
+            return 0;
+        }
+
+        lbn %= span;
+    }
+
+    if (ip->flags & I_BUSY) {  // readers must not race on the hint
+        ip->indblk = addr;
+        ip->indbase = bn - lbn;
+    }
+    return bindirect(ip, addr, lbn, alloc);
+}
+
+// Free indirect block addr and the blocks it lists, which are
+// themselves indirect blocks if level > 0.
+static void ifree (struct inode *ip, uint addr, int level)
+{
+    struct buf *bp;
+    uint *a;
+    int j;
+
+    bp = bread(ip->dev, addr);
+    a = (uint*) bp->data;
+
+    for (j = 0; j < NINDIRECT; j++) {
+        if (a[j] == 0) {
+            continue;
+        }
+
+        if (level > 0) {
+            ifree(ip, a[j], level - 1);
+        } else {
+            bfree(ip->dev, a[j]);
+        }
+    }
+
+    brelse(bp);
+    bfree(ip->dev, addr);
+}
+
+//PAGEBREAK!
+// Delayed allocation.
+//
+// writei() does not allocate disk blocks for new blocks of a
+// regular file.  Their data waits in a delalloc buffer tagged
+// with the inode and file block, and only the in-memory inode
+// knows about them: the disk inode's size stops at the first
+// one (see iupdate_ext).  When the inode has MAXDELALLOC of
+// them, or loses its last reference, daflush() gives each run
+// of consecutive waiting blocks one contiguous run of disk
+// blocks.  So small appends from concurrent writers do not
+// interleave on disk, and the blocks are never zeroed, since
+// they are written whole.  The last end_op() of a transaction
+// group calls dasync() to do the same for every file before it
+// commits, so that a write that has returned is on disk, and in
+// a snapshot, once the commit is.
+//
+// A delalloc buffer is only used under its inode's lock.
+// delalloc.lock protects the ip fields.
+
+struct dabuf {
+    struct inode *ip;  // owner, or 0 if free
+    uint lbn;          // file block
+    uchar data[BSIZE];
+};
+
+struct {
+    struct spinlock lock;
+    struct dabuf buf[NDELALLOC];
+} delalloc;
+
+static void dainit (void)
+{
+    initlock(&delalloc.lock, "delalloc");
+}
+
+// Return ip's delalloc buffer for file block bn, or 0.
+static struct dabuf* dafind (struct inode *ip, uint bn)
+{
+    struct dabuf *d;
+
+    acquire(&delalloc.lock);
+
+    for (d = delalloc.buf; d < delalloc.buf + NDELALLOC; d++) {
+        if (d->ip == ip && d->lbn == bn) {
+            release(&delalloc.lock);
+            return d;
+        }
+    }
+
+    release(&delalloc.lock);
+    return 0;
+}
+
+// Release ip's delalloc buffer d.
+static void dafree (struct inode *ip, struct dabuf *d)
+{
+    acquire(&delalloc.lock);
+    d->ip = 0;
+    release(&delalloc.lock);
+    ip->ndelalloc--;
+}
+
+// Log blocks a run of waiting blocks takes besides its own: its
+// bitmap block, the inode, and a split of an extent tree node,
+// which writes a new node, its bitmap block and the parent.
+#define DARUNCOST 5
+
+// Allocate disk blocks for ip's waiting blocks, lowest file
+// block first, and write them to the log, while the log count of
+// ip's device stays within limit; a limit < 0 means no limit.
+// Returns 1 if all were allocated.  The caller must iupdate() ip
+// afterwards, since its extents have changed.
+static int daflush (struct inode *ip, int limit)
+{
+    struct dabuf *d, *first;
+    struct extent x, split;
+    struct buf *bp;
+    uint b, goal, n, i;
+    int room;
+
+    // The blocks join the part of the file the checksum covers,
+    // which iupdate_ext() extends.
+    while (ip->ndelalloc > 0) {
+        first = 0;
+
+        acquire(&delalloc.lock);
+        for (d = delalloc.buf; d < delalloc.buf + NDELALLOC; d++) {
+            if (d->ip == ip && (first == 0 || d->lbn < first->lbn)) {
+                first = d;
+            }
+        }
+        release(&delalloc.lock);
+
+        for (n = 1; n < ip->ndelalloc && dafind(ip, first->lbn + n); n++)
+            ;
+
+        if (limit >= 0) {
+            room = limit - logn(ip->dev) - DARUNCOST -
+                   ((struct extenthdr*) ip->addrs)->depth;
+            if (room < 1) {
+                return 0;
+            }
+            if (n > room) {
+                n = room;
+            }
+        }
+
+        elookup(ip, first->lbn, &goal);
+        x.lblk = first->lbn;
+        x.pblk = b = ballocrun(ip->dev, goal, &n);
+        x.len = n;
+
+        for (i = 0; i < n; i++) {
+            d = dafind(ip, x.lblk + i);
+            bp = bblank(ip->dev, b + i);
+            memmove(bp->data, d->data, BSIZE);
+            log_write(bp);
+            brelse(bp);
+            dafree(ip, d);
+        }
+
+        einsert(ip, 0, (struct extenthdr*) ip->addrs, &x, &split);
+    }
+
+    return 1;
+}
+
+// Called by end_op() for the last operation of a transaction
+// group, before the commit and with no operation outstanding:
+// allocate the waiting blocks of every file, as an operation of
+// its own.  Waits for readers of an inode.  An inode someone has
+// locked is skipped: the holder is in the middle of a system
+// call, and a later commit covers it.  Returns 0 if the log
+// filled up first; the caller commits and calls again.
+int dasync (void)
+{
+    struct inode *ip;
+    int i, done;
+
+    done = 1;
+
+    for (i = 0; i < NDELALLOC && done; i++) {
+        // Nothing else runs in an operation now, so the inode
+        // keeps its waiting blocks, and a reference with them.
+        acquire(&delalloc.lock);
+        ip = delalloc.buf[i].ip;
+        release(&delalloc.lock);
+
+        if (ip == 0) {
+            continue;
+        }
+
+        acquire(&icache.lock);
+        ip->wwait++;  // hold off new readers
+        while (ip->readers > 0 && !(ip->flags & I_BUSY)) {
+            sleep(ip, &icache.lock);
+        }
+        ip->wwait--;
+
+        if (ip->flags & I_BUSY) {
+            release(&icache.lock);
+            continue;
+        }
+
+        ip->flags |= I_BUSY;
+        release(&icache.lock);
+
+        done = daflush(ip, LOGSIZE / snapcost() - 1);
+        iupdate(ip);
+        iunlock(ip);
+    }
+
+    return done;
+}
+
+// Size of ip's content that is on disk: up to its first
+// waiting block.
+static uint dadisksize (struct inode *ip)
+{
+    struct dabuf *d;
+    uint size;
+
+    size = ip->size;
+
+    acquire(&delalloc.lock);
+    for (d = delalloc.buf; d < delalloc.buf + NDELALLOC; d++) {
+        if (d->ip == ip && d->lbn * BSIZE < size) {
+            size = d->lbn * BSIZE;
+        }
+    }
+    release(&delalloc.lock);
+
+    return size;
+}
+
+// Discard ip's waiting blocks.
+static void dadrop (struct inode *ip)
+{
+    struct dabuf *d;
+
+    acquire(&delalloc.lock);
+    for (d = delalloc.buf; d < delalloc.buf + NDELALLOC; d++) {
+        if (d->ip == ip) {
+            d->ip = 0;
+            ip->ndelalloc--;
+        }
+    }
+    release(&delalloc.lock);
+}
+
+// Return the delalloc buffer to write file block bn of ip into,
+// or 0 if bn must be written in place: it is already on disk,
+// or every delalloc buffer is in use.  Sets *flushed if it had
+// to allocate ip's waiting blocks to make room.
+static struct dabuf* daget (struct inode *ip, uint bn, int *flushed)
+{
+    struct dabuf *d;
+    uint goal;
+
+    if ((d = dafind(ip, bn)) != 0 || elookup(ip, bn, &goal) != 0) {
+        return d;
+    }
+
+    // While there are snapshots, each logged block costs more
+    // (snapcost()), so fewer fit in the writer's operation.
+    if (ip->ndelalloc >= MAXDELALLOC / snapcost()) {
+        daflush(ip, -1);
+        *flushed = 1;
+    }
+
+    for (;;) {
+        acquire(&delalloc.lock);
+
+        for (d = delalloc.buf; d < delalloc.buf + NDELALLOC; d++) {
+            if (d->ip == 0) {
+                d->ip = ip;
+                d->lbn = bn;
+                release(&delalloc.lock);
+                memset(d->data, 0, BSIZE);
+                ip->ndelalloc++;
+                return d;
+            }
+        }
+
+        release(&delalloc.lock);
+
+        if (ip->ndelalloc == 0) {
+            return 0;
+        }
+
+        daflush(ip, -1);
+        *flushed = 1;
+    }
+}
+
+//PAGEBREAK!
+// Record files: compression and dedup.
+//
+// An IF_COMPRESS or IF_DEDUP file is read and written a record
+// (CRECSIZE bytes) at a time, each record mapped by one extent
+// (see fs.h).  Writing part of a record reads it, patches it and
+// stores it again, never in place.  An IF_COMPRESS record is
+// compressed if lzcompress() can save a disk block and stored as
+// it is otherwise; lzcompress() gives up as soon as its output is
+// too long, so incompressible data costs little.  An IF_DEDUP
+// record that is identical to one in the dedup table takes a
+// reference to its blocks (ddt.c) instead of new ones.  Record
+// files never use delayed allocation.
+//
+// Decompressed records are kept in a small cache, so reading a
+// record in pieces decompresses it once.  Writes keep it up to
+// date; truncation and unmount drop the records of the inode or
+// device.
+
+struct zrec {
+    uint dev;           // 0 if the slot is free
+    uint inum;
+    uint rec;           // record number in the file
+    uchar data[CRECSIZE];
+};
+
+struct {
+    struct spinlock lock;
+    uint next;          // slot to replace next
+    struct zrec rec[NZCACHE];
+} zcache;
+
+static void zinit (void)
+{
+    initlock(&zcache.lock, "zcache");
+}
+
+// Copy n bytes at off of record rec of ip to dst if the record
+// is cached.  Returns 0 if it is not.
+static int zcget (struct inode *ip, uint rec, char *dst, uint off, uint n)
+{
+    struct zrec *z;
+
+    acquire(&zcache.lock);
+    for (z = zcache.rec; z < &zcache.rec[NZCACHE]; z++) {
+        if (z->dev == ip->dev && z->inum == ip->inum && z->rec == rec) {
+            memmove(dst, z->data + off, n);
+            release(&zcache.lock);
+            return 1;
+        }
+    }
+    release(&zcache.lock);
+    return 0;
+}
+
+// Cache data as the content of record rec of ip.
+static void zcput (struct inode *ip, uint rec, uchar *data)
+{
+    struct zrec *z;
+
+    acquire(&zcache.lock);
+    for (z = zcache.rec; z < &zcache.rec[NZCACHE]; z++) {
+        if (z->dev == ip->dev && z->inum == ip->inum && z->rec == rec) {
+            break;
+        }
+    }
+
+    if (z == &zcache.rec[NZCACHE]) {
+        z = &zcache.rec[zcache.next];
+        zcache.next = (zcache.next + 1) % NZCACHE;
+    }
+
+    z->dev = ip->dev;
+    z->inum = ip->inum;
+    z->rec = rec;
+    memmove(z->data, data, CRECSIZE);
+    release(&zcache.lock);
+}
+
+// Forget the cached records of inode inum, or of every inode
+// of dev if inum is 0.
+static void zcpurge (uint dev, uint inum)
+{
+    struct zrec *z;
+
+    acquire(&zcache.lock);
+    for (z = zcache.rec; z < &zcache.rec[NZCACHE]; z++) {
+        if (z->dev == dev && (inum == 0 || z->inum == inum)) {
+            z->dev = 0;
+        }
+    }
+    release(&zcache.lock);
+}
+
+// Find the extent of a record file that maps the record
+// starting at file block lblk and copy it to *x.  If nx is not 0,
+// the entry is replaced by *nx.  Returns 0 if the record has no
+// extent, and then sets *goal to the disk block after the one
+// before it.
+static int erecord (struct inode *ip, uint lblk, struct extent *x,
+                    struct extent *nx, uint *goal)
+{
+    struct extenthdr *h;
+    struct extent *e;
+    struct buf *bp;
+    uint child;
+    int i, found;
+
+    bp = 0;
+    h = (struct extenthdr*) ip->addrs;
+
+    for (;;) {
+        e = EXTENTS(h);
+        i = esearch(e, h->nent, lblk);
+
+        if (h->depth == 0 || h->nent == 0) {
+            break;
+        }
+
+        child = e[i < 0 ? 0 : i].pblk;
+
+        if (bp) {
+            brelse(bp);
+        }
+
+        bp = bread(ip->dev, child);
+        h = (struct extenthdr*) bp->data;
+    }
+
+    found = i >= 0 && e[i].lblk == lblk;
+    *goal = 0;
+
+    if (found) {
+        *x = e[i];
+
+        if (nx) {
+            if (bp) {
+                bcow(bp);
+                e = EXTENTS(bp->data);
+            }
+
+            e[i] = *nx;
+
+            if (bp) {
+                log_write(bp);
+            }
+        }
+    } else if (i >= 0) {
+        *goal = e[i].pblk + (e[i].len & ~EXT_FLAGS);
+    }
+
+    if (bp) {
+        brelse(bp);
+    }
+
+    return found;
+}
+
+// Each bitmap block a search for a run looks in is logged, so
+// ballocn() gives up after this many.
+#define NRUNMS 4
+
+// Allocate n contiguous disk blocks, preferably at goal.
+// Returns 0 if no run of n was found in NRUNMS metaslabs.
+static uint ballocn (uint dev, uint goal, uint n)
+{
+    uint b, got, i, ms, nms, tries;
+
+    ms = -1;
+    nms = 0;
+
+    for (tries = 0; tries < getmount(dev)->sb.size; tries++) {
+        got = n;
+        b = ballocrun(dev, goal, &got);
+
+        if (got == n) {
+            return b;
+        }
+
+        // Too short: give it back and look past it.
+        for (i = 0; i < got; i++) {
+            bfreenow(dev, b + i);
+        }
+        goal = 0;
+
+        if (b / BPB != ms) {
+            ms = b / BPB;
+            if (++nms == NRUNMS) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Read record rec of record file ip into data, CRECSIZE
+// bytes, using tmp (CRECSIZE bytes) for its compressed form.
+// A record with no extent, and the part of one past its
+// length, read as zeros.  Returns -1 if the record is corrupt.
+static int zload (struct inode *ip, uint rec, uchar *data, uchar *tmp)
+{
+    struct extent x;
+    struct zhdr *zh;
+    struct buf *bp;
+    uint b, len, goal, bns[CRECBLKS];
+
+    memset(data, 0, CRECSIZE);
+
+    if (!erecord(ip, rec * CRECBLKS, &x, 0, &goal)) {
+        return 0;
+    }
+
+    len = x.len & ~EXT_FLAGS;
+    if (len > CRECBLKS) {
+        return -1;
+    }
+
+    // On a disk set, read the blocks from all the disks at once.
+    if (raidwidth(ip->dev) > 1) {
+        for (b = 0; b < len; b++) {
+            bns[b] = x.pblk + b;
+        }
+        bprefetch(ip->dev, bns, len);
+    }
+
+    for (b = 0; b < len; b++) {
+        bp = bread(ip->dev, x.pblk + b);
+        memmove(((x.len & EXT_ZIP) ? tmp : data) + b * BSIZE, bp->data, BSIZE);
+        brelse(bp);
+    }
+
+    if (x.len & EXT_ZIP) {
+        zh = (struct zhdr*) tmp;
+
+        if (zh->clen > len * BSIZE - sizeof(*zh) || zh->rlen > CRECSIZE ||
+            lzdecompress(tmp + sizeof(*zh), zh->clen, data, zh->rlen) != zh->rlen) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Store the first rlen bytes of data as record rec of record
+// file ip, in place of its old copy.  tmp (CRECSIZE bytes) and
+// tab (LZSCRATCH bytes) are scratch space.  Returns -1, with
+// the old copy left alone, if there is no run of free blocks
+// for the new one.
+static int zstore (struct inode *ip, uint rec, uchar *data, uint rlen,
+                   uchar *tmp, ushort *tab)
+{
+    struct extent x, nx;
+    struct zhdr *zh;
+    struct buf *bp;
+    uchar *src;
+    uint b, n, goal, olen, keep;
+    int clen, old;
+
+    // Compress only if it saves at least one block.
+    n = (rlen + BSIZE - 1) / BSIZE;
+    zh = (struct zhdr*) tmp;
+    clen = -1;
+
+    if ((ip->iflags & IF_COMPRESS) && n > 1) {
+        clen = lzcompress(data, rlen, tmp + sizeof(*zh),
+                          (n - 1) * BSIZE - sizeof(*zh), tab);
+    }
+
+    nx.lblk = rec * CRECBLKS;
+
+    if (clen >= 0) {
+        zh->clen = clen;
+        zh->rlen = rlen;
+        n = (sizeof(*zh) + clen + BSIZE - 1) / BSIZE;
+        memset(tmp + sizeof(*zh) + clen, 0, n * BSIZE - sizeof(*zh) - clen);
+        nx.len = n | EXT_ZIP;
+        src = tmp;
+    } else {
+        nx.len = n;
+        src = data;
+    }
+
+    old = erecord(ip, nx.lblk, &x, 0, &goal);
+    olen = old ? x.len & ~EXT_FLAGS : 0;
+    keep = 0;
+
+    // An unshared old copy with room for the new one is written
+    // over, through the log; else the new copy goes to a new run
+    // after it.  The old blocks left over are let go of last, in
+    // case the record is unchanged or there is no run.
+    if ((ip->iflags & IF_DEDUP) && ddtref(ip->dev, src, n, &nx.pblk)) {
+        nx.len |= EXT_DDT;
+    } else {
+        if (old && !(x.len & EXT_DDT) && olen >= n) {
+            nx.pblk = x.pblk;
+            keep = n;
+        } else if ((nx.pblk = ballocn(ip->dev, old ? x.pblk + olen : goal, n)) == 0) {
+            return -1;
+        }
+
+        for (b = 0; b < n; b++) {
+            bp = bread(ip->dev, nx.pblk + b);
+            bcow(bp);
+            memmove(bp->data, src + b * BSIZE, BSIZE);
+            log_write(bp);
+            brelse(bp);
+        }
+
+        if ((ip->iflags & IF_DEDUP) && ddtadd(ip->dev, src, n, nx.pblk)) {
+            nx.len |= EXT_DDT;
+        }
+    }
+
+    if (old && (x.len & EXT_DDT)) {
+        ddtunref(ip->dev, x.pblk, olen);
+    } else {
+        for (b = keep; b < olen; b++) {
+            bfree(ip->dev, x.pblk + b);
+        }
+    }
+
+    if (old) {
+        erecord(ip, nx.lblk, &x, &nx, &goal);
+    } else {
+        einsert(ip, 0, (struct extenthdr*) ip->addrs, &nx, &x);
+    }
+
+    ip->ecache.len = 0;
+    zcput(ip, rec, data);
+    return 0;
+}
+
+// Read n bytes at off, which are inside the file, from
+// record file ip.  Returns -1 if out of memory or a record
+// is corrupt.
+static int zread (struct inode *ip, char *dst, uint off, uint n)
+{
+    uint tot, m, rec;
+    uchar *page;
+    int r;
+
+    page = 0;
+    r = n;
+
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        rec = off / CRECSIZE;
+        m = min(n - tot, CRECSIZE - off % CRECSIZE);
+
+        if (zcget(ip, rec, dst, off % CRECSIZE, m)) {
+            continue;
+        }
+
+        if ((page == 0 && (page = (uchar*) kalloc()) == 0) ||
+            zload(ip, rec, page, page + CRECSIZE) < 0) {
+            r = -1;
+            break;
+        }
+
+        zcput(ip, rec, page);
+        memmove(dst, page + off % CRECSIZE, m);
+    }
+
+    if (page) {
+        kfree((char*) page);
+    }
+
+    return r;
+}
+
+// Write n bytes at off to record file ip, one record at
+// a time.  Returns -1 if out of memory or disk runs, or if a
+// record being rewritten is corrupt.
+static int zwrite (struct inode *ip, char *src, uint off, uint n)
+{
+    uint tot, m, rec, end;
+    uchar *page;
+    ushort *tab;
+    int r;
+
+    page = (uchar*) kalloc();
+    tab = (ushort*) kalloc();
+    r = page && tab ? 0 : -1;
+
+    end = off + n > ip->size ? off + n : ip->size;
+
+    for (tot = 0; r == 0 && tot < n; tot += m, off += m, src += m) {
+        rec = off / CRECSIZE;
+        m = min(n - tot, CRECSIZE - off % CRECSIZE);
+
+        if (m < CRECSIZE && !zcget(ip, rec, (char*) page, 0, CRECSIZE) &&
+            zload(ip, rec, page, page + CRECSIZE) < 0) {
+            r = -1;
+            break;
+        }
+
+        memmove(page + off % CRECSIZE, src, m);
+        r = zstore(ip, rec, page, min(end - rec * CRECSIZE, CRECSIZE),
+                   page + CRECSIZE, tab);
+    }
+
+    if (tab) {
+        kfree((char*) tab);
+    }
+    if (page) {
+        kfree((char*) page);
+    }
+
+    return r;
+}
+
+//PAGEBREAK!
+// Files with a record size.
+//
+// A regular file whose record size (ip->recblks, see recsize())
+// is more than a block, and that is not IF_COMPRESS or IF_DEDUP,
+// is also kept in records of that many blocks, mapped like those
+// above, but its data moves between the disk and memory around
+// the buffer cache and the log, a page at a time (bdirect()).
+// So a record costs one extent lookup and a few logged metadata
+// blocks whatever its size, and streaming a big file does not
+// push metadata out of the cache.
+//
+// That is safe because a record is never written in place:
+// rstore() writes it to new blocks and the transaction only
+// points its extent at them.  A crash before the commit leaves
+// the old record, as long as the new blocks were free at the last
+// commit; rballoc() makes sure of that.  rstore() keeps the
+// checksum up to date record by record, as writei() does block
+// by block for a directory, so writes do not have it summed again.
+
+#define RCHUNK (PGSIZE / BSIZE)  // blocks a page of scratch holds
+
+// XOR of the n bytes at p as 32-bit words; see blockxor().
+static uint dataxor (uchar *p, uint n)
+{
+    uint *w, x;
+
+    x = 0;
+    for (w = (uint*) p; w < (uint*) (p + n); w++) {
+        x ^= *w;
+    }
+
+    return x;
+}
+
+// Allocate n contiguous disk blocks, preferably at goal, for a
+// record that is written before the transaction commits.  Blocks
+// the transaction freed would still belong to their old owner
+// after a crash, so only blocks that were free at the last commit
+// and that the transaction has not logged will do.  scratch is
+// BSIZE bytes.  Returns 0 if there is no such run in NRUNMS
+// metaslabs.
+static uint rballoc (uint dev, uint goal, uint n, uchar *scratch)
+{
+    uint b, bi, i, ms, nms, tries;
+
+    ms = -1;
+    nms = 0;
+
+    for (tries = 0; tries < getmount(dev)->sb.size; tries++) {
+        if ((b = ballocn(dev, goal, n)) == 0) {
+            return 0;
+        }
+
+        // The run is inside one bitmap block (see btakerun()),
+        // which is on disk as of the last commit.
+        bdiskread(dev, MBBLOCK(getmount(dev), b), scratch);
+
+        for (i = 0; i < n; i++) {
+            bi = (b + i) % BPB;
+            if ((scratch[bi / 8] & (1 << (bi % 8))) || loghas(dev, b + i)) {
+                break;
+            }
+        }
+
+        if (i == n) {
+            return b;
+        }
+
+        for (i = 0; i < n; i++) {
+            bfreenow(dev, b + i);
+        }
+        goal = b + n;
+
+        if (b / BPB != ms) {
+            ms = b / BPB;
+            if (++nms == NRUNMS) {
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Read n bytes at off, which are inside the file, from ip,
+// which has a record size.  Only the blocks holding them are
+// read.  A record with no extent, and the part of one past its
+// length, read as zeros.  Returns -1 if out of memory.
+static int rread (struct inode *ip, char *dst, uint off, uint n)
+{
+    struct extent x;
+    uchar *page;
+    uint tot, m, rs, rec, b, nb, k, goal;
+    int found;
+
+    if ((page = (uchar*) kalloc()) == 0) {
+        return -1;
+    }
+
+    rs = ip->recblks * BSIZE;
+    rec = -1;
+    found = 0;
+
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = min(n - tot, RCHUNK * BSIZE - off % (RCHUNK * BSIZE));
+        m = min(m, rs - off % rs);
+
+        if (off / rs != rec) {
+            rec = off / rs;
+            found = erecord(ip, rec * ip->recblks, &x, 0, &goal);
+        }
+
+        b = off % rs / BSIZE;
+        nb = (off % BSIZE + m + BSIZE - 1) / BSIZE;
+        k = found && x.len > b ? min(nb, x.len - b) : 0;
+
+        if (k > 0) {
+            bdirect(ip->dev, x.pblk + b, page, k, 0);
+        }
+
+        memset(page + k * BSIZE, 0, (nb - k) * BSIZE);
+        memmove(dst, page + off % BSIZE, m);
+    }
+
+    kfree((char*) page);
+    return n;
+}
+
+// Write the m bytes at src to offset off of record rec of ip,
+// which is end bytes long after the write.  The record goes to
+// new blocks a page at a time, with what it held outside the
+// bytes written copied over, and its old blocks are freed.
+// page is PGSIZE bytes and scratch BSIZE bytes of scratch.
+// Returns -1, with the record left alone, if there is no run
+// of free blocks for it.
+static int rstore (struct inode *ip, uint rec, char *src, uint off, uint m,
+                   uint end, uchar *page, uchar *scratch)
+{
+    struct extent x, nx;
+    uint c, k, i, lo, hi, goal;
+    int old;
+
+    nx.lblk = rec * ip->recblks;
+    nx.len = min(ip->recblks, (end - nx.lblk * BSIZE + BSIZE - 1) / BSIZE);
+
+    if ((old = erecord(ip, nx.lblk, &x, 0, &goal)) == 0) {
+        x.len = 0;
+    }
+
+    if ((nx.pblk = rballoc(ip->dev, goal, nx.len, scratch)) == 0) {
+        return -1;
+    }
+
+    for (c = 0; c < nx.len; c += k) {
+        k = min(nx.len - c, RCHUNK);
+        lo = c * BSIZE;
+        hi = lo + k * BSIZE;
+
+        // The old content is needed for the checksum even where
+        // it is written over.
+        i = x.len > c ? min(k, x.len - c) : 0;
+        if (i > 0) {
+            bdirect(ip->dev, x.pblk + c, page, i, 0);
+        }
+        memset(page + i * BSIZE, 0, (k - i) * BSIZE);
+        ip->checksum ^= dataxor(page, k * BSIZE);
+
+        if (off < hi && off + m > lo) {
+            i = off > lo ? off : lo;
+            memmove(page + i - lo, src + i - off, min(off + m, hi) - i);
+        }
+
+        ip->checksum ^= dataxor(page, k * BSIZE);
+        bdirect(ip->dev, nx.pblk + c, page, k, 1);
+    }
+
+    if (old) {
+        for (i = 0; i < x.len; i++) {
+            bfree(ip->dev, x.pblk + i);
+        }
+        erecord(ip, nx.lblk, &x, &nx, &goal);
+    } else {
+        einsert(ip, 0, (struct extenthdr*) ip->addrs, &nx, &x);
+    }
+
+    ip->ecache.len = 0;
+    return 0;
+}
+
+// Write n bytes at off to ip, which has a record size, one
+// record at a time.  Returns -1 if out of memory or disk runs.
+static int rwrite (struct inode *ip, char *src, uint off, uint n)
+{
+    uint tot, m, rs, end;
+    uchar *page, *scratch;
+    int r;
+
+    page = (uchar*) kalloc();
+    scratch = (uchar*) kalloc();
+    r = page && scratch ? 0 : -1;
+
+    rs = ip->recblks * BSIZE;
+    end = off + n > ip->size ? off + n : ip->size;
+
+    for (tot = 0; r == 0 && tot < n; tot += m, off += m, src += m) {
+        m = min(n - tot, rs - off % rs);
+        r = rstore(ip, off / rs, src, off % rs, m, end, page, scratch);
+    }
+
+    if (scratch) {
+        kfree((char*) scratch);
+    }
+    if (page) {
+        kfree((char*) page);
+    }
+
+    return r;
+}
+
+// Bytes in a record of ip: what a write of any part of one
+// rewrites.  BSIZE for a file kept in blocks, and for a
+// directory, the record size its new files take.
+uint irecsize (struct inode *ip)
+{
+    if (IRECORDS(ip)) {
+        return IRECBLKS(ip) * BSIZE;
+    }
+
+    if (ip->type == T_DIR && ip->recblks > 1) {
+        return ip->recblks * BSIZE;
+    }
+
+    return BSIZE;
+}
+
+// Truncate inode (discard contents).
+// Only called when the inode has no links
+// to it (no directory entries referring to it)
+// and has no in-memory reference to it (is
+// not an open file or current directory).
+// A big extent file is freed over several
+// transactions, so the caller must be in one.
+static void itrunc (struct inode *ip)
+{
+    int i, limit, nfreed;
+    struct extenthdr *h;
+
+    ip->cdirty = 1;
+
+    if (ip->iflags & IF_INLINE) {
+        memset(ip->addrs, 0, sizeof(ip->addrs));
+        ip->size = 0;
+        iupdate(ip);
+        return;
+    }
+
+    if (ip->iflags & IF_EXTENT) {
+        dadrop(ip);
+        zcpurge(ip->dev, ip->inum);
+        ip->ecache.len = 0;
+        h = (struct extenthdr*) ip->addrs;
+
+        // The blocks of a big file can be in more bitmap blocks
+        // than one transaction may log: free them a transaction
+        // at a time.  Leave room for the inode, its dittos, and
+        // the tree nodes on the way down.
+        for (;;) {
+            nfreed = 0;
+            limit = logn(ip->dev) + MAXOPBLOCKS - ETRIMCOST - 3 - h->depth;
+
+            if (etrim(ip, EXTENTS(h), &h->nent, h->depth, limit, &nfreed)) {
+                break;
+            }
+
+            iupdate(ip);
+            end_op();
+            begin_op();
+        }
+
+        memset(ip->addrs, 0, sizeof(ip->addrs));
+        ip->size = 0;
+        iupdate(ip);
+        return;
+    }
+
+    for (i = 0; i < NDIRECT; i++) {
+        if (ip->addrs[i]) {
+            bfree(ip->dev, ip->addrs[i]);
+            ip->addrs[i] = 0;
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (ip->addrs[NDIRECT + i]) {
+            ifree(ip, ip->addrs[NDIRECT + i], i);
+            ip->addrs[NDIRECT + i] = 0;
+        }
+    }
+
+    ip->indblk = 0;
+    ip->size = 0;
+    iupdate(ip);
+}
+
+// Disk blocks of content mapped by the n entries at e, which
+// are index entries if depth > 0.  Tree nodes are not counted.
+static uint eblocks (struct inode *ip, struct extent *e, int n, int depth)
+{
+    struct extenthdr *h;
+    struct buf *bp;
+    uint nb;
+    int i;
+
+    nb = 0;
+
+    for (i = 0; i < n; i++) {
+        if (depth == 0) {
+            nb += e[i].len & ~EXT_FLAGS;
+            continue;
+        }
+
+        bp = bread(ip->dev, e[i].pblk);
+        h = (struct extenthdr*) bp->data;
+        nb += eblocks(ip, EXTENTS(h), h->nent, h->depth);
+        brelse(bp);
+    }
+
+    return nb;
+}
+
+// Disk blocks of content listed under indirect block addr,
+// like ifree().
+static uint iblocks (struct inode *ip, uint addr, int level)
+{
+    struct buf *bp;
+    uint *a, nb;
+    int j;
+
+    nb = 0;
+    bp = bread(ip->dev, addr);
+    a = (uint*) bp->data;
+
+    for (j = 0; j < NINDIRECT; j++) {
+        if (a[j] != 0) {
+            nb += level > 0 ? iblocks(ip, a[j], level - 1) : 1;
+        }
+    }
+
+    brelse(bp);
+    return nb;
+}
+
+// Disk blocks holding ip's content, counting blocks that wait
+// for delayed allocation, so that size / (blocks * BSIZE) is
+// how well a compressed file compresses.
+static uint idiskblocks (struct inode *ip)
+{
+    struct extenthdr *h;
+    uint nb;
+    int i;
+
+    if (ip->type == T_DEV || (ip->iflags & IF_INLINE)) {
+        return 0;
+    }
+
+    if (ip->iflags & IF_EXTENT) {
+        h = (struct extenthdr*) ip->addrs;
+        return eblocks(ip, EXTENTS(h), h->nent, h->depth) + ip->ndelalloc;
+    }
+
+    nb = 0;
+
+    for (i = 0; i < NDIRECT; i++) {
+        nb += ip->addrs[i] != 0;
+    }
+
+    for (i = 0; i < 3; i++) {
+        if (ip->addrs[NDIRECT + i]) {
+            nb += iblocks(ip, ip->addrs[NDIRECT + i], i);
+        }
+    }
+
+    return nb;
+}
+
+// Copy stat information from inode.
+void stati (struct inode *ip, struct stat *st)
+{
+    st->dev = ip->dev;
+    st->ino = ip->inum;
+    st->type = ip->type;
+    st->nlink = ip->nlink;
+    st->size = ip->size;
+    st->child1 = ip->child1;
+    st->child2 = ip->child2;
+    st->checksum = ip->checksum;
+    st->gen = ip->gen;
+    st->blocks = idiskblocks(ip);
+}
+
+// Try block bn of ip rebuilt from parity in place of what the
+// disk returned, and keep it if the checksum of ip then matches.
+// old and new are BSIZE bytes of scratch.
+static int ifixblock (struct inode *ip, uint bn, uchar *old, uchar *new)
+{
+    struct buf *bp;
+
+    if (raidrebuild(ip->dev, bn, new) < 0) {
+        return 0;
+    }
+
+    // A dirty buffer is newer than the disk.
+    bp = bread(ip->dev, bn);
+    if ((bp->flags & B_DIRTY) || memcmp(bp->data, new, BSIZE) == 0) {
+        brelse(bp);
+        return 0;
+    }
+
+    // Change the disk as well as the cache, in case the buffer
+    // is recycled while the checksum is worked out.
+    bcow(bp);
+    memmove(old, bp->data, BSIZE);
+    memmove(bp->data, new, BSIZE);
+    raidfix(ip->dev, bn, new);
+    brelse(bp);
+    zcpurge(ip->dev, ip->inum);
+
+    if (ichecksum(ip) == ip->checksum) {
+        return 1;
+    }
+
+    bp = bread(ip->dev, bn);
+    bcow(bp);
+    memmove(bp->data, old, BSIZE);
+    raidfix(ip->dev, bn, old);
+    brelse(bp);
+    zcpurge(ip->dev, ip->inum);
+    return 0;
+}
+
+// ip, on a disk set, failed its checksum.  A block that went
+// bad on one disk can be rebuilt from the others, so try each
+// block of the file until one makes the checksum match.
+// Returns 1 if the file was repaired.
+static int irepair (struct inode *ip)
+{
+    struct extent x;
+    uchar *scratch;
+    uint lbn, nblk, bn, b, goal;
+    int ok;
+
+    if (raidwidth(ip->dev) == 0 || ip->type == T_DEV || (ip->iflags & IF_INLINE)) {
+        return 0;
+    }
+
+    if ((scratch = (uchar*) kalloc()) == 0) {
+        return 0;
+    }
+
+    ok = 0;
+    nblk = (ip->size + BSIZE - 1) / BSIZE;
+
+    for (lbn = 0; lbn < nblk && !ok; lbn++) {
+        if (!IRECORDS(ip)) {
+            if ((bn = bmap_ext(ip, lbn, 0)) != 0) {
+                ok = ifixblock(ip, bn, scratch, scratch + BSIZE);
+            }
+        } else if (lbn % IRECBLKS(ip) == 0 && erecord(ip, lbn, &x, 0, &goal)) {
+            for (b = 0; b < (x.len & ~EXT_FLAGS) && !ok; b++) {
+                ok = ifixblock(ip, x.pblk + b, scratch, scratch + BSIZE);
+            }
+        }
+    }
+
+    kfree((char*) scratch);
+
+    if (ok) {
+        cprintf("irepair: inode %d rebuilt from parity\n", ip->inum);
+    }
+
+    return ok;
+}
+
+// Report file system activity counters.
+void fsstat (struct fsstat *st)
+{
+    logstat(st);
+    ddtstat(st);
+    st->niwrite = iupdates.nwrite;
+    st->niskip = iupdates.nskip;
+    st->nfree = mtab.m[0].fsmap.tree[1];
+    raidstat(st);
+    l2stat(st);
+}
+
+// On a disk set, read the blocks of ip from file block lbn up to
+// end, one per data disk, in one go.
+static void iprefetch (struct inode *ip, uint lbn, uint end)
+{
+    uint bns[NRAIDDISK], i;
+
+    for (i = 0; i < raidwidth(ip->dev) && lbn + i < end; i++) {
+        bns[i] = bmap_ext(ip, lbn + i, 0);
+    }
+
+    bprefetch(ip->dev, bns, i);
+}
+
+//PAGEBREAK!
+// Read data from inode.
+int readi (struct inode *ip, char *dst, uint off, uint n)
+{
+    uint tot, m, addr, w;
+    struct buf *bp;
+    struct dabuf *d;
+
+    if (ip->type == T_DEV) {
+        if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read) {
+            return -1;
+        }
+
+        return devsw[ip->major].read(ip, dst, n);
+    }
+
+    if (off > ip->size || off + n < off) {
+        return -1;
+    }
+
+    if (off + n > ip->size) {
+        n = ip->size - off;
+    }
+
+    if (ip->iflags & IF_INLINE) {
+        memmove(dst, (char*) ip->addrs + off, n);
+        return n;
+    }
+
+    if (IZRECORDS(ip)) {
+        return zread(ip, dst, off, n);
+    }
+
+    if (IRECORDS(ip)) {
+        return rread(ip, dst, off, n);
+    }
+
+    w = raidwidth(ip->dev);
+
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = min(n - tot, BSIZE - off%BSIZE);
+
+        if (ip->ndelalloc > 0 && (d = dafind(ip, off / BSIZE)) != 0) {
+            memmove(dst, d->data + off % BSIZE, m);
+            continue;
+        }
+
+        if (w > 1 && (tot == 0 || (off / BSIZE) % w == 0)) {
+            iprefetch(ip, off / BSIZE, (off - tot + n + BSIZE - 1) / BSIZE);
+        }
+
+        // A hole reads as zeros, without touching the disk.
+        if ((addr = bmap_ext(ip, off / BSIZE, 0)) == 0) {
+            memset(dst, 0, m);
+            continue;
+        }
+
+        bp = bread(ip->dev, addr);
+        memmove(dst, bp->data + off % BSIZE, m);
+        brelse(bp);
+    }
+
+    return n;
+}
+
+// PAGEBREAK!
+// Write data to inode.
+int writei (struct inode *ip, char *src, uint off, uint n)
+{
+	return writei_ext(ip, src, off, n, 0);
+}
+
+// XOR of the words of an IF_INLINE inode's content, the
+// inline counterpart of blockxor().
+static uint inlinexor (struct inode *ip)
+{
+    uint i, x;
+
+    x = 0;
+    for (i = 0; i < NDIRECT+3; i++) {
+        x ^= ip->addrs[i];
+    }
+
+    return x;
+}
+
+// Move the content of an IF_INLINE inode out to blocks,
+// which it is about to outgrow.  Files become extent-mapped,
+// directories block-mapped.
+static void ispill (struct inode *ip)
+{
+    char buf[NINLINE];
+    uint n;
+
+    n = ip->size;
+    memmove(buf, ip->addrs, n);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->iflags &= ~IF_INLINE;
+    if (ip->type == T_FILE) {
+        ip->iflags |= IF_EXTENT;
+    }
+    ip->ecache.len = 0;
+    ip->indblk = 0;
+
+    // skip: the checksum is recomputed and ditto replicas,
+    // which keep their own copy, are left alone.
+    if (n > 0) {
+        writei_ext(ip, buf, 0, n, 1);
+    }
+}
+
+int writei_ext(struct inode *ip, char *src, uint off, uint n, uint skip)
+{
+	uint tot, m;
+	struct buf *bp;
+	struct dabuf *d;
+	char *csrc = src;
+	uint coff = off;
+	int delay, update, inl, zip;
+
+	if (ip->type == T_DEV) {
+		if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write) {
+			return -1;
+		}
+		return devsw[ip->major].write(ip, src, n);
+	}
+
+	// Writing past the end of a file leaves a hole, which has
+	// no blocks; other inodes stay without holes.
+	if ((ip->type != T_FILE && off > ip->size) || off + n < off) {
+		return -1;
+	}
+
+	if (!(ip->iflags & IF_EXTENT) && off + n > MAXFILE * BSIZE) {
+		return -1;
+	}
+
+	// Content that no longer fits in the inode moves to blocks.
+	inl = 0;
+	if (ip->iflags & IF_INLINE) {
+		if (off + n > NINLINE) {
+			ispill(ip);
+		} else {
+			inl = 1;
+		}
+	}
+
+	zip = !inl && IRECORDS(ip);
+
+	// New blocks of a regular file get delayed allocation,
+	// unless ditto replicas have to be kept in step.
+	delay = ip->type == T_FILE && (ip->iflags & IF_EXTENT) &&
+	        !zip && skip == 0 && ip->child1 == 0 && ip->child2 == 0;
+	update = !delay;
+
+	// rstore() keeps the checksum of a file with a record size.
+	// Appending to a file that can delay leaves what the checksum
+	// covers alone: iupdate_ext() sums just the new content.
+	if (n > 0 && !(zip && !IZRECORDS(ip)) && !(delay && off >= ip->csize)) {
+		ip->cdirty = 1;
+	}
+
+	if (inl) {
+		if (ip->type == T_DIR) {
+			ip->checksum ^= inlinexor(ip);
+		}
+		memmove((char*) ip->addrs + off, src, n);
+		if (ip->type == T_DIR) {
+			ip->checksum ^= inlinexor(ip);
+		}
+		off += n;
+	} else if (zip && IZRECORDS(ip)) {
+		if (zwrite(ip, src, off, n) < 0) {
+			return -1;
+		}
+		off += n;
+	} else if (zip) {
+		if (rwrite(ip, src, off, n) < 0) {
+			return -1;
+		}
+		off += n;
+	}
+
+	for (tot = (inl || zip) ? n : 0; tot < n; tot += m, off += m, src += m) {
+		m = min(n - tot, BSIZE - off%BSIZE);
+
+		if (delay && (d = daget(ip, off / BSIZE, &update)) != 0) {
+			memmove(d->data + off % BSIZE, src, m);
+			continue;
+		}
+
+		bp = bread(ip->dev, bmap(ip, off / BSIZE));
+		bcow(bp);
+		if (ip->type == T_DIR) {
+			ip->checksum ^= blockxor(bp);
+		}
+		memmove(bp->data + off % BSIZE, src, m);
+		if (ip->type == T_DIR) {
+			ip->checksum ^= blockxor(bp);
+		}
+		log_write(bp);
+		brelse(bp);
+		update = 1;
+	}
+
+	// update ditto blocks; a replica's size only catches up at
+	// iupdate, so give it the file's hole or delayed tail first.
+	struct inode *ic;
+	if (skip == 0) {
+		if (ip->child1) {
+			ic = iget(ip->dev, ip->child1);
+			ilock_ext(ic, 0);
+			if (ic->size < coff) ic->size = coff;
+			writei(ic, csrc, coff, n);
+			iunlockput(ic);
+		}
+		if (ip->child2) {
+			ic = iget(ip->dev, ip->child2);
+			ilock_ext(ic, 0);
+			if (ic->size < coff) ic->size = coff;
+			writei(ic, csrc, coff, n);
+			iunlockput(ic);
+		}
+	}
+
+	// the parent call iupdate to update ditto blocks
+	if (ip->type == T_DITTO) {
+		return n;
+	}
+
+	if (n > 0 && off > ip->size) {
+		ip->size = off;
+	}
+
+	// Blocks that only went to delalloc buffers leave the
+	// disk unchanged; the inode is written when they are.
+	if (ip->type != T_DEV && update) {
+		iupdate_ext(ip, skip);
+	}
+
+	return n;
+}
+
+
+//PAGEBREAK!
+// Directories
+
+int namecmp (const char *s, const char *t)
+{
+    return strncmp(s, t, DIRSIZ);
+}
+
+// Name lookup cache.
+//
+// dcache remembers what dirlookup() found: the inode and dirent
+// offset for name in directory dinum, or inum 0 if the name is
+// not there (a negative entry, so that failed lookups such as
+// open(O_CREATE) of a new file are cheap too). The table is
+// direct-mapped by a hash of the key; a new entry replaces
+// whatever was in its slot. Entries are added and dropped with
+// the directory locked, so a directory's entries always agree
+// with its content: dirlink() and sys_unlink() drop the names
+// they change and iput() drops all entries of a freed directory.
+
+struct dcentry {
+    uint dev;           // 0 if the slot is empty
+    uint dinum;         // directory
+    char name[DIRSIZ];
+    uint inum;          // 0 for a negative entry
+    uint off;           // offset of the dirent if inum != 0
+};
+
+struct {
+    struct spinlock lock;
+    struct dcentry e[NDCACHE];
+} dcache;
+
+static void dcinit (void)
+{
+    initlock(&dcache.lock, "dcache");
+}
+
+static struct dcentry* dcslot (uint dev, uint dinum, char *name)
+{
+    uint h;
+    int i;
+
+    h = dev * 31 + dinum;
+    for (i = 0; i < DIRSIZ && name[i]; i++) {
+        h = h * 31 + (uchar) name[i];
+    }
+
+    return &dcache.e[h % NDCACHE];
+}
+
+// Look name up in dp's cache entries.  Returns 1 and sets
+// *inum and *off if there is an entry, 0 if there is none.
+static int dclookup (struct inode *dp, char *name, uint *inum, uint *off)
+{
+    struct dcentry *e;
+    int r;
+
+    acquire(&dcache.lock);
+    e = dcslot(dp->dev, dp->inum, name);
+    r = e->dev == dp->dev && e->dinum == dp->inum && namecmp(e->name, name) == 0;
+
+    if (r) {
+        *inum = e->inum;
+        *off = e->off;
+    }
+
+    release(&dcache.lock);
+    return r;
+}
+
+static void dcenter (struct inode *dp, char *name, uint inum, uint off)
+{
+    struct dcentry *e;
+
+    acquire(&dcache.lock);
+    e = dcslot(dp->dev, dp->inum, name);
+    e->dev = dp->dev;
+    e->dinum = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->inum = inum;
+    e->off = off;
+    release(&dcache.lock);
+}
+
+// Forget name in directory dp.  Caller holds dp's lock.
+void dcinval (struct inode *dp, char *name)
+{
+    struct dcentry *e;
+
+    acquire(&dcache.lock);
+    e = dcslot(dp->dev, dp->inum, name);
+    if (e->dev == dp->dev && e->dinum == dp->inum && namecmp(e->name, name) == 0) {
+        e->dev = 0;
+    }
+    release(&dcache.lock);
+}
+
+// Forget every entry of directory dinum, which is being freed,
+// or of every directory of dev if dinum is 0.
+static void dcpurge (uint dev, uint dinum)
+{
+    struct dcentry *e;
+
+    acquire(&dcache.lock);
+    for (e = dcache.e; e < &dcache.e[NDCACHE]; e++) {
+        if (e->dev == dev && (dinum == 0 || e->dinum == dinum)) {
+            e->dev = 0;
+        }
+    }
+    release(&dcache.lock);
+}
+
+// Search the first n dirents of directory block bn (or of an
+// IF_INLINE directory's inode) in place for name.  Returns the inode number and sets *off to the
+// entry's byte offset, or returns 0 if it is not there.
+static uint dirscan (struct inode *dp, uint bn, uint n, char *name, uint *off)
+{
+    struct dirent *de;
+    struct buf *bp;
+    uint addr, i, inum;
+
+    bp = 0;
+
+    if (dp->iflags & IF_INLINE) {
+        de = (struct dirent*) dp->addrs;
+    } else {
+        if ((addr = bmap_ext(dp, bn, 0)) == 0) {
+            return 0;
+        }
+
+        bp = bread(dp->dev, addr);
+        de = (struct dirent*) bp->data;
+    }
+
+    inum = 0;
+
+    for (i = 0; i < n; i++) {
+        if (de[i].inum != 0 && namecmp(name, de[i].name) == 0) {
+            inum = de[i].inum;
+            *off = bn * BSIZE + i * sizeof(*de);
+            break;
+        }
+    }
+
+    if (bp) {
+        brelse(bp);
+    }
+
+    return inum;
+}
+
+// FNV-1a hash of a directory entry name.
+static uint dirhash (char *name)
+{
+    uint h;
+    int i;
+
+    h = 2166136261;
+    for (i = 0; i < DIRSIZ && name[i]; i++) {
+        h = (h ^ (uchar) name[i]) * 16777619;
+    }
+
+    return h;
+}
+
+// Where the entry for a leaf of a hashed directory lives:
+// position i of the index in block node, or in block 0 if node
+// is 0, which is in turn at position ri of block 0's index.
+struct dxpath {
+    uint    node;
+    int     ri;
+    int     i;
+};
+
+// Position in the index of n entries at x of the block that
+// holds hash h.
+static int dxpos (struct dxslot *x, int n, uint h)
+{
+    int i;
+
+    for (i = 1; i < n && x[i/2].blk[i%2] != 0 && x[i/2].hash[i%2] <= h; i++)
+        ;
+
+    return i - 1;
+}
+
+// The leaf of hashed directory dp that holds hash h.
+// Sets *p to where its index entry is.
+static uint dxfind (struct inode *dp, uint h, struct dxpath *p)
+{
+    struct dxslot *x;
+    struct buf *bp;
+    uint blk;
+
+    bp = bread(dp->dev, bmap_ext(dp, 0, 0));
+    x = (struct dxslot*) bp->data + 2;
+    p->node = 0;
+    p->ri = p->i = dxpos(x, NDXLEAF, h);
+    blk = x[p->i/2].blk[p->i%2];
+
+    if (x[0].depth > 0) {
+        brelse(bp);
+        p->node = blk;
+        bp = bread(dp->dev, bmap_ext(dp, p->node, 0));
+        x = (struct dxslot*) bp->data;
+        p->i = dxpos(x, NDXNODE, h);
+        blk = x[p->i/2].blk[p->i%2];
+    }
+
+    brelse(bp);
+    return blk;
+}
+
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// A linear directory is scanned block by block; a hashed
+// one needs only block 0, an index block once block 0's index
+// has moved down, and the leaf that holds the name.
+struct inode* dirlookup (struct inode *dp, char *name, uint *poff)
+{
+    struct dxpath p;
+    uint off, bn, inum;
+
+    if (dp->type != T_DIR) {
+        panic("dirlookup not DIR");
+    }
+
+    if (dclookup(dp, name, &inum, &off)) {
+        if (inum == 0) {
+            return 0;
+        }
+
+        if (poff) {
+            *poff = off;
+        }
+
+        return iget(dp->dev, inum);
+    }
+
+    inum = 0;
+
+    if (dp->iflags & IF_HASHDIR) {
+        if ((inum = dirscan(dp, 0, 2, name, &off)) == 0) {  // "." and ".."
+            inum = dirscan(dp, dxfind(dp, dirhash(name), &p), NDIRENT, name, &off);
+        }
+    } else {
+        for (bn = 0; inum == 0 && bn * BSIZE < dp->size; bn++) {
+            inum = dirscan(dp, bn, min(NDIRENT, (dp->size - bn * BSIZE) / sizeof(struct dirent)), name, &off);
+        }
+    }
+
+    if (inum == 0) {
+        dcenter(dp, name, 0, 0);
+        return 0;
+    }
+
+    dcenter(dp, name, inum, off);
+
+    if (poff) {
+        *poff = off;
+    }
+
+    return iget(dp->dev, inum);
+}
+
+// Directory traversal.  A program that reads a directory, like
+// ls, goes on to look up and lock each entry, and each inode it
+// locks costs a read of its inode block and, for the checksum,
+// of its content, one after another.  dirahead() starts those
+// reads for the next RAENTS entries together with breadahead(),
+// ahead of the lookups, and enters the names in the name cache.
+#define RAENTS  16                  // entries prefetched at a time
+#define RASMALL (NDIRECT * BSIZE)   // files whose first block is prefetched too
+
+// Is inode inum of dev cached and read in?
+static int icached (uint dev, uint inum)
 {
+    struct inode *ip;
+    int r;
+
+    r = 0;
     acquire(&icache.lock);
 
-    if (ip->ref == 1 && (ip->flags & I_VALID) && ip->nlink == 0) {
-        // inode has no links: truncate and free inode.
-        if (ip->flags & I_BUSY) {
-            panic("iput busy");
+    for (ip = icache.hash[ihash(dev, inum)]; ip; ip = ip->hnext) {
+        if (ip->dev == dev && ip->inum == inum) {
+            r = (ip->flags & I_VALID) != 0;
+            break;
         }
-
-        ip->flags |= I_BUSY;
-        release(&icache.lock);
-        itrunc(ip);
-        ip->type = 0;
-        iupdate(ip);
-
-        acquire(&icache.lock);
-        ip->flags = 0;
-        wakeup(ip);
     }
 
-    ip->ref--;
     release(&icache.lock);
+    return r;
 }
 
-// Common idiom: unlock, then put.
-void iunlockput (struct inode *ip)
-{
-    iunlock(ip);
-    iput(ip);
-}
-
-// Copy from replica inode to parent
-void irescue(struct inode *ip, struct inode *rinode)
+// The disk block holding the start of dip's content, or 0 if
+// there is none outside the inode.
+static uint dfirst (struct dinode *dip)
 {
-	int max = ((LOGSIZE-1-1-2) / 4) * 512;
-	int i = 0;
-	int n, n1;
-	uint off = 0;
-
-	ilock_ext(rinode, 0);
-	ilock_ext(ip, 0);
+    struct extenthdr *h;
 
-	n = ip->size;
+    if (dip->type == T_DEV || (dip->iflags & IF_INLINE)) {
+        return 0;
+    }
 
-	while (i < n) {
-		n1 = n - i;
-		if (n1 > max)
-			n1 = max;
+    if (dip->iflags & IF_EXTENT) {
+        h = (struct extenthdr*) dip->addrs;
 
-		begin_op();
-		iduplicate(rinode, ip, off, n1);
-		end_op();
+        if (h->depth == 0 && h->nent > 0 && EXTENTS(h)[0].lblk == 0) {
+            return EXTENTS(h)[0].pblk;
+        }
 
-		off += n1;
-		i += n1;
-	}
+        return 0;
+    }
 
-	iunlock(rinode);
-	iunlock(ip);
+    return dip->addrs[0];
 }
 
-// Copy size, checksum, and inode data from source to dest
-// MUST BE SURROUNDED BY A TRANSACTION!
-void iduplicate(struct inode *src, struct inode *dst, uint off, uint tot)
+// Prefetch what looking up the RAENTS entries of dp from offset
+// off needs: their inode blocks, then the first block of those
+// that are small.  dp is locked, shared or not.  Returns the
+// offset to call again at, halfway through, so that the next
+// batch is on its way before this one is used up.
+uint dirahead (struct inode *dp, uint off)
 {
-	char buf[512];
-	uint n = sizeof(buf);
-	memset((void *)buf, 0, n);
-	uint r;
-	uint coff = off;
+    struct dirent de[RAENTS];
+    struct mount *mp;
+    struct dinode *dip;
+    struct buf *bp;
+    uint inums[RAENTS], bns[RAENTS];
+    int n, i, k, nb;
 
-	dst->checksum = src->checksum;
-	dst->size = src->size;
+    if (ISSNAPDEV(dp->dev) || (n = readi(dp, (char*) de, off, sizeof(de))) <= 0) {
+        return dp->size;
+    }
 
-	while (((r = readi(src, buf, off, n)) > 0) && (off < (tot + coff))) {
-		writei_ext(dst, buf, off, r, 1);
-		off += r;
-		memset((void *)buf, 0, n);
-	}
-}
+    n /= sizeof(de[0]);
+    mp = getmount(dp->dev);
 
-//PAGEBREAK!
-// Inode content
-//
-// The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+    for (i = k = nb = 0; i < n; i++) {
+        if (de[i].inum == 0) {
+            continue;
+        }
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-static uint bmap (struct inode *ip, uint bn)
-{
-    uint addr, *a;
-    struct buf *bp;
+        dcenter(dp, de[i].name, de[i].inum, off + i * sizeof(de[0]));
 
-    if (bn < NDIRECT) {
-        if ((addr = ip->addrs[bn]) == 0) {
-            ip->addrs[bn] = addr = balloc(ip->dev);
+        if (icached(dp->dev, de[i].inum)) {
+            continue;
         }
 
-        return addr;
+        inums[k++] = de[i].inum;
+        if (nb == 0 || bns[nb - 1] != MIBLOCK(mp, de[i].inum)) {
+            bns[nb++] = MIBLOCK(mp, de[i].inum);
+        }
     }
 
-    bn -= NDIRECT;
-
-    if (bn < NINDIRECT) {
-        // Load indirect block, allocating if necessary.
-        if ((addr = ip->addrs[NDIRECT]) == 0) {
-            ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-        }
+    breadahead(dp->dev, bns, nb);
 
-        bp = bread(ip->dev, addr);
-        a = (uint*) bp->data;
+    // The inode blocks arrive together; wait for them to find
+    // the content blocks.
+    for (i = nb = 0; i < k; i++) {
+        bp = bread(dp->dev, MIBLOCK(mp, inums[i]));
+        dip = (struct dinode*) bp->data + inums[i] % IPB;
 
-        if ((addr = a[bn]) == 0) {
-            a[bn] = addr = balloc(ip->dev);
-            log_write(bp);
+        if (dip->type != 0 && dip->size <= RASMALL) {
+            bns[nb++] = dfirst(dip);
         }
 
         brelse(bp);
-        return addr;
     }
 
-    panic("bmap: out of range");
+    breadahead(dp->dev, bns, nb);
+
+    return off + (n + 1) / 2 * sizeof(de[0]);
 }
 
-// Truncate inode (discard contents).
-// Only called when the inode has no links
-// to it (no directory entries referring to it)
-// and has no in-memory reference to it (is
-// not an open file or current directory).
-static void itrunc (struct inode *ip)
+// Turn the full one-block directory dp into a hashed directory
+// whose only leaf, block 1, holds everything but "." and "..".
+static void dxconvert (struct inode *dp)
 {
-    int i, j;
-    struct buf *bp;
-    uint *a;
+    struct dirent de[NDIRENT];
+    struct dxslot *x;
 
-    for (i = 0; i < NDIRECT; i++) {
-        if (ip->addrs[i]) {
-            bfree(ip->dev, ip->addrs[i]);
-            ip->addrs[i] = 0;
-        }
+    if (readi(dp, (char*) de, 2 * sizeof(de[0]), (NDIRENT - 2) * sizeof(de[0])) !=
+        (NDIRENT - 2) * sizeof(de[0])) {
+        panic("dxconvert read");
     }
 
-    if (ip->addrs[NDIRECT]) {
-        bp = bread(ip->dev, ip->addrs[NDIRECT]);
-        a = (uint*) bp->data;
-
-        for (j = 0; j < NINDIRECT; j++) {
-            if (a[j]) {
-                bfree(ip->dev, a[j]);
-            }
-        }
+    memset(&de[NDIRENT - 2], 0, 2 * sizeof(de[0]));
+    writei(dp, (char*) de, BSIZE, BSIZE);
 
-        brelse(bp);
-        bfree(ip->dev, ip->addrs[NDIRECT]);
-        ip->addrs[NDIRECT] = 0;
-    }
+    memset(de, 0, sizeof(de));
+    x = (struct dxslot*) de;
+    x[0].blk[0] = 1;
+    x[0].hash[0] = 0;
+    dp->iflags |= IF_HASHDIR;
+    writei(dp, (char*) de, 2 * sizeof(de[0]), (NDIRENT - 2) * sizeof(de[0]));
 
-    ip->size = 0;
-    iupdate(ip);
+    dcpurge(dp->dev, dp->inum);  // the entries moved
 }
 
-// Copy stat information from inode.
-void stati (struct inode *ip, struct stat *st)
+// The byte offset in the directory and the number of entries
+// of the index in block node (block 0 if node is 0).
+static uint dxbase (uint node, int *n)
 {
-    st->dev = ip->dev;
-    st->ino = ip->inum;
-    st->type = ip->type;
-    st->nlink = ip->nlink;
-    st->size = ip->size;
-    st->child1 = ip->child1;
-    st->child2 = ip->child2;
-    st->checksum = ip->checksum;
+    *n = node ? NDXNODE : NDXLEAF;
+    return node ? node * BSIZE : 2 * sizeof(struct dirent);
 }
 
-//PAGEBREAK!
-// Read data from inode.
-int readi (struct inode *ip, char *dst, uint off, uint n)
+// Number of entries used in the index in block node.
+static int dxcount (struct inode *dp, uint node)
 {
-    uint tot, m;
+    struct dxslot *x;
     struct buf *bp;
+    int i, n;
 
-    if (ip->type == T_DEV) {
-        if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].read) {
-            return -1;
-        }
+    bp = bread(dp->dev, bmap_ext(dp, node, 0));
+    x = (struct dxslot*) (bp->data + dxbase(node, &n) % BSIZE);
 
-        return devsw[ip->major].read(ip, dst, n);
-    }
+    for (i = 0; i < n && x[i/2].blk[i%2] != 0; i++)
+        ;
 
-    if (off > ip->size || off + n < off) {
-        return -1;
-    }
+    brelse(bp);
+    return i;
+}
 
-    if (off + n > ip->size) {
-        n = ip->size - off;
-    }
+// Add block blk for hashes from h up at position i of the
+// index in block node of dp.
+static void dxinsert (struct inode *dp, uint node, int i, uint h, uint blk)
+{
+    struct dxslot x[NDIRENT];
+    uint base;
+    int j, n;
 
-    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-        bp = bread(ip->dev, bmap(ip, off / BSIZE));
-        m = min(n - tot, BSIZE - off%BSIZE);
-        memmove(dst, bp->data + off % BSIZE, m);
-        brelse(bp);
+    base = dxbase(node, &n);
+    readi(dp, (char*) x, base, n / 2 * sizeof(x[0]));
+
+    for (j = n - 1; j > i; j--) {
+        x[j/2].blk[j%2] = x[(j-1)/2].blk[(j-1)%2];
+        x[j/2].hash[j%2] = x[(j-1)/2].hash[(j-1)%2];
     }
 
-    return n;
+    x[i/2].blk[i%2] = blk;
+    x[i/2].hash[i%2] = h;
+    writei(dp, (char*) &x[i/2], base + (i/2) * sizeof(x[0]), (n/2 - i/2) * sizeof(x[0]));
 }
 
-// PAGEBREAK!
-// Write data to inode.
-int writei (struct inode *ip, char *src, uint off, uint n)
+// Make room in the full index in block node of dp.  Block 0's
+// index moves down into a new index block, which becomes the
+// only entry of block 0; an index block gives the upper half
+// of its entries to a new index block.  Returns -1 if block 0
+// indexes index blocks and is full.
+static int dxgrow (struct inode *dp, struct dxpath *p)
 {
-	return writei_ext(ip, src, off, n, 0);
+    struct dxslot x[NDIRENT];
+    uint nb;
+
+    nb = dp->size / BSIZE;
+    memset(x, 0, sizeof(x));
+
+    if (p->node == 0) {
+        readi(dp, (char*) x, 2 * sizeof(x[0]), (NDIRENT - 2) * sizeof(x[0]));
+        x[0].depth = 0;
+        writei(dp, (char*) x, nb * BSIZE, BSIZE);
+
+        memset(x, 0, sizeof(x));
+        x[0].blk[0] = nb;
+        x[0].depth = 1;
+        writei(dp, (char*) x, 2 * sizeof(x[0]), (NDIRENT - 2) * sizeof(x[0]));
+        return 0;
+    }
+
+    if (dxcount(dp, 0) == NDXLEAF) {
+        return -1;
+    }
+
+    readi(dp, (char*) x, p->node * BSIZE, BSIZE);
+    memmove(x, &x[NDIRENT/2], BSIZE / 2);
+    memset(&x[NDIRENT/2], 0, BSIZE / 2);
+    writei(dp, (char*) x, nb * BSIZE, BSIZE);
+    writei(dp, (char*) &x[NDIRENT/2], p->node * BSIZE + BSIZE / 2, BSIZE / 2);
+    dxinsert(dp, 0, p->ri + 1, x[0].hash[0], nb);
+    return 0;
 }
 
-int writei_ext(struct inode *ip, char *src, uint off, uint n, uint skip)
+// Split the full leaf of dp: the upper half of its hashes
+// move to a new leaf at the end of the directory, whose
+// smallest hash goes in *split.  Returns the new leaf, or 0
+// if all the names in the leaf have the same hash.
+static uint dxsplit (struct inode *dp, uint leaf, uint *split)
 {
-	uint tot, m;
-	struct buf *bp;
-	char *csrc = src;
-	uint coff = off;
+    struct dirent de[NDIRENT];
+    uint h[NDIRENT], sorted[NDIRENT], nb;
+    int j, k;
+
+    readi(dp, (char*) de, leaf * BSIZE, BSIZE);
+
+    // Split at the median hash, or above the smallest one
+    // if that is the median too.
+    for (j = 0; j < NDIRENT; j++) {
+        h[j] = dirhash(de[j].name);
+        for (k = j; k > 0 && sorted[k-1] > h[j]; k--) {
+            sorted[k] = sorted[k-1];
+        }
+        sorted[k] = h[j];
+    }
 
-	if (ip->type == T_DEV) {
-		if (ip->major < 0 || ip->major >= NDEV || !devsw[ip->major].write) {
-			return -1;
-		}
-		return devsw[ip->major].write(ip, src, n);
-	}
+    for (k = NDIRENT / 2; k < NDIRENT && sorted[k] == sorted[0]; k++)
+        ;
 
-	if (off > ip->size || off + n < off) {
-		return -1;
-	}
+    if (k == NDIRENT) {
+        return 0;
+    }
 
-	if (off + n > MAXFILE * BSIZE) {
-		return -1;
-	}
+    *split = sorted[k];
 
-	for (tot = 0; tot < n; tot += m, off += m, src += m) {
-		bp = bread(ip->dev, bmap(ip, off / BSIZE));
-		m = min(n - tot, BSIZE - off%BSIZE);
-		memmove(bp->data + off % BSIZE, src, m);
-		log_write(bp);
-		brelse(bp);
-	}
+    // Gather the upper half into the new leaf at the end, then
+    // clear it from the old leaf.
+    nb = dp->size / BSIZE;
 
-	// update ditto blocks
-	struct inode *ic;
-	if (skip == 0) {
-		if (ip->child1) {
-			ic = iget(ip->dev, ip->child1);
-			ilock_ext(ic, 0);
-			writei(ic, csrc, coff, n);
-			iunlock(ic);
-		}
-		if (ip->child2) {
-			ic = iget(ip->dev, ip->child2);
-			ilock_ext(ic, 0);
-			writei(ic, csrc, coff, n);
-			iunlock(ic);
-		}
-	}
+    for (j = k = 0; j < NDIRENT; j++) {
+        if (h[j] >= *split) {
+            de[k] = de[j];
+            dcenter(dp, de[k].name, de[k].inum, nb * BSIZE + k * sizeof(de[k]));
+            k++;
+        }
+    }
 
-	// the parent call iupdate to update ditto blocks
-	if (ip->type == T_DITTO) {
-		return n;
-	}
+    memset(&de[k], 0, (NDIRENT - k) * sizeof(de[0]));
+    writei(dp, (char*) de, nb * BSIZE, BSIZE);
 
-	if (n > 0 && off > ip->size) {
-		ip->size = off;
-	}
+    readi(dp, (char*) de, leaf * BSIZE, BSIZE);
 
-	if (ip->type != T_DEV) {
-		iupdate_ext(ip, skip);
-	}
+    for (j = 0; j < NDIRENT; j++) {
+        if (h[j] >= *split) {
+            memset(&de[j], 0, sizeof(de[j]));
+        }
+    }
 
-	return n;
+    writei(dp, (char*) de, leaf * BSIZE, BSIZE);
+    return nb;
 }
 
+// Find a free slot for a new entry in hashed directory dp,
+// splitting the leaf if it is full, after growing the index
+// if that is full too.  Returns its offset, or -1 if the
+// directory cannot grow.
+static int dxroom (struct inode *dp, char *name)
+{
+    struct dxpath p;
+    struct dirent *de;
+    struct buf *bp;
+    uint leaf, hash, split, nb, j;
+    int n, tries;
 
-//PAGEBREAK!
-// Directories
+    hash = dirhash(name);
 
-int namecmp (const char *s, const char *t)
-{
-    return strncmp(s, t, DIRSIZ);
-}
+    for (tries = 0; tries < 3; tries++) {
+        leaf = dxfind(dp, hash, &p);
+        bp = bread(dp->dev, bmap_ext(dp, leaf, 0));
+        de = (struct dirent*) bp->data;
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode* dirlookup (struct inode *dp, char *name, uint *poff)
-{
-    uint off, inum;
-    struct dirent de;
+        for (j = 0; j < NDIRENT && de[j].inum != 0; j++)
+            ;
 
-    if (dp->type != T_DIR) {
-        panic("dirlookup not DIR");
-    }
+        brelse(bp);
 
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (readi(dp, (char*) &de, off, sizeof(de)) != sizeof(de)) {
-            panic("dirlookup read");
+        if (j < NDIRENT) {
+            return leaf * BSIZE + j * sizeof(*de);
         }
 
-        if (de.inum == 0) {
-            continue;
-        }
+        // A grown index has room for a split, and both
+        // halves of a split leaf have room.
+        dxbase(p.node, &n);
 
-        if (namecmp(name, de.name) == 0) {
-            // entry matches path element
-            if (poff) {
-                *poff = off;
+        if (dxcount(dp, p.node) == n) {
+            if (dxgrow(dp, &p) < 0) {
+                return -1;
             }
-
-            inum = de.inum;
-            return iget(dp->dev, inum);
+        } else if ((nb = dxsplit(dp, leaf, &split)) == 0) {
+            return -1;
+        } else {
+            dxinsert(dp, p.node, p.i + 1, split, nb);
         }
     }
 
-    return 0;
+    panic("dxroom");
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
@@ -889,17 +4018,32 @@ int dirlink (struct inode *dp, char *name, uint inum)
         return -1;
     }
 
-    // Look for an empty dirent.
-    for (off = 0; off < dp->size; off += sizeof(de)) {
-        if (readi(dp, (char*) &de, off, sizeof(de)) != sizeof(de)) {
-            panic("dirlink read");
+    // A full one-block directory becomes a hashed one
+    // rather than growing a second block to scan.
+    off = dp->size;
+
+    if (!(dp->iflags & IF_HASHDIR)) {
+        // Look for an empty dirent.
+        for (off = 0; off < dp->size; off += sizeof(de)) {
+            if (readi(dp, (char*) &de, off, sizeof(de)) != sizeof(de)) {
+                panic("dirlink read");
+            }
+
+            if (de.inum == 0) {
+                break;
+            }
         }
 
-        if (de.inum == 0) {
-            break;
+        if (off == BSIZE && dp->size == BSIZE) {
+            dxconvert(dp);
         }
     }
 
+    if ((dp->iflags & IF_HASHDIR) && (off = dxroom(dp, name)) < 0) {
+        return -1;
+    }
+
+    memset(&de, 0, sizeof(de));
     strncpy(de.name, name, DIRSIZ);
     de.inum = inum;
 
@@ -907,6 +4051,8 @@ int dirlink (struct inode *dp, char *name, uint inum)
         panic("dirlink");
     }
 
+    dcenter(dp, name, inum, off);  // replaces the negative entry
+
     return 0;
 }
 
@@ -974,11 +4120,15 @@ static struct inode* namex (char *path, int nameiparent, char *name, int trans)
     }
 
     while ((path = skipelem(path, name)) != 0) {
+        if (namecmp(name, "..") == 0) {
+            ip = mountup(ip);
+        }
+
     	if (trans) {
-    		if (ilock_trans(ip) != 0) return 0;  // Failed to recover and lock
+    		if (ilock_shared_trans(ip) != 0) return 0;  // Failed to recover and lock
     	}
     	else {
-    		if (ilock(ip) != 0) return 0; // Failed to lock
+    		if (ilock_shared(ip) != 0) return 0; // Failed to lock
     	}
 
         if (ip->type != T_DIR) {
@@ -997,6 +4147,8 @@ static struct inode* namex (char *path, int nameiparent, char *name, int trans)
             return 0;
         }
 
+        next = mountcross(snapcross(next));
+
         iunlockput(ip);
         ip = next;
     }
@@ -1045,24 +4197,18 @@ int dist2root(char *path)
 {
 	char name[DIRSIZ];
 	struct inode *dp, *ip;
-	uint inum1, inum2;
-	// uint off;
-	int count;
+	int count = 0;
+
+	if ((dp = nameiparent_trans(path, name)) == 0)
+		return 0;
 
-	dp = nameiparent_trans(path, name);
 	ilock_trans(dp);
-	while ((ip = dirlookup(dp, "..", 0)) != 0) {  // keep looking up
-		inum1 = dp->inum;
-		iunlockput(ip);
+	while (dp->inum != ROOTINO && (ip = dirlookup(dp, "..", 0)) != 0) {  // keep looking up
+		iunlockput(dp);
 		dp = ip;
 		ilock_trans(dp);
-		inum2 = dp->inum;
-		if (inum1 == inum2) {  // path is the root
-			iunlockput(dp);
-			break;
-		}
 		count++;
-		// off = 0;
 	}
+	iunlockput(dp);
 	return count;
 }
@@ -20,11 +20,104 @@ struct superblock {
     uint    nblocks;        // Number of data blocks
     uint    ninodes;        // Number of inodes.
     uint    nlog;           // Number of log blocks
+    uint    ddtstart;       // First dedup table block
+    uint    nddt;           // Number of dedup table blocks
 };
 
 #define NDIRECT 10   // change from 12 to 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// Extent-mapped inodes (IF_EXTENT) use addrs[] as the root of a
+// tree of extents instead of a block list: an extenthdr followed
+// by NEXTROOT entries.  Other tree nodes are whole blocks holding
+// a header and NEXTNODE entries.  In a node of depth 0 each entry
+// is an extent; higher up, entry i maps the file blocks from its
+// lblk to the next entry's lblk, and pblk is the node below.
+// Entries are sorted by lblk, so lookups are binary searches.
+struct extent {
+    uint    lblk;           // first file block
+    uint    pblk;           // first disk block, or child node
+    uint    len;            // blocks in the run (0 in index entries)
+};
+
+struct extenthdr {
+    ushort  nent;           // entries in use
+    ushort  depth;          // 0 if the entries are extents
+};
+
+#define NEXTROOT (((NDIRECT+3)*sizeof(uint) - sizeof(struct extenthdr)) / sizeof(struct extent))
+#define NEXTNODE ((BSIZE - sizeof(struct extenthdr)) / sizeof(struct extent))
+#define EXTENTS(h) ((struct extent*)((struct extenthdr*)(h) + 1))
+
+// Inode format flags (dinode iflags)
+#define IF_EXTENT 0x1   // content mapped by extents, not addrs[]
+#define IF_HASHDIR 0x2  // directory indexed by name hash
+#define IF_INLINE 0x4   // content stored in addrs[] itself
+#define IF_COMPRESS 0x8 // extent-mapped content stored compressed
+#define IF_DEDUP 0x10   // records shared with identical ones (ddt.c)
+
+// Bytes of content an IF_INLINE inode holds in place of addrs[].
+#define NINLINE ((NDIRECT+3)*sizeof(uint))
+
+// An IF_COMPRESS or IF_DEDUP file is kept in records of CRECBLKS
+// file blocks, each mapped by one extent that starts on a record
+// boundary.  A record of an IF_COMPRESS file that compresses
+// (lz.c) into fewer disk blocks than it spans is stored as a zhdr
+// and the compressed bytes, and its extent's len is the disk
+// blocks used or'ed with EXT_ZIP.  Other records are stored as
+// they are, up to the end of the file.  A record whose blocks
+// are shared through the dedup table has EXT_DDT set.
+#define CRECBLKS 4
+#define CRECSIZE (CRECBLKS*BSIZE)
+#define EXT_ZIP 0x80000000
+#define EXT_DDT 0x40000000
+#define EXT_FLAGS (EXT_ZIP|EXT_DDT)
+
+// A regular file may be given a record size of up to MAXRECBLKS
+// blocks (recsize()); one with more than a block is kept in
+// records of that many blocks, mapped like those above.  A
+// directory's record size is what files created in it take.
+#define MAXRECBLKS 128
+
+struct zhdr {
+    ushort  clen;           // compressed bytes after the header
+    ushort  rlen;           // bytes they decompress to
+};
+
+// Bytes of scratch space lzcompress() needs.
+#define LZSCRATCH 4096
+
+// Dedup table block: a bucket of entries, each for a run of
+// blocks that IF_DEDUP records share.  See ddt.c.
+struct ddtent {
+    uint    hash;           // ddthash() of the blocks
+    uint    pblk;           // first disk block
+    uint    nblk;           // blocks in the run
+    uint    ref;            // extents using it, 0 if the slot is free
+};
+
+#define DDTPB (BSIZE / sizeof(struct ddtent))
+
+// Disk set (raid.c, mkfs -r): the file system striped across
+// ndata data disks, hdb onwards, and a parity disk after them.
+// Block b is block 1 + b/ndata of data disk b%ndata, and the same
+// block of the parity disk is the XOR of that stripe.  Block 0
+// of each disk is a label.
+struct raidlabel {
+    uint    magic;
+    uint    ndata;          // data disks
+    uint    member;         // this disk's place; ndata is parity
+    uint    nstripe;        // blocks after the label
+};
+
+#define RAIDMAGIC 0x64696172  // "raid"
+
+// A disk that starts with this is a cache disk (l2arc.c), whose
+// blocks from 1 on hold copies of file system blocks.
+#define L2LABEL "xv6 l2arc"
 
 // On-disk inode structure
 struct dinode {
@@ -33,11 +126,15 @@ struct dinode {
     short   minor;          // Minor device number (T_DEV only)
     short   nlink;          // Number of links to inode in file system
     uint    size;           // Size of file (bytes)
-    uint    addrs[NDIRECT+1]; // Data block addresses
+    uint    addrs[NDIRECT+3]; // Data block addresses
     // add by hgp
     short child1;
     short child2;
     uint checksum;
+    uint    iflags;         // IF_* format flags
+    uint    gen;            // bumped each time the disk inode changes
+    uint    recblks;        // blocks per record; 0 or 1 for none
+    uint    spare[11];      // pad to 128 bytes
 };
 
 // Inodes per block.
@@ -60,6 +157,94 @@ struct dirent {
     char    name[DIRSIZ];
 };
 
+#define NDIRENT (BSIZE / sizeof(struct dirent))
+
+// A directory that outgrows its first block is hashed
+// (IF_HASHDIR).  Block 0 keeps "." and ".." and, in the other
+// slots, an index of the leaf blocks sorted by the smallest
+// name hash each one holds; the leaves are ordinary dirent
+// blocks.  Once that index is full it moves down into an index
+// block, and block 0 indexes the index blocks instead; each of
+// those is split like a leaf when it fills.  An index slot has
+// inum 0, so programs that read the directory, like ls, see it
+// as an empty entry.
+struct dxslot {
+    ushort  inum;           // always 0
+    ushort  blk[2];         // leaf or index block, 0 if unused
+    ushort  depth;          // first slot of block 0: index blocks under it
+    uint    hash[2];        // smallest hash under the block
+};
+
+#define NDXLEAF ((NDIRENT - 2) * 2)   // entries in block 0's index
+#define NDXNODE (NDIRENT * 2)         // entries in an index block
+
+// Snapshots.  The table lives in block 1 after the super block.
+// A snapshot keeps the whole disk as it was when it was taken:
+// the first time a block in use then is changed, its old
+// content is copied to a new block, recorded in the snapshot's
+// block map (a radix tree of NINDIRECT-entry blocks under root).
+// Blocks the file system frees but the snapshot still needs
+// stay allocated and are listed in its dead list.  See
+// snapshot.c.
+#define NSNAP 8
+
+struct snapent {
+    char    name[DIRSIZ];
+    ushort  flags;          // SNAP_*
+    uint    seq;            // creation order
+    uint    root;           // block map root
+    uint    dead;           // first dead list block, or 0
+    uint    nblocks;        // blocks the snapshot holds
+    uint    reap;           // SNAP_DYING: next map key to free
+};
+
+#define SNAP_LIVE  0x1
+#define SNAP_DYING 0x2      // destroyed, blocks being freed
+
+struct snaptab {
+    uint    seq;            // last snapent.seq handed out
+    struct snapent snap[NSNAP];
+    uint    recvseq;        // sender's seq of the last stream received,
+                            // 0 once the file system changes
+};
+
+// Block map entry of a block allocated after the snapshot,
+// which therefore does not need its old content kept.
+#define SNAPNEW 0xffffffff
+
+// Dead list block: runs of blocks held for the snapshot.
+struct deadrun {
+    uint    start;
+    uint    len;
+};
+
+struct deadhdr {
+    uint    next;           // next dead list block, or 0
+    uint    n;              // runs in use
+};
+
+#define NDEADRUN ((BSIZE - sizeof(struct deadhdr)) / sizeof(struct deadrun))
+
+// Replication stream, written by snapsend() and applied to a
+// copy of the file system by recv: a sendhdr, then a sendrec for
+// each block that differs between the two snapshots, then one
+// with bno SENDEND.  A full stream (fromseq 0) has every block
+// in use.
+#define SENDMAGIC 0x646e6573  // "send"
+#define SENDEND 0xffffffff
+
+struct sendhdr {
+    uint    magic;
+    uint    fromseq;        // snapshot the copy must be at, or 0
+    uint    toseq;          // snapshot the stream brings it to
+    struct superblock sb;   // of the sender
+};
+
+struct sendrec {
+    uint    bno;
+    uchar   data[BSIZE];
+};
+
 
 // add for ditto-blocks
 #define DITTO_LOWER  3
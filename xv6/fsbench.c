@@ -0,0 +1,993 @@
+// File system benchmarks.
+//
+// Runs the same workloads on whichever kernel it is started
+// under, so "make qemu-bench" can compare the disk-backed kernel
+// with kernelmemfs (device cost removed) on identical tests.
+//
+// usage: fsbench [test ...]   (no arguments runs every test)
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+#define NROUND   5     // repetitions of each workload
+#define FILESZ   (64*1024)  // bytes in the sequential file
+#define NSMALL   30    // files in the create/unlink workload
+#define NFULL    6     // FILESZ files written by the allocation workload
+#define NAPPEND  128   // records each writer appends in the append workload
+#define NMANY    80    // empty files each process creates in the inode workload
+#define NREADER  4     // processes in the parallel read workload
+#define NSCAN    20    // times each reader lists the directory and reads the file
+#define MAXDEPTH 8     // deepest path in the lookup workload
+#define NOPEN    200   // opens of each path in the lookup workload
+#define NLOGW    100   // writes in each case of the log workload
+#define NSNAPSZ  4     // file system sizes in the snapshot workload
+#define NSNAPF   2     // FILESZ files added at each size
+#define NSNAPC   10    // snapshots taken at each size
+#define NZIP     3     // rounds of each case of the compression workload
+#define NDUP     4     // FILESZ copies written by the dedup workload
+#define NSENDSZ  4     // file system sizes in the send workload
+#define NSENDF   2     // FILESZ files added at each size
+#define NSTRIPE  8     // FILESZ chunks in the striping workload's file
+#define NL2SET   4     // FILESZ chunks in the cache disk workload's file
+#define NL2READ  2000  // random block reads in each of its passes
+#define NRECSET  4     // FILESZ chunks in the record size workload's file
+#define NRECW    200   // random block overwrites in that workload
+#define NLSENT   200   // small files in the listing workload's directory
+#define NBIGDIR  2000  // names in the large directory workload
+
+#define NELEM(x) (sizeof(x)/sizeof((x)[0]))
+
+char buf[4096];
+
+// Fill name with prefix followed by a two-digit number.
+void
+mkname(char *name, char *prefix, int i)
+{
+  int n = strlen(prefix);
+
+  memmove(name, prefix, n);
+  name[n] = '0' + (i / 10) % 10;
+  name[n+1] = '0' + i % 10;
+  name[n+2] = '\0';
+}
+
+void
+report(char *test, int ops, char *unit, int ticks)
+{
+  printf(1, "fsbench: %s %d %s in %d ticks\n", test, ops, unit, ticks);
+}
+
+// Sequential writes of a FILESZ file, in 4 KB chunks.
+void
+writetest(void)
+{
+  int fd, i, n, t0;
+
+  memset(buf, 'w', sizeof(buf));
+  t0 = uptime();
+  for(i = 0; i < NROUND; i++){
+    unlink("bench.seq");
+    if((fd = open("bench.seq", O_CREATE|O_RDWR)) < 0){
+      printf(1, "fsbench: create bench.seq failed\n");
+      exit();
+    }
+    for(n = 0; n < FILESZ; n += sizeof(buf))
+      if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+        printf(1, "fsbench: write failed\n");
+        exit();
+      }
+    close(fd);
+  }
+  report("write", NROUND * FILESZ / 1024, "KB", uptime() - t0);
+}
+
+// Sequential reads of the file left behind by writetest.
+void
+readtest(void)
+{
+  int fd, i, n, t0, tot;
+
+  tot = 0;
+  t0 = uptime();
+  for(i = 0; i < NROUND; i++){
+    if((fd = open("bench.seq", O_RDONLY)) < 0){
+      printf(1, "fsbench: open bench.seq failed\n");
+      exit();
+    }
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      tot += n;
+    close(fd);
+  }
+  report("read", tot / 1024, "KB", uptime() - t0);
+}
+
+// Create, write one block into, and unlink many small files.
+void
+createtest(void)
+{
+  char name[16];
+  int fd, i, r, t0;
+
+  memset(buf, 'c', BSIZE);
+  t0 = uptime();
+  for(r = 0; r < NROUND; r++){
+    for(i = 0; i < NSMALL; i++){
+      mkname(name, "bench.c", i);
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      write(fd, buf, BSIZE);
+      close(fd);
+    }
+    for(i = 0; i < NSMALL; i++){
+      mkname(name, "bench.c", i);
+      unlink(name);
+    }
+  }
+  report("create", NROUND * NSMALL, "files", uptime() - t0);
+}
+
+// Allocation throughput, along the lines of usertests' bigfile
+// and fsfull: write NFULL files of FILESZ, then delete them all,
+// NROUND times.  Most useful on a large image, e.g. built with
+// make MKFSFLAGS="-s 4194304".
+void
+alloctest(void)
+{
+  char name[16];
+  int fd, i, n, r, t0, t1, tfree;
+
+  memset(buf, 'a', sizeof(buf));
+  tfree = 0;
+  t0 = uptime();
+  for(r = 0; r < NROUND; r++){
+    for(i = 0; i < NFULL; i++){
+      mkname(name, "bench.a", i);
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      for(n = 0; n < FILESZ; n += sizeof(buf))
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+          printf(1, "fsbench: write %s failed\n", name);
+          exit();
+        }
+      close(fd);
+    }
+    t1 = uptime();
+    for(i = 0; i < NFULL; i++){
+      mkname(name, "bench.a", i);
+      unlink(name);
+    }
+    tfree += uptime() - t1;
+  }
+  report("alloc", NROUND * NFULL * (FILESZ / BSIZE), "blocks", uptime() - t0 - tfree);
+  report("free", NROUND * NFULL * (FILESZ / BSIZE), "blocks", tfree);
+}
+
+// Two processes append 512-byte records to their own files at
+// the same time, the pattern that interleaves the files' blocks
+// when each append allocates its block at once.
+void
+appendtest(void)
+{
+  char name[16];
+  int fd, i, pid, r, t0;
+
+  t0 = uptime();
+  for(r = 0; r < NROUND; r++){
+    if((pid = fork()) < 0){
+      printf(1, "fsbench: fork failed\n");
+      exit();
+    }
+    mkname(name, "bench.l", pid == 0);
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf(1, "fsbench: create %s failed\n", name);
+      exit();
+    }
+    memset(buf, 'l', 512);
+    for(i = 0; i < NAPPEND; i++)
+      if(write(fd, buf, 512) != 512){
+        printf(1, "fsbench: append %s failed\n", name);
+        exit();
+      }
+    close(fd);
+    unlink(name);
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  report("append", NROUND * 2 * NAPPEND, "blocks", uptime() - t0);
+}
+
+// Two processes create NMANY empty files each in one directory
+// and then unlink them, along the lines of usertests' concreate
+// and bigdir.  Nearly all of the cost is inode allocation and
+// directory updates.
+void
+inodetest(void)
+{
+  char name[16];
+  int fd, i, pid, r, t0;
+
+  t0 = uptime();
+  for(r = 0; r < NROUND; r++){
+    if((pid = fork()) < 0){
+      printf(1, "fsbench: fork failed\n");
+      exit();
+    }
+    for(i = 0; i < NMANY; i++){
+      mkname(name, pid == 0 ? "bench.ia" : "bench.ib", i);
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      close(fd);
+    }
+    for(i = 0; i < NMANY; i++){
+      mkname(name, pid == 0 ? "bench.ia" : "bench.ib", i);
+      unlink(name);
+    }
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  report("inode", NROUND * 2 * NMANY, "files", uptime() - t0);
+}
+
+// NREADER processes at once list the current directory and
+// read a file in it, like many ls and cat running in parallel.
+// Every path lookup goes through the same directory, so this
+// measures how well readers share inodes.  Run with CPUS=4.
+void
+parallelreadtest(void)
+{
+  struct stat st;
+  char name[DIRSIZ+1];
+  struct dirent de;
+  int dfd, fd, i, n, p, t0;
+
+  if((fd = open("bench.r", O_CREATE|O_RDWR)) < 0){
+    printf(1, "fsbench: create bench.r failed\n");
+    exit();
+  }
+  memset(buf, 'r', sizeof(buf));
+  for(n = 0; n < 4; n++)
+    write(fd, buf, sizeof(buf));
+  close(fd);
+
+  t0 = uptime();
+  for(p = 0; p < NREADER; p++){
+    if((n = fork()) < 0){
+      printf(1, "fsbench: fork failed\n");
+      exit();
+    }
+    if(n > 0)
+      continue;
+    for(i = 0; i < NSCAN; i++){
+      if((dfd = open(".", O_RDONLY)) < 0){
+        printf(1, "fsbench: open . failed\n");
+        exit();
+      }
+      while(read(dfd, &de, sizeof(de)) == sizeof(de)){
+        if(de.inum == 0)
+          continue;
+        memmove(name, de.name, DIRSIZ);
+        name[DIRSIZ] = 0;
+        stat(name, &st);
+      }
+      close(dfd);
+      if((fd = open("bench.r", O_RDONLY)) < 0){
+        printf(1, "fsbench: open bench.r failed\n");
+        exit();
+      }
+      while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+      close(fd);
+    }
+    exit();
+  }
+  for(p = 0; p < NREADER; p++)
+    wait();
+  report("parallel", NREADER * NSCAN, "scans", uptime() - t0);
+  unlink("bench.r");
+}
+
+// open() latency against path depth: bench.d/d/d/.../f with
+// 1 to MAXDEPTH directories, each path opened NOPEN times.
+// Directory lookups dominate, so the time per open should grow
+// with the depth much more slowly once names are cached.
+void
+lookuptest(void)
+{
+  char path[8 + 2*MAXDEPTH + 2];
+  int depth, fd, i, n, t0;
+
+  strcpy(path, "bench.d");
+  for(depth = 1; depth <= MAXDEPTH; depth++){
+    if(mkdir(path) < 0){
+      printf(1, "fsbench: mkdir %s failed\n", path);
+      exit();
+    }
+    n = strlen(path);
+    strcpy(path + n, "/f");
+    if((fd = open(path, O_CREATE|O_RDWR)) < 0){
+      printf(1, "fsbench: create %s failed\n", path);
+      exit();
+    }
+    close(fd);
+
+    t0 = uptime();
+    for(i = 0; i < NOPEN; i++){
+      if((fd = open(path, O_RDONLY)) < 0){
+        printf(1, "fsbench: open %s failed\n", path);
+        exit();
+      }
+      close(fd);
+    }
+    printf(1, "fsbench: lookup depth %d: %d opens in %d ticks\n",
+           depth, NOPEN, uptime() - t0);
+    strcpy(path + n, "/d");
+  }
+
+  // Remove the tree from the bottom up.
+  for(depth = MAXDEPTH; depth >= 1; depth--){
+    path[5 + 2*depth] = '\0';
+    n = strlen(path);
+    strcpy(path + n, "/f");
+    unlink(path);
+    path[n] = '\0';
+    unlink(path);
+  }
+}
+
+// Fill name with prefix followed by a four-digit number.
+void
+mkname4(char *name, char *prefix, int i)
+{
+  mkname(name, prefix, i / 100);
+  mkname(name + strlen(prefix) + 2, "", i);
+}
+
+// Link NBIGDIR names to one file in a fresh directory, look
+// each of them up, then unlink them all.  The directory
+// outgrows one block of hashed index, so the times show
+// whether a create or lookup stays cheap as it grows.
+void
+bigdirtest(void)
+{
+  char name[16];
+  int fd, i, t0;
+
+  if(mkdir("bench.bd") < 0 || (fd = open("bench.bd/f", O_CREATE|O_RDWR)) < 0){
+    printf(1, "fsbench: create bench.bd failed\n");
+    exit();
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(i = 0; i < NBIGDIR; i++){
+    mkname4(name, "bench.bd/n", i);
+    if(link("bench.bd/f", name) < 0){
+      printf(1, "fsbench: link %s failed\n", name);
+      exit();
+    }
+  }
+  report("bigdir create", NBIGDIR, "names", uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < NBIGDIR; i++){
+    mkname4(name, "bench.bd/n", i);
+    if((fd = open(name, O_RDONLY)) < 0){
+      printf(1, "fsbench: open %s failed\n", name);
+      exit();
+    }
+    close(fd);
+  }
+  report("bigdir lookup", NBIGDIR, "names", uptime() - t0);
+
+  t0 = uptime();
+  for(i = 0; i < NBIGDIR; i++){
+    mkname4(name, "bench.bd/n", i);
+    unlink(name);
+  }
+  report("bigdir unlink", NBIGDIR, "names", uptime() - t0);
+
+  unlink("bench.bd/f");
+  unlink("bench.bd");
+}
+
+// What ls does to directory path: read the entries and stat
+// each one.  Returns how many it found.
+int
+lsdir(char *path)
+{
+  char name[32];
+  struct dirent de;
+  struct stat st;
+  int fd, n, len;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  len = strlen(path);
+  memmove(name, path, len);
+  name[len] = '/';
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de)){
+    if(de.inum == 0)
+      continue;
+    memmove(name + len + 1, de.name, DIRSIZ);
+    name[len + 1 + DIRSIZ] = '\0';
+    if(stat(name, &st) >= 0)
+      n++;
+  }
+  close(fd);
+  return n;
+}
+
+// ls of a directory of NLSENT small files, cold and then warm.
+// Only the first run after boot is cold, so the directory is
+// left behind: the first "fsbench ls" creates it, and after a
+// reboot "fsbench ls" times reading it from the disk, where
+// each entry's inode block and first block are prefetched.
+void
+lstest(void)
+{
+  char name[16];
+  int fd, i, n, t0;
+
+  if((fd = open("bench.ls", O_RDONLY)) >= 0){
+    close(fd);
+  } else {
+    mkdir("bench.ls");
+    memset(buf, 's', 300);
+    for(i = 0; i < NLSENT; i++){
+      strcpy(name, "bench.ls/f");
+      name[10] = '0' + i / 100;
+      name[11] = '0' + i / 10 % 10;
+      name[12] = '0' + i % 10;
+      name[13] = '\0';
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0 || write(fd, buf, 300) != 300){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      close(fd);
+    }
+    printf(1, "fsbench: ls: made bench.ls; reboot and run fsbench ls for a cold cache\n");
+  }
+
+  for(i = 0; i < 2; i++){
+    t0 = uptime();
+    n = lsdir("bench.ls");
+    printf(1, "fsbench: ls %s: %d entries in %d ticks\n", i ? "again" : "first", n, uptime() - t0);
+  }
+}
+
+// One case of logtest: NLOGW 512-byte writes to fd at off (or
+// appended if off < 0), filled with c, or if c is 0 with a
+// different byte each time and the count in the first byte.
+void
+logcase(int fd, char *what, int off, int c)
+{
+  struct fsstat s0, s1;
+  int i;
+
+  if(off < 0)
+    lseek(fd, 0, SEEK_END);
+  fsstat(&s0);
+  for(i = 0; i < NLOGW; i++){
+    memset(buf, c ? c : 'a' + i % 26, 512);
+    if(c == 0)
+      buf[0] = i;  // the checksum is an XOR, blind to repeated words
+    if(off >= 0)
+      lseek(fd, off, SEEK_SET);
+    if(write(fd, buf, 512) != 512){
+      printf(1, "fsbench: write bench.log failed\n");
+      exit();
+    }
+  }
+  fsstat(&s1);
+  printf(1, "fsbench: log %s: %d writes, %d log blocks, %d inode writes, %d skipped\n",
+         what, NLOGW, s1.nlogged - s0.nlogged, s1.niwrite - s0.niwrite,
+         s1.niskip - s0.niskip);
+}
+
+// Log blocks per write.  Rewriting a block in place with the
+// same bytes changes no inode field, so only the data block
+// should reach the log; new bytes change the checksum, and
+// appends the size, so those also write the inode.
+void
+logtest(void)
+{
+  int fd;
+
+  if((fd = open("bench.log", O_CREATE|O_RDWR)) < 0){
+    printf(1, "fsbench: create bench.log failed\n");
+    exit();
+  }
+  memset(buf, 's', sizeof(buf));
+  write(fd, buf, sizeof(buf));
+  close(fd);
+
+  fd = open("bench.log", O_RDWR);
+  logcase(fd, "same", 0, 's');
+  logcase(fd, "changed", 0, 0);
+  logcase(fd, "append", -1, 'p');
+  close(fd);
+  unlink("bench.log");
+}
+
+// Snapshot creation as the file system fills up.  Taking a
+// snapshot only writes its table entry and an empty map, so
+// the time and log blocks per snapshot should stay flat.
+void
+snaptest(void)
+{
+  struct fsstat s0, s1;
+  char name[DIRSIZ];
+  int i, j, k, fd, t0, t1;
+
+  for(i = 0; i < NSNAPSZ; i++){
+    for(j = 0; j < NSNAPF; j++){
+      mkname(name, "bench.snap", i * NSNAPF + j);
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      memset(buf, 'a' + i, sizeof(buf));
+      for(k = 0; k < FILESZ; k += sizeof(buf))
+        write(fd, buf, sizeof(buf));
+      close(fd);
+    }
+
+    fsstat(&s0);
+    t0 = uptime();
+    for(k = 0; k < NSNAPC; k++){
+      if(snapshot("bench") < 0 || snapdestroy("bench") < 0){
+        printf(1, "fsbench: snapshot failed\n");
+        exit();
+      }
+    }
+    t1 = uptime();
+    fsstat(&s1);
+    printf(1, "fsbench: snap with %d KB of files: %d snapshots, %d log blocks, %d ticks\n",
+           (i + 1) * NSNAPF * FILESZ / 1024, NSNAPC, s1.nlogged - s0.nlogged, t1 - t0);
+  }
+
+  for(i = 0; i < NSNAPSZ * NSNAPF; i++){
+    mkname(name, "bench.snap", i);
+    unlink(name);
+  }
+}
+
+// Fill buf with numbered lines of text if text is set, else
+// with pseudo-random bytes.
+void
+zipfill(int text, uint *seed)
+{
+  static char line[] = "the quick brown fox jumps over the lazy dog ";
+  int i, j;
+  uint v;
+  char d[10];
+
+  for(i = 0; i < sizeof(buf); ){
+    if(!text){
+      *seed = *seed * 1103515245 + 12345;
+      buf[i++] = *seed >> 16;
+      continue;
+    }
+    for(j = 0; line[j] && i < sizeof(buf); j++)
+      buf[i++] = line[j];
+    v = (*seed)++;
+    j = 0;
+    do {
+      d[j++] = '0' + v % 10;
+      v /= 10;
+    } while(v);
+    while(j > 0 && i < sizeof(buf))
+      buf[i++] = d[--j];
+    if(i < sizeof(buf))
+      buf[i++] = '\n';
+  }
+}
+
+// Print KB moved in ticks as KB/s (100 ticks a second).
+void
+zipreport(char *what, char *how, char *op, int kb, int ticks)
+{
+  printf(1, "fsbench: zip %s %s %s: %d KB in %d ticks, %d KB/s\n",
+         what, how, op, kb, ticks, ticks ? kb * 100 / ticks : 0);
+}
+
+// Write and read a FILESZ file of text, which compresses, and
+// of random bytes, which does not, stored as it is and with
+// O_COMPRESS.  fstat's blocks gives the space it took on disk.
+void
+ziptest(void)
+{
+  struct stat st;
+  char *how;
+  int text, z, i, n, fd, t0;
+  uint seed;
+
+  for(text = 1; text >= 0; text--){
+    for(z = 0; z < 2; z++){
+      how = z ? "compressed" : "plain";
+      t0 = uptime();
+      for(i = 0; i < NZIP; i++){
+        unlink("bench.zip");
+        if((fd = open("bench.zip", O_CREATE|O_RDWR|(z ? O_COMPRESS : 0))) < 0){
+          printf(1, "fsbench: create bench.zip failed\n");
+          exit();
+        }
+        seed = 1;
+        for(n = 0; n < FILESZ; n += sizeof(buf)){
+          zipfill(text, &seed);
+          if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+            printf(1, "fsbench: write bench.zip failed\n");
+            exit();
+          }
+        }
+        close(fd);
+      }
+      zipreport(text ? "text" : "random", how, "write", NZIP * FILESZ / 1024, uptime() - t0);
+
+      t0 = uptime();
+      for(i = 0; i < NZIP; i++){
+        fd = open("bench.zip", O_RDONLY);
+        while(read(fd, buf, sizeof(buf)) > 0)
+          ;
+        close(fd);
+      }
+      zipreport(text ? "text" : "random", how, "read", NZIP * FILESZ / 1024, uptime() - t0);
+
+      fd = open("bench.zip", O_RDONLY);
+      fstat(fd, &st);
+      close(fd);
+      printf(1, "fsbench: zip %s %s: %d bytes in %d blocks, ratio %d.%d%d\n",
+             text ? "text" : "random", how, st.size, st.blocks,
+             st.size / (st.blocks * BSIZE), st.size * 10 / (st.blocks * BSIZE) % 10,
+             st.size * 100 / (st.blocks * BSIZE) % 10);
+    }
+  }
+  unlink("bench.zip");
+}
+
+// Write NDUP files with the same content, each of which also
+// repeats itself, stored as they are and with O_DEDUP.  Reports
+// the time taken and the disk blocks used, from fsstat's count
+// of free blocks, and how many records dedup stored by reference.
+void
+deduptest(void)
+{
+  struct fsstat s0, s1;
+  char name[16];
+  int d, i, n, fd, t0, t1;
+
+  for(d = 0; d < 2; d++){
+    fsstat(&s0);
+    t0 = uptime();
+    for(i = 0; i < NDUP; i++){
+      mkname(name, "bench.dup", i);
+      if((fd = open(name, O_CREATE|O_RDWR|(d ? O_DEDUP : 0))) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      for(n = 0; n < FILESZ; n += sizeof(buf)){
+        memset(buf, 'a' + (n / sizeof(buf)) % 4, sizeof(buf));
+        if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+          printf(1, "fsbench: write %s failed\n", name);
+          exit();
+        }
+      }
+      close(fd);
+    }
+    t1 = uptime();
+    fsstat(&s1);
+    printf(1, "fsbench: dedup %s: %d KB in %d ticks, %d blocks used, %d records shared\n",
+           d ? "on" : "off", NDUP * FILESZ / 1024, t1 - t0, s0.nfree - s1.nfree,
+           s1.ndedup - s0.ndedup);
+    for(i = 0; i < NDUP; i++){
+      mkname(name, "bench.dup", i);
+      unlink(name);
+    }
+  }
+}
+
+// Send the stream from snapshot from to snapshot to into a pipe
+// that a child empties.  Returns the number of blocks sent.
+int
+sendpipe(char *from, char *to)
+{
+  int p[2], n;
+
+  if(pipe(p) < 0){
+    printf(1, "fsbench: pipe failed\n");
+    exit();
+  }
+  if(fork() == 0){
+    close(p[1]);
+    while(read(p[0], buf, sizeof(buf)) > 0)
+      ;
+    exit();
+  }
+  close(p[0]);
+  n = snapsend(from, to, p[1]);
+  close(p[1]);
+  wait();
+  if(n < 0){
+    printf(1, "fsbench: snapsend failed\n");
+    exit();
+  }
+  return n;
+}
+
+// Incremental and full streams as the file system fills up.
+// Between the two snapshots one 4 KB chunk is rewritten each
+// time, so the incremental stream should stay the same size
+// and take the same time while the full one grows.
+void
+sendtest(void)
+{
+  char name[DIRSIZ];
+  int i, j, k, n, fd, t0, t1, t2;
+
+  for(i = 0; i < NSENDSZ; i++){
+    for(j = 0; j < NSENDF; j++){
+      mkname(name, "bench.send", i * NSENDF + j);
+      if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create %s failed\n", name);
+        exit();
+      }
+      memset(buf, 'a' + i, sizeof(buf));
+      for(k = 0; k < FILESZ; k += sizeof(buf))
+        write(fd, buf, sizeof(buf));
+      close(fd);
+    }
+
+    if(snapshot("bench.a") < 0){
+      printf(1, "fsbench: snapshot failed\n");
+      exit();
+    }
+    fd = open("bench.send00", O_RDWR);
+    memset(buf, 'z' - i, sizeof(buf));
+    write(fd, buf, sizeof(buf));
+    close(fd);
+    if(snapshot("bench.b") < 0){
+      printf(1, "fsbench: snapshot failed\n");
+      exit();
+    }
+
+    t0 = uptime();
+    n = sendpipe("bench.a", "bench.b");
+    t1 = uptime();
+    j = sendpipe("", "bench.b");
+    t2 = uptime();
+    printf(1, "fsbench: send with %d KB of files: incremental %d blocks in %d ticks, "
+           "full %d blocks in %d ticks\n",
+           (i + 1) * NSENDF * FILESZ / 1024, n, t1 - t0, j, t2 - t1);
+
+    snapdestroy("bench.a");
+    snapdestroy("bench.b");
+  }
+
+  for(i = 0; i < NSENDSZ * NSENDF; i++){
+    mkname(name, "bench.send", i);
+    unlink(name);
+  }
+}
+
+// Sequential write and read of a file larger than the buffer
+// cache, so the read goes to the disk.  Run it under "make qemu"
+// and "make qemu-raid" to compare one disk with a disk set: the
+// report says how many data disks the blocks are striped across.
+void
+stripetest(void)
+{
+  struct fsstat st;
+  int fd, i, n, tot, t0, t1, t2;
+
+  unlink("bench.stripe");
+  memset(buf, 's', sizeof(buf));
+  t0 = uptime();
+  if((fd = open("bench.stripe", O_CREATE|O_RDWR)) < 0){
+    printf(1, "fsbench: create bench.stripe failed\n");
+    exit();
+  }
+  for(i = 0; i < NSTRIPE * FILESZ; i += sizeof(buf))
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf(1, "fsbench: write failed\n");
+      exit();
+    }
+  close(fd);
+
+  t1 = uptime();
+  tot = 0;
+  for(i = 0; i < NROUND; i++){
+    if((fd = open("bench.stripe", O_RDONLY)) < 0){
+      printf(1, "fsbench: open bench.stripe failed\n");
+      exit();
+    }
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      tot += n;
+    close(fd);
+  }
+  t2 = uptime();
+
+  fsstat(&st);
+  printf(1, "fsbench: stripe over %d data disks: write %d KB in %d ticks, "
+         "read %d KB in %d ticks, %d blocks rebuilt from parity\n",
+         st.ndisk, NSTRIPE * FILESZ / 1024, t1 - t0, tot / 1024, t2 - t1, st.nrebuilt);
+  unlink("bench.stripe");
+}
+
+// Resilver member 0 of a disk set twice, the second time with
+// NSTRIPE * FILESZ more in use.  The time taken should follow the
+// stripes in use, not the size of the disks.
+void
+resilvertest(void)
+{
+  struct fsstat st;
+  int fd, i, n, t0;
+
+  for(i = 0; i < 2; i++){
+    if(i == 1){
+      if((fd = open("bench.rs", O_CREATE|O_RDWR)) < 0){
+        printf(1, "fsbench: create bench.rs failed\n");
+        exit();
+      }
+      memset(buf, 'r', sizeof(buf));
+      for(n = 0; n < NSTRIPE * FILESZ; n += sizeof(buf))
+        write(fd, buf, sizeof(buf));
+      close(fd);
+    }
+
+    fsstat(&st);
+    t0 = uptime();
+    if((n = resilver(0)) < 0){
+      printf(1, "fsbench: resilver: no disk set\n");
+      break;
+    }
+    printf(1, "fsbench: resilver with %d blocks free: %d stripes in %d ticks\n",
+           st.nfree, n, uptime() - t0);
+  }
+  unlink("bench.rs");
+}
+
+// Random block reads over a file larger than the buffer cache
+// but smaller than the cache disk.  The first pass warms the
+// cache disk; the second should be served from it.  Run it under
+// "make qemu" and "make qemu-l2arc" to compare.
+void
+l2arctest(void)
+{
+  struct fsstat st0, st1;
+  int fd, i, pass, t0;
+  uint seed;
+
+  unlink("bench.l2");
+  if((fd = open("bench.l2", O_CREATE|O_RDWR)) < 0){
+    printf(1, "fsbench: create bench.l2 failed\n");
+    exit();
+  }
+  memset(buf, 'l', sizeof(buf));
+  for(i = 0; i < NL2SET * FILESZ; i += sizeof(buf))
+    write(fd, buf, sizeof(buf));
+
+  seed = 1;
+  for(pass = 0; pass < 2; pass++){
+    fsstat(&st0);
+    t0 = uptime();
+    for(i = 0; i < NL2READ; i++){
+      seed = seed * 1103515245 + 12345;
+      lseek(fd, (seed >> 8) % (NL2SET * FILESZ / BSIZE) * BSIZE, SEEK_SET);
+      if(read(fd, buf, BSIZE) != BSIZE){
+        printf(1, "fsbench: read bench.l2 failed\n");
+        exit();
+      }
+    }
+    fsstat(&st1);
+    printf(1, "fsbench: l2arc %s: %d reads of %d KB in %d ticks, "
+           "%d from the cache disk, %d blocks filled\n",
+           pass ? "warm" : "cold", NL2READ, NL2SET * FILESZ / 1024, uptime() - t0,
+           st1.nl2hit - st0.nl2hit, st1.nl2fill - st0.nl2fill);
+  }
+  close(fd);
+  unlink("bench.l2");
+}
+
+// Write, read and randomly overwrite a file with each record
+// size.  Large records move more at a time past the buffer cache
+// and log; small overwrites pay for that by copying the record.
+void
+recsizetest(void)
+{
+  static int sizes[] = { 512, 4096, 65536 };
+  int fd, i, k, t0, tw, tr;
+  uint seed;
+
+  for(k = 0; k < NELEM(sizes); k++){
+    unlink("bench.rec");
+    if((fd = open("bench.rec", O_CREATE|O_RDWR)) < 0 || recsize(fd, sizes[k]) != sizes[k]){
+      printf(1, "fsbench: create bench.rec failed\n");
+      exit();
+    }
+    memset(buf, 'q', sizeof(buf));
+    t0 = uptime();
+    for(i = 0; i < NRECSET * FILESZ; i += sizeof(buf))
+      write(fd, buf, sizeof(buf));
+    tw = uptime() - t0;
+
+    lseek(fd, 0, SEEK_SET);
+    t0 = uptime();
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;
+    tr = uptime() - t0;
+
+    seed = 1;
+    t0 = uptime();
+    for(i = 0; i < NRECW; i++){
+      seed = seed * 1103515245 + 12345;
+      lseek(fd, (seed >> 8) % (NRECSET * FILESZ / BSIZE) * BSIZE, SEEK_SET);
+      write(fd, buf, BSIZE);
+    }
+    printf(1, "fsbench: recsize %d: write %d KB in %d ticks, read in %d, "
+           "%d block overwrites in %d\n", sizes[k], NRECSET * FILESZ / 1024,
+           tw, tr, NRECW, uptime() - t0);
+    close(fd);
+  }
+  unlink("bench.rec");
+}
+
+struct {
+  char *name;
+  void (*fn)(void);
+} tests[] = {
+  { "write",  writetest },
+  { "read",   readtest },
+  { "create", createtest },
+  { "alloc",  alloctest },
+  { "append", appendtest },
+  { "inode",  inodetest },
+  { "parallel", parallelreadtest },
+  { "lookup", lookuptest },
+  { "bigdir", bigdirtest },
+  { "ls",     lstest },
+  { "log",    logtest },
+  { "snap",   snaptest },
+  { "zip",    ziptest },
+  { "dedup",  deduptest },
+  { "send",   sendtest },
+  { "stripe", stripetest },
+  { "resilver", resilvertest },
+  { "l2arc",  l2arctest },
+  { "recsize", recsizetest },
+};
+
+int
+main(int argc, char *argv[])
+{
+  int i, j;
+
+  if(argc < 2){
+    for(i = 0; i < NELEM(tests); i++)
+      tests[i].fn();
+  } else {
+    for(j = 1; j < argc; j++){
+      for(i = 0; i < NELEM(tests); i++)
+        if(strcmp(argv[j], tests[i].name) == 0)
+          break;
+      if(i == NELEM(tests)){
+        printf(2, "fsbench: unknown test %s\n", argv[j]);
+        exit();
+      }
+      tests[i].fn();
+    }
+  }
+  unlink("bench.seq");
+  exit();
+}
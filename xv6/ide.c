@@ -1,4 +1,14 @@
 // Simple PIO-based (non-DMA) IDE driver code.
+//
+// Disks 0 and 1 are on the primary channel, 2 and 3 (hdc and hdd)
+// on the secondary one.  Each channel has its own queue, so
+// requests for disks on different channels are served in
+// parallel.  If ROOTDEV is a disk set (raid.c), iderw() hands its
+// blocks to raidrw(), which turns them into requests for the
+// member disks.  A disk labelled as a cache disk holds the
+// second-level buffer cache (l2arc.c).  Any other disk can hold
+// a file system mounted under the root (fsmount() in fs.c); the
+// device number of a file system is its disk's number.
 
 #include "types.h"
 #include "defs.h"
@@ -18,26 +28,47 @@
 #define IDE_DF        0x20
 #define IDE_ERR       0x01
 
+#define IDE_DRQ       0x08
+
 #define IDE_CMD_READ  0x20
 #define IDE_CMD_WRITE 0x30
+#define IDE_CMD_READ_EXT  0x24
+#define IDE_CMD_WRITE_EXT 0x34
+#define IDE_CMD_IDENTIFY  0xec
+
+#define LBA28_MAX     (1 << 28)  // first sector that needs LBA48
+
+#define NIDEDISK      4  // two drives on each of two channels
 
-// idequeue points to the buf now being read/written to the disk.
-// idequeue->qnext points to the next buf to be processed.
-// You must hold idelock while manipulating queue.
+// idequeue[c] points to the buf now being read/written on
+// channel c, and idequeue[c]->qnext to the next one.
+// You must hold idelock while manipulating the queues.
 
 static struct spinlock idelock;
-static struct buf *idequeue;
+static struct buf *idequeue[2];
 
-static int havedisk1;
+static int havedisk[NIDEDISK];
+static int claimed[NIDEDISK];  // in use by the root, raid.c, l2arc.c or a mount
 static void idestart(struct buf*);
+static void ideidentify(int);
 
-// Wait for IDE disk to become ready.
+// Command block and device control ports of each channel.
+static ushort ideport[2] = { 0x1f0, 0x170 };
+static ushort idectl[2] = { 0x3f6, 0x376 };
+
+// Geometry reported by IDENTIFY DEVICE, per drive.
+static struct {
+  uint nsectors;  // addressable sectors
+  int lba48;      // drive supports 48-bit addressing
+} idedisk[NIDEDISK];
+
+// Wait for the selected disk of channel c to become ready.
 static int
-idewait(int checkerr)
+idewait(int c, int checkerr)
 {
   int r;
 
-  while(((r = inb(0x1f7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY) 
+  while(((r = inb(ideport[c]+7)) & (IDE_BSY|IDE_DRDY)) != IDE_DRDY) 
     ;
   if(checkerr && (r & (IDE_DF|IDE_ERR)) != 0)
     return -1;
@@ -47,72 +78,203 @@ idewait(int checkerr)
 void
 ideinit(void)
 {
-  int i;
+  int i, d, c, r;
   
   initlock(&idelock, "ide");
   picenable(IRQ_IDE);
   ioapicenable(IRQ_IDE, ncpu - 1);
-  idewait(0);
+  picenable(IRQ_IDE+1);
+  ioapicenable(IRQ_IDE+1, ncpu - 1);
+  idewait(0, 0);
+  havedisk[0] = 1;
   
-  // Check if disk 1 is present
-  outb(0x1f6, 0xe0 | (1<<4));
-  for(i=0; i<1000; i++){
-    if(inb(0x1f7) != 0){
-      havedisk1 = 1;
-      break;
+  // Check which of disks 1-3 are present.  A channel with no
+  // drives reads as 0, and one that is not there at all as 0xff.
+  for(d = 1; d < NIDEDISK; d++){
+    c = d >> 1;
+    outb(ideport[c]+6, 0xe0 | ((d&1)<<4));
+    for(i=0; i<1000; i++){
+      if((r = inb(ideport[c]+7)) != 0 && r != 0xff){
+        havedisk[d] = 1;
+        break;
+      }
     }
+
+    if(havedisk[d])
+      ideidentify(d);
+
+    // Switch back to the channel's first disk.
+    outb(ideport[c]+6, 0xe0 | (0<<4));
   }
-  
-  // Switch back to disk 0.
-  outb(0x1f6, 0xe0 | (0<<4));
+
+  // The boot disk, and the root with the members of its disk set.
+  raidinit();
+  for(d = 0; d <= ROOTDEV + raidwidth(ROOTDEV) && d < NIDEDISK; d++)
+    claimed[d] = 1;
+  l2init();
+}
+
+// Take disk d for a file system or the cache disk.  Returns -1
+// if it is not there or already taken.
+int
+ideclaim(int d)
+{
+  int r;
+
+  acquire(&idelock);
+  r = -1;
+  if(d >= 0 && d < NIDEDISK && havedisk[d] && !claimed[d]){
+    claimed[d] = 1;
+    r = 0;
+  }
+  release(&idelock);
+  return r;
+}
+
+// Give back disk d, taken with ideclaim().
+void
+ideunclaim(int d)
+{
+  acquire(&idelock);
+  claimed[d] = 0;
+  release(&idelock);
+}
+
+// Ask drive d for its size with IDENTIFY DEVICE.
+// Polled, with the interrupt masked, since it only runs at boot.
+static void
+ideidentify(int d)
+{
+  ushort id[256];
+  int r, c;
+
+  c = d >> 1;
+  outb(idectl[c], 2);  // nIEN: no interrupt for this command
+  outb(ideport[c]+6, 0xe0 | ((d&1)<<4));
+  outb(ideport[c]+7, IDE_CMD_IDENTIFY);
+  while((r = inb(ideport[c]+7)) & IDE_BSY)
+    ;
+  if((r & (IDE_ERR|IDE_DRQ)) != IDE_DRQ){
+    // Not an ATA drive that answers IDENTIFY; trust the superblock.
+    idedisk[d].nsectors = 0xffffffff;
+    outb(idectl[c], 0);
+    return;
+  }
+  insl(ideport[c], id, sizeof(id)/4);
+  outb(idectl[c], 0);
+
+  // Word 83 bit 10: 48-bit address feature set.
+  // Words 100-103 hold the LBA48 sector count, words 60-61 the LBA28 one.
+  idedisk[d].lba48 = (id[83] & (1<<10)) != 0;
+  if(idedisk[d].lba48 && (id[102] | id[103]) != 0)
+    idedisk[d].nsectors = 0xffffffff;  // more than we can name with a uint
+  else if(idedisk[d].lba48)
+    idedisk[d].nsectors = id[100] | ((uint)id[101] << 16);
+  else
+    idedisk[d].nsectors = id[60] | ((uint)id[61] << 16);
+  cprintf("ide: disk %d has %d sectors%s\n", d, idedisk[d].nsectors,
+          idedisk[d].lba48 ? " (lba48)" : "");
+}
+
+// Read sector of disk d into dst, polled like ideidentify(),
+// for use at boot before there are processes to sleep.
+// Returns -1 if the disk is not there or reports an error.
+int
+ideread0(int d, uint sector, void *dst)
+{
+  int c, r;
+
+  if(d < 0 || d >= NIDEDISK || !havedisk[d] || sector >= LBA28_MAX)
+    return -1;
+
+  c = d >> 1;
+  outb(idectl[c], 2);
+  outb(ideport[c]+6, 0xe0 | ((d&1)<<4) | ((sector>>24)&0x0f));
+  idewait(c, 0);
+  outb(ideport[c]+2, 1);
+  outb(ideport[c]+3, sector & 0xff);
+  outb(ideport[c]+4, (sector >> 8) & 0xff);
+  outb(ideport[c]+5, (sector >> 16) & 0xff);
+  outb(ideport[c]+7, IDE_CMD_READ);
+  while((r = inb(ideport[c]+7)) & IDE_BSY)
+    ;
+  if((r & (IDE_ERR|IDE_DF|IDE_DRQ)) != IDE_DRQ){
+    outb(idectl[c], 0);
+    return -1;
+  }
+  insl(ideport[c], dst, SECTOR_SIZE/4);
+  outb(idectl[c], 0);
+  return 0;
 }
 
 // Start the request for b.  Caller must hold idelock.
 static void
 idestart(struct buf *b)
 {
+  int d, c;
+  ushort port;
+  int ext;
+
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
-    panic("incorrect blockno");
+  d = b->dev;
+  c = d >> 1;
+  port = ideport[c];
   int sector_per_block =  BSIZE/SECTOR_SIZE;
-  int sector = b->blockno * sector_per_block;
+  uint sector = b->blockno * sector_per_block;
 
   if (sector_per_block > 7) panic("idestart");
-  
-  idewait(0);
-  outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
-  outb(0x1f3, sector & 0xff);
-  outb(0x1f4, (sector >> 8) & 0xff);
-  outb(0x1f5, (sector >> 16) & 0xff);
-  outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
+  if(idedisk[d].nsectors &&
+     (b->blockno >= idedisk[d].nsectors / sector_per_block))
+    panic("idestart: block beyond end of disk");
+
+  // LBA28 is cheaper to program, so only use LBA48 past its reach.
+  ext = sector + sector_per_block > LBA28_MAX;
+  if(ext && !idedisk[d].lba48)
+    panic("idestart: disk lacks lba48");
+
+  idewait(c, 0);
+  outb(idectl[c], 0);  // generate interrupt
+  if(ext){
+    // High-order bytes go first; the registers are two-deep FIFOs.
+    outb(port+6, 0x40 | ((d&1)<<4));
+    outb(port+2, 0);
+    outb(port+3, (sector >> 24) & 0xff);
+    outb(port+4, 0);  // bits 32-47: blockno is only 32 bits wide
+    outb(port+5, 0);
+  }
+  outb(port+2, sector_per_block);  // number of sectors
+  outb(port+3, sector & 0xff);
+  outb(port+4, (sector >> 8) & 0xff);
+  outb(port+5, (sector >> 16) & 0xff);
+  if(!ext)
+    outb(port+6, 0xe0 | ((d&1)<<4) | ((sector>>24)&0x0f));
   if(b->flags & B_DIRTY){
-    outb(0x1f7, IDE_CMD_WRITE);
-    outsl(0x1f0, b->data, BSIZE/4);
+    outb(port+7, ext ? IDE_CMD_WRITE_EXT : IDE_CMD_WRITE);
+    outsl(port, b->data, BSIZE/4);
   } else {
-    outb(0x1f7, IDE_CMD_READ);
+    outb(port+7, ext ? IDE_CMD_READ_EXT : IDE_CMD_READ);
   }
 }
 
-// Interrupt handler.
+// Interrupt handler for channel c.
 void
-ideintr(void)
+ideintr(int c)
 {
   struct buf *b;
 
   // First queued buffer is the active request.
   acquire(&idelock);
-  if((b = idequeue) == 0){
+  if((b = idequeue[c]) == 0){
     release(&idelock);
     // cprintf("spurious IDE interrupt\n");
     return;
   }
-  idequeue = b->qnext;
+  idequeue[c] = b->qnext;
 
   // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(!(b->flags & B_DIRTY) && idewait(c, 1) >= 0)
+    insl(ideport[c], b->data, BSIZE/4);
   
   // Wake process waiting for this buf.
   b->flags |= B_VALID;
@@ -120,44 +282,108 @@ ideintr(void)
   wakeup(b);
   
   // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+  if(idequeue[c] != 0)
+    idestart(idequeue[c]);
 
   release(&idelock);
+
+  // Nobody waits for a read-ahead; hand it back to the cache.
+  // Not under idelock, since l2evict() takes it inside bcache.lock.
+  if(b->flags & B_ASYNC)
+    bdone(b);
+}
+
+// Sectors on disk d, or 0 if it is not there.
+uint
+idesize(int d)
+{
+  if(d < 0 || d >= NIDEDISK || !havedisk[d])
+    return 0;
+  return idedisk[d].nsectors;
 }
 
 //PAGEBREAK!
-// Sync buf with disk. 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Queue the n bufs in bv, whose dev is a disk number.
+// Caller must hold idelock.
+static void
+idequeuev(struct buf **bv, int n)
+{
+  struct buf *b, **pp;
+  int i, c;
+
+  for(i = 0; i < n; i++){
+    b = bv[i];
+    if(b->dev >= NIDEDISK || !havedisk[b->dev])
+      panic("iderw: ide disk not present");
+    c = b->dev >> 1;
+
+    // Append b to its channel's queue.
+    b->qnext = 0;
+    for(pp=&idequeue[c]; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
+      ;
+    *pp = b;
+  
+    // Start disk if necessary.
+    if(idequeue[c] == b)
+      idestart(b);
+  }
+}
+
+// Start the n bufs in bv and return without waiting for them.
+// ideintr() sets B_VALID and clears B_DIRTY as each one is done.
 void
-iderw(struct buf *b)
+ideiostart(struct buf **bv, int n)
 {
-  struct buf **pp;
+  acquire(&idelock);
+  idequeuev(bv, n);
+  release(&idelock);
+}
 
-  if(!(b->flags & B_BUSY))
-    panic("iderw: buf not busy");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+// Read or write the n bufs in bv, whose dev is a disk number,
+// as iderw() does: all of them are queued before waiting, so
+// those on different channels are served in parallel.
+void
+ideio(struct buf **bv, int n)
+{
+  int i;
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
-  
-  // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  idequeuev(bv, n);
   
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Wait for the requests to finish.
+  for(i = 0; i < n; i++){
+    while((bv[i]->flags & (B_VALID|B_DIRTY)) != B_VALID){
+      sleep(bv[i], &idelock);
+    }
   }
 
   release(&idelock);
 }
+
+// Sync the n bufs in bv, all of one device, with the disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!(bv[i]->flags & B_BUSY))
+      panic("iderw: buf not busy");
+    if((bv[i]->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+  }
+
+  if(n > 0 && raidwidth(bv[0]->dev) > 0)
+    raidrw(bv, n);
+  else
+    ideio(bv, n);
+}
+
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
+}
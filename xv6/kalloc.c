@@ -94,3 +94,20 @@ kalloc(void)
   return (char*)r;
 }
 
+// Number of free pages, for sizing caches at boot.
+int
+kfreepages(void)
+{
+  struct run *r;
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = 0;
+  for(r = kmem.freelist; r; r = r->next)
+    n++;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
+
@@ -0,0 +1,309 @@
+// Second-level buffer cache on a cache disk, in the manner of
+// ZFS's L2ARC.
+//
+// A disk labelled L2LABEL (see fs.h; "make l2arc.img") catches
+// the clean blocks of ROOTDEV that the buffer cache evicts.  Its
+// blocks from 1 on are a ring of slots filled in order by a write
+// hand.  Evicted blocks are copied into a batch of L2BATCH slots
+// in memory, and a full batch is written with one ideiostart(),
+// which returns at once, so eviction never waits for the cache
+// disk.  There are two batches: one filling and one being
+// written.  If the one to fill next is still being written, the
+// cache disk is behind and evicted blocks are dropped until it
+// catches up.
+//
+// The index of what the slots hold is only in memory, so the
+// cache starts empty at boot.  bread() asks l2read() on a miss
+// before going to ROOTDEV.  A block in one of the two batches is
+// copied from memory, and one in an older slot is read from the
+// cache disk.  bwrite() calls l2inval(), since the copy would be
+// stale.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define L2HASH 257  // index hash buckets, a prime
+
+struct l2ent {
+    uint dev;       // 0 if the slot holds nothing
+    uint blockno;
+    uint gen;       // bumped each time the slot is filled
+    int hnext;      // next slot in the hash chain, or -1
+};
+
+struct {
+    struct spinlock lock;
+    int disk;       // cache disk, or -1 if there is none
+    uint nslot;     // slots on it, an even number of batches
+    uint hand;      // next slot to fill
+    struct l2ent ent[NL2ARC];
+    int head[L2HASH];
+    struct buf batch[2][L2BATCH];  // slots hand/L2BATCH (mod 2) fill
+    uint nhit;
+    uint nfill;
+} l2;
+
+// Look for a cache disk among disks 2 and 3 that the disk set
+// does not use.  Called by ideinit(), before interrupts are on.
+void l2init (void)
+{
+    uchar buf[BSIZE];
+    uint n;
+    int d, i;
+
+    initlock(&l2.lock, "l2arc");
+    l2.disk = -1;
+
+    for (i = 0; i < L2HASH; i++) {
+        l2.head[i] = -1;
+    }
+
+    for (d = 2; d <= 3 && l2.disk < 0; d++) {
+        if (ideread0(d, 0, buf) < 0 || memcmp(buf, L2LABEL, sizeof(L2LABEL)) != 0) {
+            continue;
+        }
+
+        n = idesize(d) / (BSIZE / 512) - 1;
+        if (n > NL2ARC) {
+            n = NL2ARC;
+        }
+        // An even number of batches, so that batch b always fills
+        // l2.batch[b % 2], even across the wrap.
+        n -= n % (2 * L2BATCH);
+
+        // Slots in the batches must not come round again while
+        // they are being read from memory.
+        if (n < 4 * L2BATCH || ideclaim(d) < 0) {
+            continue;
+        }
+
+        l2.disk = d;
+        l2.nslot = n;
+        cprintf("l2arc: cache disk %d, %d blocks\n", d, n);
+    }
+
+    for (i = 0; i < 2 * L2BATCH; i++) {
+        l2.batch[i / L2BATCH][i % L2BATCH].dev = l2.disk;
+        l2.batch[i / L2BATCH][i % L2BATCH].data = l2.batch[i / L2BATCH][i % L2BATCH].cache;
+    }
+}
+
+static uint l2hash (uint dev, uint blockno)
+{
+    return (blockno ^ (dev << 24)) % L2HASH;
+}
+
+// The slot holding block blockno of dev, or -1.
+static int l2find (uint dev, uint blockno)
+{
+    int s;
+
+    for (s = l2.head[l2hash(dev, blockno)]; s >= 0; s = l2.ent[s].hnext) {
+        if (l2.ent[s].dev == dev && l2.ent[s].blockno == blockno) {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+// Empty slot s.
+static void l2drop (int s)
+{
+    int *pp;
+
+    if (l2.ent[s].dev == 0) {
+        return;
+    }
+
+    for (pp = &l2.head[l2hash(l2.ent[s].dev, l2.ent[s].blockno)]; *pp >= 0;
+         pp = &l2.ent[*pp].hnext) {
+        if (*pp == s) {
+            *pp = l2.ent[s].hnext;
+            break;
+        }
+    }
+
+    l2.ent[s].dev = 0;
+}
+
+// The buf in memory that holds slot s, or 0 if s is only on the
+// cache disk: s must be behind the hand in the batch being
+// filled, or in the one before it.  Slots of the batch being
+// filled that are past the hand still hold last lap's blocks,
+// which are on the cache disk.
+static struct buf* l2mem (uint s)
+{
+    uint b, cur;
+
+    b = s / L2BATCH;
+    cur = l2.hand / L2BATCH;
+
+    if (b == cur ? s >= l2.hand : (b + 1) % (l2.nslot / L2BATCH) != cur) {
+        return 0;
+    }
+
+    return &l2.batch[b % 2][s % L2BATCH];
+}
+
+// Has the batch bv been written to the cache disk?
+static int l2written (struct buf *bv)
+{
+    int i;
+
+    for (i = 0; i < L2BATCH; i++) {
+        if (bv[i].flags & B_DIRTY) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// b, a valid buffer of the buffer cache, is being recycled:
+// keep a copy on the cache disk.  Called with bcache.lock held,
+// so it must not sleep.
+void l2evict (struct buf *b)
+{
+    struct buf *bv[L2BATCH], *fill;
+    uint s;
+    int i;
+
+    if (l2.disk < 0 || b->dev != ROOTDEV) {
+        return;
+    }
+
+    acquire(&l2.lock);
+
+    // Writes drop the copy, so one that is there is current.
+    if (l2find(b->dev, b->blockno) >= 0) {
+        release(&l2.lock);
+        return;
+    }
+
+    s = l2.hand;
+    fill = l2.batch[(s / L2BATCH) % 2];
+
+    if (s % L2BATCH == 0) {
+        if (!l2written(fill)) {
+            release(&l2.lock);
+            return;
+        }
+
+        // The slots of the batch lose what they held a lap ago.
+        for (i = 0; i < L2BATCH; i++) {
+            l2drop(s + i);
+        }
+    }
+
+    memmove(fill[s % L2BATCH].data, b->data, BSIZE);
+    l2.ent[s].dev = b->dev;
+    l2.ent[s].blockno = b->blockno;
+    l2.ent[s].gen++;
+    i = l2hash(b->dev, b->blockno);
+    l2.ent[s].hnext = l2.head[i];
+    l2.head[i] = s;
+    l2.nfill++;
+
+    if (++l2.hand % L2BATCH == 0) {
+        for (i = 0; i < L2BATCH; i++) {
+            fill[i].blockno = 1 + s - s % L2BATCH + i;
+            fill[i].flags = B_BUSY | B_DIRTY;
+            bv[i] = &fill[i];
+        }
+        ideiostart(bv, L2BATCH);
+
+        if (l2.hand == l2.nslot) {
+            l2.hand = 0;
+        }
+    }
+
+    release(&l2.lock);
+}
+
+// Fill b, which missed in the buffer cache, from the cache disk.
+// Returns 0 if the block is not there.
+int l2read (struct buf *b)
+{
+    struct buf *pb, *mb;
+    uint gen;
+    int s, ok;
+
+    if (l2.disk < 0 || b->dev != ROOTDEV) {
+        return 0;
+    }
+
+    acquire(&l2.lock);
+
+    if ((s = l2find(b->dev, b->blockno)) < 0) {
+        release(&l2.lock);
+        return 0;
+    }
+
+    if ((mb = l2mem(s)) != 0) {
+        memmove(b->data, mb->data, BSIZE);
+        l2.nhit++;
+        release(&l2.lock);
+        b->flags |= B_VALID;
+        return 1;
+    }
+
+    gen = l2.ent[s].gen;
+    release(&l2.lock);
+
+    if ((pb = (struct buf*) kalloc()) == 0) {
+        return 0;
+    }
+
+    pb->dev = l2.disk;
+    pb->blockno = 1 + s;
+    pb->flags = B_BUSY;
+    pb->data = b->data;
+    ideio(&pb, 1);
+    kfree((char*) pb);
+
+    // The hand may have come round to the slot meanwhile.
+    acquire(&l2.lock);
+    ok = l2.ent[s].gen == gen && l2.ent[s].dev == b->dev && l2.ent[s].blockno == b->blockno;
+    if (ok) {
+        l2.nhit++;
+    }
+    release(&l2.lock);
+
+    if (ok) {
+        b->flags |= B_VALID;
+    }
+
+    return ok;
+}
+
+// Block blockno of dev is being written: forget the copy.
+void l2inval (uint dev, uint blockno)
+{
+    int s;
+
+    if (l2.disk < 0) {
+        return;
+    }
+
+    acquire(&l2.lock);
+    if ((s = l2find(dev, blockno)) >= 0) {
+        l2drop(s);
+    }
+    release(&l2.lock);
+}
+
+// Report cache disk activity for fsstat().
+void l2stat (struct fsstat *st)
+{
+    acquire(&l2.lock);
+    st->nl2hit = l2.nhit;
+    st->nl2fill = l2.nfill;
+    release(&l2.lock);
+}
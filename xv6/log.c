@@ -2,8 +2,10 @@
 #include "defs.h"
 #include "param.h"
 #include "spinlock.h"
+#include "stat.h"
 #include "fs.h"
 #include "buf.h"
+#include "mount.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
@@ -35,44 +37,101 @@ struct logheader {
   int block[LOGSIZE];
 };
 
-struct log {
-  struct spinlock lock;
+// Each mounted device has its own log, on its own disk, so a
+// block is only ever installed on the device it was logged on.
+// The transaction spans them all: begin_op() and end_op() count
+// the FS system calls in progress whatever device they change,
+// and the last end_op() commits every log that has blocks.
+struct devlog {
   int start;
   int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
-  int dev;
+  int dev;         // 0 if the slot is free
+  uint ncommit;    // transactions committed since boot
+  uint nlogged;    // blocks they wrote to the log
   struct logheader lh;
 };
-struct log log;
 
-static void recover_from_log(void);
-static void commit();
+struct {
+  struct spinlock lock;
+  int outstanding; // how many FS sys calls are executing.
+  int committing;  // in commit(), please wait.
+  int snapreaders; // snapread()s in progress; commit() waits for them.
+  struct devlog dl[NMOUNT];
+} log;
+
+static void recover_from_log(struct devlog*);
+static void commit(struct devlog*);
+
+// The log of device dev.
+static struct devlog*
+logof(uint dev)
+{
+  struct devlog *l;
 
+  for(l = log.dl; l < &log.dl[NMOUNT]; l++){
+    if(l->dev == dev)
+      return l;
+  }
+  panic("logof: device not mounted");
+}
+
+// Set up the log of mounted device dev and replay any
+// committed transaction.  Called from fsinit(), for the root
+// before any other device.
 void
-initlog(void)
+initlog(int dev)
 {
+  struct mount *mp;
+  struct devlog *l;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
-  struct superblock sb;
-  initlock(&log.lock, "log");
-  readsb(ROOTDEV, &sb);
-  log.start = sb.size - sb.nlog;
-  log.size = sb.nlog;
-  log.dev = ROOTDEV;
-  recover_from_log();
+  if(dev == ROOTDEV)
+    initlock(&log.lock, "log");
+
+  // Nothing writes to dev yet, so the slot can be filled in
+  // before it is taken.
+  acquire(&log.lock);
+  for(l = log.dl; l < &log.dl[NMOUNT] && l->dev != 0; l++)
+    ;
+  release(&log.lock);
+  if(l == &log.dl[NMOUNT])
+    panic("initlog: no free log");
+
+  mp = getmount(dev);
+  memset(l, 0, sizeof(*l));
+  l->start = mp->logstart;
+  l->size = mp->sb.nlog;
+  l->dev = dev;
+  recover_from_log(l);
+}
+
+// Give up the log of dev, which is being unmounted and no longer
+// changed, once the blocks it holds have been committed.
+void
+logdrop(int dev)
+{
+  struct devlog *l;
+
+  acquire(&log.lock);
+  l = logof(dev);
+  while(l->lh.n > 0 || log.committing)
+    sleep(&log, &log.lock);
+  l->dev = 0;
+  release(&log.lock);
 }
 
 // Copy committed blocks from log to their home location
 static void 
-install_trans(void)
+install_trans(struct devlog *l)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < l->lh.n; tail++) {
+    struct buf *lbuf = bread(l->dev, l->start+tail+1); // read log block
+    struct buf *dbuf = bread(l->dev, l->lh.block[tail]); // read dst
+    bcow(dbuf);
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
     brelse(lbuf); 
@@ -82,14 +141,14 @@ install_trans(void)
 
 // Read the log header from disk into the in-memory log header
 static void
-read_head(void)
+read_head(struct devlog *l)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bread(l->dev, l->start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  l->lh.n = lh->n;
+  for (i = 0; i < l->lh.n; i++) {
+    l->lh.block[i] = lh->block[i];
   }
   brelse(buf);
 }
@@ -98,26 +157,43 @@ read_head(void)
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(struct devlog *l)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct buf *buf = bread(l->dev, l->start);
+  struct logheader *hb;
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  bcow(buf);
+  hb = (struct logheader *) (buf->data);
+  hb->n = l->lh.n;
+  for (i = 0; i < l->lh.n; i++) {
+    hb->block[i] = l->lh.block[i];
   }
   bwrite(buf);
   brelse(buf);
 }
 
 static void
-recover_from_log(void)
+recover_from_log(struct devlog *l)
+{
+  read_head(l);      
+  install_trans(l); // if committed, copy from log to disk
+  l->lh.n = 0;
+  write_head(l); // clear the log
+}
+
+// Blocks in the fullest log.  Caller holds log.lock.
+static int
+logmax(void)
 {
-  read_head();      
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct devlog *l;
+  int n;
+
+  n = 0;
+  for(l = log.dl; l < &log.dl[NMOUNT]; l++){
+    if(l->dev != 0 && l->lh.n > n)
+      n = l->lh.n;
+  }
+  return n;
 }
 
 // called at the start of each FS system call.
@@ -128,8 +204,10 @@ begin_op(void)
   while(1){
     if(log.committing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(logmax() + (log.outstanding+1)*MAXOPBLOCKS*snapcost() + 3 > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      // The header, and snapcommit()'s map root and block 1,
+      // take the last 3 blocks.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -144,7 +222,8 @@ begin_op(void)
 void
 end_op(void)
 {
-  int do_commit = 0;
+  struct devlog *l;
+  int do_commit = 0, done;
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
@@ -159,9 +238,20 @@ end_op(void)
   release(&log.lock);
 
   if(do_commit){
+    acquire(&log.lock);
+    while(log.snapreaders > 0)
+      sleep(&log, &log.lock);
+    release(&log.lock);
     // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
+    // to sleep with locks.  Blocks of files waiting for delayed
+    // allocation go in first (dasync), a log's worth at a time.
+    do {
+      done = dasync();
+      for(l = log.dl; l < &log.dl[NMOUNT]; l++){
+        if(l->dev != 0)
+          commit(l);
+      }
+    } while(!done);
     acquire(&log.lock);
     log.committing = 0;
     wakeup(&log);
@@ -171,13 +261,14 @@ end_op(void)
 
 // Copy modified blocks from cache to log.
 static void 
-write_log(void)
+write_log(struct devlog *l)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
+  for (tail = 0; tail < l->lh.n; tail++) {
+    struct buf *to = bread(l->dev, l->start+tail+1); // log block
+    struct buf *from = bread(l->dev, l->lh.block[tail]); // cache block
+    bcow(to);
     memmove(to->data, from->data, BSIZE);
     bwrite(to);  // write the log
     brelse(from); 
@@ -186,16 +277,83 @@ write_log(void)
 }
 
 static void
-commit()
+commit(struct devlog *l)
 {
-	if (log.lh.n > 0) {
+	if (l->dev == ROOTDEV)
+		snapcommit();    // Copy what snapshots need into the transaction
+	if (l->lh.n > 0) {
 	cprintf("in commit\n");
-	write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0; 
-    write_head();    // Erase the transaction from the log
+	l->ncommit++;
+	l->nlogged += l->lh.n;
+	write_log(l);     // Write modified blocks from cache to log
+    write_head(l);    // Write header to disk -- the real commit
+    install_trans(l); // Now install writes to home locations
+    l->lh.n = 0; 
+    write_head(l);    // Erase the transaction from the log
+  }
+}
+
+// Report the commit counters of the root for fsstat().
+void
+logstat(struct fsstat *st)
+{
+  struct devlog *l;
+
+  acquire(&log.lock);
+  l = logof(ROOTDEV);
+  st->ncommit = l->ncommit;
+  st->nlogged = l->nlogged;
+  release(&log.lock);
+}
+
+// A snapshot reads blocks that commit() is about to overwrite
+// and the log blocks it copies; keep commit() out meanwhile.
+void
+begin_snapread(void)
+{
+  acquire(&log.lock);
+  while(log.committing)
+    sleep(&log, &log.lock);
+  log.snapreaders++;
+  release(&log.lock);
+}
+
+void
+end_snapread(void)
+{
+  acquire(&log.lock);
+  if(--log.snapreaders == 0)
+    wakeup(&log);
+  release(&log.lock);
+}
+
+// The blocks of the current transaction on dev, for
+// snapcommit() and itrunc().
+int
+logn(uint dev)
+{
+  return logof(dev)->lh.n;
+}
+
+uint
+logblockno(int i)
+{
+  return logof(ROOTDEV)->lh.block[i];
+}
+
+// Is block b of dev part of the current transaction?
+int
+loghas(uint dev, uint b)
+{
+  struct devlog *l;
+  int i;
+
+  l = logof(dev);
+  for (i = 0; i < l->lh.n; i++) {
+    if (l->lh.block[i] == b)
+      return 1;
   }
+  return 0;
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -204,29 +362,30 @@ commit()
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
+//   bcow(bp)
 //   modify bp->data[]
 //   log_write(bp)
 //   brelse(bp)
 void
 log_write(struct buf *b)
 {
+  struct devlog *l;
   int i;
 
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  l = logof(b->dev);
+  if (l->lh.n >= LOGSIZE || l->lh.n >= l->size - 1)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (log.outstanding < 1 && !log.committing)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorbtion
+  for (i = 0; i < l->lh.n; i++) {
+    if (l->lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n)
-    log.lh.n++;
+  l->lh.block[i] = b->blockno;
+  if (i == l->lh.n)
+    l->lh.n++;
   b->flags |= B_DIRTY; // prevent eviction
   release(&log.lock);
 }
-
-
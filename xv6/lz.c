@@ -0,0 +1,213 @@
+// LZ77 compression in the format of LZ4, used for the records
+// of compressed files (see fs.c) and by mkfs.
+//
+// The output is a list of sequences: a token byte whose high
+// nibble counts the literal bytes that follow it and whose low
+// nibble is the length of the match after them, less LZMINMATCH.
+// A nibble of 15 continues in following bytes, each added on,
+// until one is not 255.  The match is a 2-byte little-endian
+// offset back into the output.  The last sequence has only
+// literals and ends the input.
+//
+// The code uses no library calls so that mkfs can link it too.
+
+#include "types.h"
+
+#define LZHASHBITS 11   // LZSCRATCH (fs.h) holds 1<<LZHASHBITS ushorts
+#define LZMINMATCH 4
+
+static uint lzhash (uchar *p)
+{
+    uint v;
+
+    v = p[0] | p[1] << 8 | p[2] << 16 | (uint)p[3] << 24;
+    return (v * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// Write the part of a length beyond its nibble: bytes of 255,
+// then the rest.  Returns the new end of the output, or 0 if it
+// would pass oend.
+static uchar* lzputlen (uchar *op, uchar *oend, uint n)
+{
+    for (; n >= 255; n -= 255) {
+        if (op >= oend) {
+            return 0;
+        }
+        *op++ = 255;
+    }
+
+    if (op >= oend) {
+        return 0;
+    }
+    *op++ = n;
+    return op;
+}
+
+// Write a sequence of nlit literals at lit followed by a match of
+// mlen bytes off back, or by nothing if mlen is 0.
+static uchar* lzseq (uchar *op, uchar *oend, uchar *lit, uint nlit,
+                     uint off, uint mlen)
+{
+    uchar *tok;
+    uint i;
+
+    if (op >= oend) {
+        return 0;
+    }
+
+    tok = op++;
+    *tok = (nlit < 15 ? nlit : 15) << 4;
+
+    if (nlit >= 15 && (op = lzputlen(op, oend, nlit - 15)) == 0) {
+        return 0;
+    }
+
+    if (nlit > oend - op) {
+        return 0;
+    }
+
+    for (i = 0; i < nlit; i++) {
+        *op++ = lit[i];
+    }
+
+    if (mlen == 0) {
+        return op;
+    }
+
+    if (oend - op < 2) {
+        return 0;
+    }
+
+    *op++ = off;
+    *op++ = off >> 8;
+    mlen -= LZMINMATCH;
+    *tok |= mlen < 15 ? mlen : 15;
+
+    if (mlen >= 15) {
+        op = lzputlen(op, oend, mlen - 15);
+    }
+
+    return op;
+}
+
+// Compress the n bytes at src into at most cap bytes at dst,
+// using tab (LZSCRATCH bytes) to find matches.  Returns the
+// compressed length, or -1 as soon as the output would pass
+// cap, so data that does not compress is given up on early.
+int lzcompress (uchar *src, uint n, uchar *dst, uint cap, ushort *tab)
+{
+    uchar *ip, *anchor, *end, *ref, *op, *oend;
+    uint h, mlen;
+
+    for (h = 0; h < (1 << LZHASHBITS); h++) {
+        tab[h] = 0;
+    }
+
+    ip = anchor = src;
+    end = src + n;
+    op = dst;
+    oend = dst + cap;
+
+    while (end - ip >= LZMINMATCH) {
+        h = lzhash(ip);
+        ref = src + tab[h];
+        tab[h] = ip - src;
+
+        if (ref >= ip || ip - ref > 0xffff || ref[0] != ip[0] || ref[1] != ip[1] ||
+            ref[2] != ip[2] || ref[3] != ip[3]) {
+            ip++;
+            continue;
+        }
+
+        for (mlen = LZMINMATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++)
+            ;
+
+        if ((op = lzseq(op, oend, anchor, ip - anchor, ip - ref, mlen)) == 0) {
+            return -1;
+        }
+
+        ip += mlen;
+        anchor = ip;
+    }
+
+    if ((op = lzseq(op, oend, anchor, end - anchor, 0, 0)) == 0) {
+        return -1;
+    }
+
+    return op - dst;
+}
+
+// Read the part of a length beyond its nibble into *n.
+static uchar* lzgetlen (uchar *ip, uchar *iend, uint *n)
+{
+    uint c;
+
+    do {
+        if (ip >= iend) {
+            return 0;
+        }
+        c = *ip++;
+        *n += c;
+    } while (c == 255);
+
+    return ip;
+}
+
+// Decompress the n bytes at src into at most cap bytes at dst.
+// Returns the decompressed length, or -1 if src is not valid
+// compressed data or does not fit.
+int lzdecompress (uchar *src, uint n, uchar *dst, uint cap)
+{
+    uchar *ip, *iend, *op, *oend, *ref;
+    uint tok, nlit, off, mlen;
+
+    ip = src;
+    iend = src + n;
+    op = dst;
+    oend = dst + cap;
+
+    while (ip < iend) {
+        tok = *ip++;
+
+        nlit = tok >> 4;
+        if (nlit == 15 && (ip = lzgetlen(ip, iend, &nlit)) == 0) {
+            return -1;
+        }
+
+        if (nlit > iend - ip || nlit > oend - op) {
+            return -1;
+        }
+
+        for (; nlit > 0; nlit--) {
+            *op++ = *ip++;
+        }
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        mlen = tok & 15;
+        if (mlen == 15 && (ip = lzgetlen(ip, iend, &mlen)) == 0) {
+            return -1;
+        }
+        mlen += LZMINMATCH;
+
+        if (off == 0 || off > op - dst || mlen > oend - op) {
+            return -1;
+        }
+
+        // Byte at a time: the match may overlap what it copies.
+        for (ref = op - off; mlen > 0; mlen--) {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - dst;
+}
@@ -31,12 +31,12 @@ main(void)
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
-  iinit();         // inode cache
   ideinit();       // disk
   if(!ismp)
     timerinit();   // uniprocessor timer
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
+  iinit();         // inode cache, sized from free memory
   userinit();      // first user process
   // Finish setting up this processor in mpmain.
   mpmain();
@@ -1,9 +1,16 @@
 // Fake IDE disk; stores blocks in memory.
 // Useful for running kernel without scratch disk.
+//
+// Reads do not copy: a clean buffer is mapped straight onto
+// the embedded image (B_MAPPED), and bcow() gives it a private
+// copy only when the file system is about to modify it.  With
+// no device cost left, the memfs kernel measures the CPU
+// overhead of the file system code itself.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "stat.h"
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
@@ -25,7 +32,7 @@ ideinit(void)
 
 // Interrupt handler.
 void
-ideintr(void)
+ideintr(int c)
 {
   // no-op
 }
@@ -44,15 +51,114 @@ iderw(struct buf *b)
     panic("iderw: nothing to do");
   if(b->dev != 1)
     panic("iderw: request not for disk 1");
-  if(b->block >= disksize)
+  if(b->blockno >= disksize)
     panic("iderw: block out of range");
 
-  p = memdisk + b->block*BSIZE;
+  p = memdisk + b->blockno*BSIZE;
   
   if(b->flags & B_DIRTY){
     b->flags &= ~B_DIRTY;
-    memmove(p, b->data, BSIZE);
-  } else
-    memmove(b->data, p, BSIZE);
-  b->flags |= B_VALID;
+    if(b->data != p)
+      memmove(p, b->data, BSIZE);
+  }
+  // Now identical to the image: drop the private copy, if any.
+  b->data = p;
+  b->flags |= B_VALID | B_MAPPED;
+}
+
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    iderw(bv[i]);
+}
+
+// The memory disk is the only disk, and it holds the root.
+int
+ideclaim(int d)
+{
+  return -1;
+}
+
+void
+ideunclaim(int d)
+{
+}
+
+uint
+idesize(int d)
+{
+  return d == ROOTDEV ? disksize * (BSIZE/512) : 0;
+}
+
+// Nothing to wait for: do the requests now.
+void
+ideiostart(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    iderw(bv[i]);
+    if(bv[i]->flags & B_ASYNC)
+      bdone(bv[i]);
+  }
+}
+
+// The memory disk is never a disk set (raid.c).
+int
+raidwidth(uint dev)
+{
+  return 0;
+}
+
+int
+raidrebuild(uint dev, uint bn, uchar *dst)
+{
+  return -1;
+}
+
+void
+raidfix(uint dev, uint bn, uchar *data)
+{
+}
+
+void
+raidstat(struct fsstat *st)
+{
+  st->ndisk = 1;
+  st->nrebuilt = 0;
+  st->nresilver = 0;
+  st->nresilvered = 0;
+}
+
+int
+raidresilver(int m)
+{
+  return -1;
+}
+
+// Nor does it have a cache disk (l2arc.c); it is as fast.
+void
+l2evict(struct buf *b)
+{
+}
+
+int
+l2read(struct buf *b)
+{
+  return 0;
+}
+
+void
+l2inval(uint dev, uint blockno)
+{
+}
+
+void
+l2stat(struct fsstat *st)
+{
+  st->nl2hit = 0;
+  st->nl2fill = 0;
 }
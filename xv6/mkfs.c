@@ -16,19 +16,23 @@
 
 
 #define NINODES  300
+#define DDTRATIO 128  // disk blocks per dedup table block
 // Disk layout:
 // [ boot block | sb block | inode blocks | bit map | data blocks | log ]
 
-int nbitmap = FSSIZE/(BSIZE * 8) + 1;
+uint fssize = FSSIZE;  // Size of the image in blocks (-s)
+int zflag;     // Store files compressed (-z)
+uint ndata;    // Data disks of a disk set (-r), 0 for one disk
+uint nbitmap;  // Number of bitmap blocks, one bit per block of fssize
 int nblocks;  // Number of data blocks
 int nmeta;    // Number of meta blocks (inode, bitmap, and 2 extra)
 int nlog = LOGSIZE;
+int nddt;     // Number of dedup table blocks, 1 per DDTRATIO blocks
 int ninodeblocks = NINODES / IPB + 1;
 //int size = 2048;
 
 int fsfd;
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeblock;
 uint freeinode = 1;
 
@@ -41,8 +45,18 @@ uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
 uint ichecksum(struct dinode *din);
 void rblock(struct dinode *din, uint bn, char * dst);
+uint emap(struct dinode *din, uint bn, int alloc);
+uint bmap(struct dinode *din, uint bn, int alloc);
 int readi(struct dinode *din, char * dst, uint off, uint n);
 void copy_dinode_content(struct dinode *src, uint dst);
+void zappend(uchar *data, uint n);
+void zfinish(uint inum, uint size, uint checksum);
+int lzcompress(uchar*, uint, uchar*, uint, ushort*);
+void stripe(char *name);
+
+// Extents of the compressed file being written, one per record.
+struct extent *zext;
+int nzext;
 
 // convert to intel byte order
 ushort
@@ -74,14 +88,39 @@ main(int argc, char *argv[])
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
+  uchar rec[CRECSIZE];
   struct dinode din, din2;
   unsigned int checksum;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+  for(;;){
+    if(argc > 2 && strcmp(argv[1], "-s") == 0){
+      fssize = strtoul(argv[2], 0, 0);
+      argv += 2;
+      argc -= 2;
+    } else if(argc > 1 && strcmp(argv[1], "-z") == 0){
+      zflag = 1;
+      argv++;
+      argc--;
+    } else if(argc > 2 && strcmp(argv[1], "-r") == 0){
+      ndata = strtoul(argv[2], 0, 0);
+      argv += 2;
+      argc -= 2;
+    } else {
+      break;
+    }
+  }
+
+  if(argc < 2 || ndata >= NRAIDDISK){
+    fprintf(stderr, "Usage: mkfs [-s nblocks] [-z] [-r ndata] fs.img files...\n");
+    exit(1);
+  }
+
+  // A file has at most one record per block.
+  if(zflag && (zext = malloc(fssize * sizeof(*zext))) == 0){
+    perror("malloc");
     exit(1);
   }
 
@@ -94,28 +133,38 @@ main(int argc, char *argv[])
     exit(1);
   }
   
+  nbitmap = fssize/(BSIZE * 8) + 1;
+  nddt = fssize/DDTRATIO + 1;
   nmeta = 2 + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nlog - nmeta;
+  nblocks = fssize - nlog - nmeta;
 
   //Creating the super block
   //Total size of the hard disk will be 1024 sectors
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   // so whole disk is size sectors
   sb.nblocks = xint(nblocks);
   //200 inodes
   sb.ninodes = xint(NINODES);
   sb.nlog = xint(nlog);
+  // The dedup table takes the first data blocks; the image
+  // starts out zero, so every entry is free.
+  sb.ddtstart = xint(nmeta);
+  sb.nddt = xint(nddt);
 
   //IPB -> INODES PER BLOCK
-  freeblock = nmeta;  // the first free block that we can allocate
+  freeblock = nmeta + nddt;  // the first free block that we can allocate
 
   printf("nmeta %d (boot, super, inode blocks %u, bitmap blocks %u) blocks %d log %u total %d\n",
-  		nmeta, ninodeblocks, nbitmap, nblocks, nlog, FSSIZE);
+  		nmeta, ninodeblocks, nbitmap, nblocks, nlog, fssize);
 
-  assert(nblocks + nmeta + nlog == xint(FSSIZE));
+  assert(nblocks + nmeta + nlog == fssize);
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
+  // Size the image without writing every block, so that
+  // multi-GB images stay sparse and mkfs stays fast.
+  if(ftruncate(fsfd, (off_t)fssize * BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
 
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
@@ -166,7 +215,14 @@ main(int argc, char *argv[])
     int counter2 = 0;
     char * cbuf = (char * )buf;
     memset((void *) cbuf,0,sizeof(buf));
-    while((cc = read(fd, buf, sizeof(buf))) > 0){
+    nzext = 0;
+    while((cc = read(fd, zflag ? (char*)rec + counter2 % CRECSIZE : buf, sizeof(buf))) > 0){
+      if(zflag){
+        // Gather a record; the checksum is of the content.
+        memmove(buf, rec + counter2 % CRECSIZE, cc);
+        if((counter2 + cc) % CRECSIZE == 0)
+          zappend(rec, CRECSIZE);
+      }
       counter2 += cc;
       uint i;
       unsigned int * bp = (unsigned int *)buf;
@@ -176,7 +232,15 @@ main(int argc, char *argv[])
 		checksum ^= *bp;
 		bp++;
       }
-      iappend(inum, buf, cc);
+      if(!zflag)
+        iappend(inum, buf, cc);
+    }
+    if(zflag){
+      if(counter2 % CRECSIZE)
+        zappend(rec, counter2 % CRECSIZE);
+      zfinish(inum, counter2, checksum);
+      close(fd);
+      continue;
     }
     //fprintf(stderr, "Size of the file: %s is %d bytes \n",argv[i],counter2);
     //fprintf(stderr, "Checksum from fd: %x \n", checksum);
@@ -233,9 +297,81 @@ main(int argc, char *argv[])
   //writes the bitmap to fs.img
   balloc(freeblock);
 
+  if(ndata > 0)
+    stripe(argv[1]);
+
   exit(0);
 }
 
+void
+wdisk(int fd, uint sec, void *buf)
+{
+  if(lseek(fd, sec * 512L, 0) != sec * 512L){
+    perror("lseek");
+    exit(1);
+  }
+  if(write(fd, buf, 512) != 512){
+    perror("write");
+    exit(1);
+  }
+}
+
+// Spread the image just built over a disk set of ndata data disks
+// and a parity disk (see fs.h).  name becomes member 0, and name.1
+// onwards the rest, the last of them parity.
+void
+stripe(char *name)
+{
+  char path[256];
+  uchar *img, *p, par[BSIZE];
+  struct raidlabel l;
+  uint nstripe, m, s, i;
+  int fd[NRAIDDISK];
+
+  nstripe = (fssize + ndata - 1) / ndata;
+  if((img = calloc(nstripe * ndata, BSIZE)) == 0){
+    perror("calloc");
+    exit(1);
+  }
+  for(i = 0; i < fssize; i++)
+    rsect(i, img + i * BSIZE);
+  close(fsfd);
+
+  for(m = 0; m <= ndata; m++){
+    if(m == 0)
+      snprintf(path, sizeof(path), "%s", name);
+    else
+      snprintf(path, sizeof(path), "%s.%u", name, m);
+    if((fd[m] = open(path, O_RDWR|O_CREAT|O_TRUNC, 0666)) < 0){
+      perror(path);
+      exit(1);
+    }
+    memset(par, 0, sizeof(par));
+    l.magic = xint(RAIDMAGIC);
+    l.ndata = xint(ndata);
+    l.member = xint(m);
+    l.nstripe = xint(nstripe);
+    memmove(par, &l, sizeof(l));
+    wdisk(fd[m], 0, par);
+  }
+
+  for(s = 0; s < nstripe; s++){
+    memset(par, 0, sizeof(par));
+    for(m = 0; m < ndata; m++){
+      p = img + (s * ndata + m) * BSIZE;
+      for(i = 0; i < BSIZE; i++)
+        par[i] ^= p[i];
+      wdisk(fd[m], 1 + s, p);
+    }
+    wdisk(fd[ndata], 1 + s, par);
+  }
+
+  for(m = 0; m <= ndata; m++)
+    close(fd[m]);
+  free(img);
+  printf("stripe: %u data disks and parity, %u stripes\n", ndata, nstripe);
+}
+
 void
 wsect(uint sec, void *buf)
 {
@@ -243,6 +379,7 @@ wsect(uint sec, void *buf)
     perror("lseek");
     exit(1);
   }
+  assert(sec < fssize);
   if(write(fsfd, buf, 512) != 512){
     perror("write");
     exit(1);
@@ -315,6 +452,8 @@ ialloc(ushort type)
   din.type = xshort(type);
   din.nlink = xshort(1);
   din.size = xint(0);
+  if(type == T_FILE || type == T_DITTO)
+    din.iflags = xint(IF_EXTENT);
   winode(inum, &din);
   return inum;
 }
@@ -324,16 +463,21 @@ void
 balloc(int used)
 {
   uchar buf[512];
-  int i;
+  uint i, b, blk;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < 512*8);
-  bzero(buf, 512);
-  for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+  assert(used < fssize - nlog);
+  for(b = 0; b < nbitmap; b++){
+    bzero(buf, 512);
+    for(i = 0; i < BPB; i++){
+      // metadata and file blocks, plus the log at the end of the disk
+      blk = b*BPB + i;
+      if(blk < used || (blk >= fssize - nlog && blk < fssize))
+        buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    }
+    wsect(BBLOCK(b*BPB, NINODES), buf);
   }
-  printf("balloc: write bitmap block at sector %zu\n", NINODES/IPB + 3);
-  wsect(NINODES / IPB + 3, buf);
+  printf("balloc: write %u bitmap blocks at sector %zu\n", nbitmap, NINODES/IPB + 3);
 }
 
 
@@ -344,7 +488,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[512];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -352,26 +495,10 @@ iappend(uint inum, void *xp, int n)
   off = xint(din.size);
   while(n > 0){
     fbn = off / 512;
-    assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        // printf("allocate indirect block\n");
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      // printf("read indirect block\n");
-      // The address just points to a block
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    if(xint(din.iflags) & IF_EXTENT)
+      x = emap(&din, fbn, 1);
+    else
+      x = bmap(&din, fbn, 1);
     n1 = min(n, (fbn + 1) * 512 - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * 512), n1);
@@ -412,20 +539,89 @@ readi(struct dinode *din, char *dst, uint off, uint n){
 
 void
 rblock(struct dinode *din, uint bn, char *dst){
+    if(xint(din->iflags) & IF_EXTENT)
+	rsect(emap(din, bn, 0), dst);
+    else
+	rsect(bmap(din, bn, 0), dst);
+}
+
+// Disk block holding file block bn of a block-mapped inode,
+// through up to three levels of indirect blocks.  With alloc
+// set, missing blocks are taken from freeblock.
+uint
+bmap(struct dinode *din, uint bn, int alloc){
     uint indirect[NINDIRECT];
-    uint addr;
+    uint addr, span;
+    int level;
+
     if(bn < NDIRECT){
-	rsect(xint(din->addrs[bn]), dst);
-	return;
+	if(xint(din->addrs[bn]) == 0 && alloc)
+	    din->addrs[bn] = xint(freeblock++);
+	return xint(din->addrs[bn]);
     }
     bn -= NDIRECT;
+    span = NINDIRECT;
+    for(level = 0; bn >= span; level++){
+	assert(level < 2);
+	bn -= span;
+	span *= NINDIRECT;
+    }
+    if(xint(din->addrs[NDIRECT + level]) == 0){
+	assert(alloc);
+	din->addrs[NDIRECT + level] = xint(freeblock++);
+    }
+    addr = xint(din->addrs[NDIRECT + level]);
+    for(; level >= 0; level--){
+	span /= NINDIRECT;
+	rsect(addr, (char*)indirect);
+	if(indirect[bn / span] == 0){
+	    assert(alloc);
+	    indirect[bn / span] = xint(freeblock++);
+	    wsect(addr, (char*)indirect);
+	}
+	addr = xint(indirect[bn / span]);
+	bn %= span;
+    }
+    return addr;
+}
 
-    if(bn < NINDIRECT){
-	rsect(xint(din->addrs[NDIRECT]), (char*)indirect);
-	addr = xint(indirect[bn]);
-	rsect(addr, dst);
-	return;
+// Disk block holding file block bn of an extent-mapped inode.
+// With alloc set, an unmapped bn gets the next free block;
+// mkfs allocates in order, so that usually just lengthens the
+// last extent, and the tree never grows past the root.
+uint
+emap(struct dinode *din, uint bn, int alloc){
+    uint node[BSIZE / sizeof(uint)];
+    struct extenthdr *h = (struct extenthdr*)din->addrs;
+    struct extent *e;
+    int i, n;
+
+    for(;;){
+	e = EXTENTS(h);
+	n = xshort(h->nent);
+	for(i = n - 1; i >= 0 && xint(e[i].lblk) > bn; i--)
+	    ;
+	if(xshort(h->depth) == 0)
+	    break;
+	assert(!alloc);
+	rsect(xint(e[i < 0 ? 0 : i].pblk), (char*)node);
+	h = (struct extenthdr*)node;
+    }
+    if(i >= 0 && bn - xint(e[i].lblk) < xint(e[i].len))
+	return xint(e[i].pblk) + bn - xint(e[i].lblk);
+    assert(alloc);
+
+    if(n > 0 && xint(e[n-1].lblk) + xint(e[n-1].len) == bn &&
+       xint(e[n-1].pblk) + xint(e[n-1].len) == freeblock){
+	e[n-1].len = xint(xint(e[n-1].len) + 1);
+    } else {
+	assert(n < NEXTROOT && (n == 0 || bn > xint(e[n-1].lblk)));
+	e[n].lblk = xint(bn);
+	e[n].pblk = xint(freeblock);
+	e[n].len = xint(1);
+	h->nent = xshort(n + 1);
     }
+    return freeblock++;
 }
 
 uint
@@ -469,3 +665,78 @@ copy_dinode_content(struct dinode *src, uint dst){
 }
 
 
+
+// Append the n bytes at data as the next record of the file
+// being written, compressed if that saves a block, as the
+// kernel's zstore() does.
+void
+zappend(uchar *data, uint n)
+{
+  uchar out[CRECSIZE];
+  ushort tab[LZSCRATCH / sizeof(ushort)];
+  struct zhdr *zh = (struct zhdr*)out;
+  struct extent *x = &zext[nzext];
+  uint nb, b;
+  int clen;
+
+  nb = (n + BSIZE - 1) / BSIZE;
+  memset(out, 0, sizeof(out));
+  clen = -1;
+  if(nb > 1)
+    clen = lzcompress(data, n, out + sizeof(*zh), (nb - 1) * BSIZE - sizeof(*zh), tab);
+
+  x->lblk = xint(nzext * CRECBLKS);
+  x->pblk = xint(freeblock);
+  if(clen >= 0){
+    zh->clen = xshort(clen);
+    zh->rlen = xshort(n);
+    nb = (sizeof(*zh) + clen + BSIZE - 1) / BSIZE;
+    x->len = xint(nb | EXT_ZIP);
+  } else {
+    memmove(out, data, n);
+    x->len = xint(nb);
+  }
+
+  for(b = 0; b < nb; b++)
+    wsect(freeblock++, out + b * BSIZE);
+  nzext++;
+}
+
+// Give compressed inode inum the records in zext[], building
+// levels of extent tree blocks above them until the top level
+// fits in the inode.
+void
+zfinish(uint inum, uint size, uint checksum)
+{
+  char node[BSIZE];
+  struct extenthdr *h;
+  struct dinode din;
+  int i, k, n, depth;
+
+  n = nzext;
+  for(depth = 0; n > NEXTROOT; depth++){
+    for(i = 0, k = 0; i < n; i += NEXTNODE, k++){
+      memset(node, 0, sizeof(node));
+      h = (struct extenthdr*)node;
+      h->nent = xshort(min(n - i, NEXTNODE));
+      h->depth = xshort(depth);
+      memmove(EXTENTS(h), zext + i, xshort(h->nent) * sizeof(*zext));
+      // Entry k is done with, since k <= i.
+      zext[k].lblk = zext[i].lblk;
+      zext[k].pblk = xint(freeblock);
+      zext[k].len = 0;
+      wsect(freeblock++, node);
+    }
+    n = k;
+  }
+
+  rinode(inum, &din);
+  h = (struct extenthdr*)din.addrs;
+  h->nent = xshort(n);
+  h->depth = xshort(depth);
+  memmove(EXTENTS(h), zext, n * sizeof(*zext));
+  din.size = xint(size);
+  din.iflags = xint(IF_EXTENT | IF_COMPRESS);
+  din.checksum = xint(checksum);
+  winode(inum, &din);
+}
@@ -0,0 +1,22 @@
+// Mount the file system on an IDE disk on a directory.
+//
+//   mount disk dir    disk is 2 for hdc or 3 for hdd
+//   mount -u dir      unmount the disk mounted on dir
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+int
+main(int argc, char *argv[])
+{
+  if(argc == 3 && strcmp(argv[1], "-u") == 0){
+    if(umount(argv[2]) < 0)
+      printf(2, "mount: cannot unmount %s\n", argv[2]);
+  } else if(argc == 3){
+    if(mount(atoi(argv[1]), argv[2]) < 0)
+      printf(2, "mount: cannot mount disk %s on %s\n", argv[1], argv[2]);
+  } else {
+    printf(2, "usage: mount disk dir | mount -u dir\n");
+  }
+  exit();
+}
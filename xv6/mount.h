@@ -0,0 +1,39 @@
+// A mounted file system: the super block, read once at mount,
+// the disk layout derived from it, and the in-memory maps of
+// free blocks and free inodes (see fs.c).
+
+struct mount {
+    uint dev;               // 0 if the slot is free
+    struct inode *covered;  // directory mounted on; 0 for the root
+    struct superblock sb;   // cached super block
+    uint inodestart;        // first inode block
+    uint bmapstart;         // first free bitmap block
+    uint datastart;         // first data block
+    uint logstart;          // log header block
+
+    // Free blocks.
+    struct {
+        struct spinlock lock;
+        uint nms;               // metaslabs (= bitmap blocks)
+        uint nleaf;             // leaves in tree[], a power of 2 >= nms
+        uint cursor;            // where the next allocation starts looking
+        uint tree[2*NMETASLAB]; // free counts; tree[1] is the total
+    } fsmap;
+
+    // Free inodes.
+    struct {
+        struct spinlock lock;
+        uint nfree;                 // free inodes
+        uint hint;                  // lowest inode that may be free
+        uchar used[MAXINODES / 8];  // 1 = allocated
+    } imap;
+};
+
+// Disk block holding inode inum, and the bitmap block
+// holding the bit for block b.
+#define MIBLOCK(mp, inum) ((mp)->inodestart + (inum) / IPB)
+#define MBBLOCK(mp, b)    ((mp)->bmapstart + (b) / BPB)
+
+// Mounted snapshots are read-only devices that share the
+// layout of the file system they were taken of.
+#define ISSNAPDEV(dev) ((dev) >= SNAPDEV)
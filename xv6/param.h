@@ -3,13 +3,28 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum number of cached i-nodes
+#define IMEMDIV     256  // inode cache gets 1/IMEMDIV of free memory
+#define IHASHSIZE  1021  // inode cache hash buckets, a prime
+#define NDCACHE     509  // name lookup cache entries, a prime
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
+#define SNAPDEV      16  // device number of mounted snapshot 0; NSNAP of them
+#define NMOUNT        3  // mounted file systems, the root included
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
-#define HASHSIZE     4001  // a prime number greater than 2*FSSIZE
+#define MAXSNAPCOST   6  // most log blocks a logged block takes with snapshots
+#define LOGSIZE      (MAXOPBLOCKS*MAXSNAPCOST+3)  // max data blocks in on-disk log
+#define NBUF         (LOGSIZE+10)  // size of disk block cache
+#define FSSIZE       2000  // default size of file system in blocks (mkfs -s)
+#define NMETASLAB  8192  // max bitmap blocks the allocator tracks (16 GB disk)
+#define HASHSIZE    151  // buffer cache hash buckets, a prime greater than 2*NBUF
+#define NDELALLOC    32  // blocks waiting for delayed allocation
+#define NZCACHE       8  // decompressed records of compressed files
+#define MAXDELALLOC   8  // delayed blocks per inode, allocated in one op
+#define MAXINODES  8192  // max inodes the free-inode map tracks
+#define NRAIDDISK     3  // disks in a disk set, data and parity (hdb-hdd)
+#define RSTHROTTLE    8  // stripes resilvered per tick while other I/O runs
+#define NL2ARC     2048  // blocks the cache disk holds at most
+#define L2BATCH      16  // blocks written to the cache disk at a time
 
@@ -0,0 +1,468 @@
+// Disk sets: the file system striped over several IDE disks with
+// a parity disk, in the manner of RAID-Z.
+//
+// mkfs -r N lays the file system out across N data disks, hdb
+// onwards, and a parity disk after them (see fs.h).  Block b of
+// ROOTDEV is block 1 + b/N of data disk b%N, so the consecutive
+// blocks of a record are on different disks, and reading them
+// with one iderwv() (bprefetch()) keeps all of the disks busy.
+//
+// Writing a block rewrites the parity of its stripe, computed
+// from the stripe's other data blocks rather than from the old
+// parity.  So writing a block again mends whatever parity a
+// crash left behind, and log recovery does just that for the
+// blocks that were being installed.
+//
+// A member that is missing, or has no label, at boot leaves the
+// set degraded: its blocks are rebuilt from the rest of their
+// stripe when read, and writing one only updates the parity.
+// ilock() also uses raidrebuild() to repair a block of a file
+// that fails its checksum.
+//
+// raidresilver() rebuilds the missing member onto the disk that
+// replaces it while the file system stays in use.  It walks the
+// free bitmap (bnextused()) and copies only the stripes that hold
+// blocks in use, in order: rsnext is the first stripe not yet
+// copied.  Meanwhile writes go to the new disk too, and reads use
+// it below rsnext.  Its label is written last, so a resilver cut
+// short leaves the member missing, to be resilvered again.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+
+#define NPBUF (PGSIZE / sizeof(struct buf))  // member bufs in a page
+
+struct {
+    struct spinlock lock;
+    int busy;           // a stripe is being written or rebuilt
+    uint ndata;         // data disks, 0 if ROOTDEV is a plain disk
+    uint nstripe;       // blocks on each disk after the label
+    int failed;         // member that is missing, or -1
+    int present[NRAIDDISK];  // member's disk answers at boot
+    uint nrebuilt;      // blocks rebuilt from parity
+    uint nio;           // raidrw() calls, to tell if the disks are in use
+
+    // Resilver of the failed member onto its disk.
+    int resilvering;
+    uint rsnext;        // first stripe not yet copied
+    uint nresilver;     // stripes in use to copy
+    uint nresilvered;   // stripes copied so far
+} raid;
+
+// Look for a disk set on disks 1 onwards.  Called by ideinit(),
+// before interrupts are on, so it polls.
+void raidinit (void)
+{
+    struct raidlabel *l;
+    uchar buf[BSIZE];
+    int nmissing;
+    uint d, m;
+
+    initlock(&raid.lock, "raid");
+    raid.failed = -1;
+    l = (struct raidlabel*) buf;
+
+    for (d = 1; d <= NRAIDDISK && raid.ndata == 0; d++) {
+        if (ideread0(d, 0, buf) == 0 && l->magic == RAIDMAGIC && l->ndata > 0
+            && l->ndata < NRAIDDISK) {
+            raid.ndata = l->ndata;
+            raid.nstripe = l->nstripe;
+        }
+    }
+
+    if (raid.ndata == 0) {
+        return;
+    }
+
+    nmissing = 0;
+    for (m = 0; m <= raid.ndata; m++) {
+        raid.present[m] = ideread0(1 + m, 0, buf) == 0;
+        if (!raid.present[m] || l->magic != RAIDMAGIC || l->ndata != raid.ndata
+            || l->member != m || l->nstripe != raid.nstripe) {
+            raid.failed = m;
+            nmissing++;
+        }
+    }
+
+    if (nmissing > 1) {
+        panic("raid: more than one disk missing");
+    }
+
+    cprintf("raid: %d data disks and parity, %d stripes", raid.ndata, raid.nstripe);
+    if (raid.failed >= 0) {
+        cprintf(", member %d missing", raid.failed);
+    }
+    cprintf("\n");
+}
+
+// Data disks the blocks of dev are striped across, or 0 if dev
+// is not a disk set.
+int raidwidth (uint dev)
+{
+    return dev == ROOTDEV ? raid.ndata : 0;
+}
+
+static uint member (uint bn)
+{
+    return bn % raid.ndata;
+}
+
+// Does member m hold the current block of stripe s?  Not if it
+// is missing, unless the resilver has already copied s.
+static int readable (uint m, uint s)
+{
+    return m != raid.failed || (raid.resilvering && s < raid.rsnext);
+}
+
+// Are writes to member m kept?  A missing member's are if it is
+// being resilvered.
+static int writable (uint m)
+{
+    return m != raid.failed || raid.resilvering;
+}
+
+// Point pb at block stripe of member m, to be read into or
+// written from data, or its own cache if data is 0.
+static struct buf* mbuf (struct buf *pb, uint m, uint stripe, uchar *data, int write)
+{
+    pb->dev = 1 + m;
+    pb->blockno = 1 + stripe;
+    pb->flags = B_BUSY | (write ? B_DIRTY : 0);
+    pb->data = data != 0 ? data : pb->cache;
+    return pb;
+}
+
+static void xorblock (uchar *dst, uchar *src)
+{
+    uint *d, *s;
+
+    d = (uint*) dst;
+    for (s = (uint*) src; s < (uint*) (src + BSIZE); s++) {
+        *d++ ^= *s;
+    }
+}
+
+// Only one stripe is written or rebuilt at a time, so that
+// parity is not read while it is being changed.
+static void stripelock (void)
+{
+    acquire(&raid.lock);
+    while (raid.busy) {
+        sleep(&raid, &raid.lock);
+    }
+    raid.busy = 1;
+    release(&raid.lock);
+}
+
+static void stripeunlock (void)
+{
+    acquire(&raid.lock);
+    raid.busy = 0;
+    wakeup(&raid);
+    release(&raid.lock);
+}
+
+// Rebuild the block of member m in stripe s from the other
+// members into dst, using the bufs in pg.  Caller holds the
+// stripe lock.
+static void rebuild (struct buf *pg, uint m, uint s, uchar *dst)
+{
+    struct buf *pv[NRAIDDISK];
+    uint j, k;
+
+    for (j = k = 0; j <= raid.ndata; j++) {
+        if (j != m) {
+            pv[k] = mbuf(&pg[k], j, s, 0, 0);
+            k++;
+        }
+    }
+
+    ideio(pv, k);
+
+    memset(dst, 0, BSIZE);
+    for (j = 0; j < k; j++) {
+        xorblock(dst, pv[j]->data);
+    }
+}
+
+// Write b and the new parity of its stripe, using the bufs in pg.
+static void stripewrite (struct buf *pg, struct buf *b)
+{
+    struct buf *pv[NRAIDDISK], *par;
+    uint m, s, j, k;
+
+    m = member(b->blockno);
+    s = b->blockno / raid.ndata;
+    par = mbuf(&pg[0], raid.ndata, s, 0, 0);
+
+    stripelock();
+
+    if (raid.failed >= 0 && raid.failed != m && raid.failed != raid.ndata
+        && !readable(raid.failed, s)) {
+        // Another data disk is missing: change the parity by
+        // what changes in b.
+        pv[0] = par;
+        pv[1] = mbuf(&pg[1], m, s, 0, 0);
+        ideio(pv, 2);
+        xorblock(par->data, pg[1].data);
+        xorblock(par->data, b->data);
+    } else if (writable(raid.ndata)) {
+        memmove(par->data, b->data, BSIZE);
+        for (j = k = 0; j < raid.ndata; j++) {
+            if (j != m) {
+                pv[k] = mbuf(&pg[1 + k], j, s, 0, 0);
+                k++;
+            }
+        }
+        ideio(pv, k);
+        for (j = 0; j < k; j++) {
+            xorblock(par->data, pv[j]->data);
+        }
+    }
+
+    k = 0;
+    if (writable(raid.ndata)) {
+        par->flags = B_BUSY | B_DIRTY;
+        pv[k++] = par;
+    }
+    if (writable(m)) {
+        pv[k++] = mbuf(&pg[NPBUF - 1], m, s, b->data, 1);
+    }
+    ideio(pv, k);
+
+    stripeunlock();
+}
+
+static void done (struct buf *b)
+{
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+}
+
+// Sync the n bufs in bv, blocks of the disk set, with the disks.
+// Reads of blocks on different disks go out together.
+void raidrw (struct buf **bv, int n)
+{
+    struct buf *pg, *pv[NPBUF], *lv[NPBUF];
+    int i, k;
+
+    if ((pg = (struct buf*) kalloc()) == 0) {
+        panic("raidrw");
+    }
+
+    raid.nio++;
+
+    for (i = 0; i < n; i++) {
+        if (bv[i]->blockno >= raid.ndata * raid.nstripe) {
+            panic("raidrw: block beyond end of disk set");
+        }
+    }
+
+    for (i = 0; i < n;) {
+        if (bv[i]->flags & B_DIRTY) {
+            stripewrite(pg, bv[i]);
+            done(bv[i++]);
+            continue;
+        }
+
+        if (!readable(member(bv[i]->blockno), bv[i]->blockno / raid.ndata)) {
+            stripelock();
+            rebuild(pg, member(bv[i]->blockno), bv[i]->blockno / raid.ndata, bv[i]->data);
+            raid.nrebuilt++;
+            stripeunlock();
+            done(bv[i++]);
+            continue;
+        }
+
+        for (k = 0; i < n && k < NPBUF && !(bv[i]->flags & B_DIRTY)
+             && readable(member(bv[i]->blockno), bv[i]->blockno / raid.ndata); i++, k++) {
+            lv[k] = bv[i];
+            pv[k] = mbuf(&pg[k], member(bv[i]->blockno), bv[i]->blockno / raid.ndata,
+                         bv[i]->data, 0);
+        }
+
+        ideio(pv, k);
+        while (k > 0) {
+            done(lv[--k]);
+        }
+    }
+
+    kfree((char*) pg);
+}
+
+// Rebuild block bn of dev from the rest of its stripe into dst.
+// Returns -1 if dev is not a disk set or another member of the
+// stripe is missing.
+int raidrebuild (uint dev, uint bn, uchar *dst)
+{
+    struct buf *pg;
+
+    if (raidwidth(dev) == 0 || (raid.failed >= 0 && raid.failed != member(bn)
+                                && !readable(raid.failed, bn / raid.ndata))) {
+        return -1;
+    }
+
+    if ((pg = (struct buf*) kalloc()) == 0) {
+        return -1;
+    }
+
+    stripelock();
+    rebuild(pg, member(bn), bn / raid.ndata, dst);
+    raid.nrebuilt++;
+    stripeunlock();
+
+    kfree((char*) pg);
+    return 0;
+}
+
+// Write data to block bn of dev, leaving the parity alone: data
+// was rebuilt from it by raidrebuild(), or is what was there.
+void raidfix (uint dev, uint bn, uchar *data)
+{
+    struct buf *pg, *pb;
+
+    if (raidwidth(dev) == 0 || !writable(member(bn))) {
+        return;
+    }
+
+    if ((pg = (struct buf*) kalloc()) == 0) {
+        return;
+    }
+
+    stripelock();
+    pb = mbuf(pg, member(bn), bn / raid.ndata, data, 1);
+    ideio(&pb, 1);
+    stripeunlock();
+
+    kfree((char*) pg);
+    l2inval(dev, bn);
+}
+
+// Report the shape of the disk set for fsstat().
+void raidstat (struct fsstat *st)
+{
+    st->ndisk = raid.ndata > 0 ? raid.ndata : 1;
+    st->nrebuilt = raid.nrebuilt;
+    st->nresilver = raid.resilvering ? raid.nresilver : 0;
+    st->nresilvered = raid.nresilvered;
+}
+
+// Write the label of member m, or wipe it if valid is 0.  Caller
+// holds the stripe lock.
+static void wlabel (struct buf *pg, uint m, int valid)
+{
+    struct raidlabel *l;
+
+    mbuf(pg, m, 0, 0, 1);
+    pg->blockno = 0;
+    memset(pg->data, 0, BSIZE);
+
+    if (valid) {
+        l = (struct raidlabel*) pg->data;
+        l->magic = RAIDMAGIC;
+        l->ndata = raid.ndata;
+        l->member = m;
+        l->nstripe = raid.nstripe;
+    }
+
+    ideio(&pg, 1);
+}
+
+// Give foreground I/O the disks: while there is some, copy only
+// RSTHROTTLE stripes a tick.
+static void throttle (uint *nio, uint *ncopied)
+{
+    uint t;
+
+    if (raid.nio == *nio || ++*ncopied < RSTHROTTLE) {
+        *nio = raid.nio;
+        return;
+    }
+
+    acquire(&tickslock);
+    t = ticks;
+    while (ticks == t) {
+        sleep(&ticks, &tickslock);
+    }
+    release(&tickslock);
+
+    *ncopied = 0;
+    *nio = raid.nio;
+}
+
+// The first stripe from s on that holds a block in use, or
+// nstripe if there is none.
+static uint nextstripe (uint s)
+{
+    s = bnextused(ROOTDEV, s * raid.ndata) / raid.ndata;
+    return s < raid.nstripe ? s : raid.nstripe;
+}
+
+// Rebuild member m, or the missing member if m is -1, onto its
+// disk, and then take it back into the disk set.  Runs in the
+// calling process until it is done.  Returns the number of
+// stripes copied, or -1 if there is nothing to resilver onto or
+// another member is missing.
+int raidresilver (int m)
+{
+    struct buf *pg, *pb;
+    uint s, nio, ncopied;
+
+    if ((pg = (struct buf*) kalloc()) == 0) {
+        return -1;
+    }
+
+    stripelock();
+    if (m < 0) {
+        m = raid.failed;
+    }
+    if (raid.ndata == 0 || raid.resilvering || m < 0 || m > raid.ndata || !raid.present[m]
+        || (raid.failed >= 0 && raid.failed != m)) {
+        stripeunlock();
+        kfree((char*) pg);
+        return -1;
+    }
+    raid.failed = m;
+    raid.resilvering = 1;
+    raid.rsnext = 0;
+    raid.nresilver = raid.nresilvered = 0;
+    wlabel(pg, m, 0);
+    stripeunlock();
+
+    // Count the stripes in use, for progress reports.
+    for (s = nextstripe(0); s < raid.nstripe; s = nextstripe(s + 1)) {
+        raid.nresilver++;
+    }
+
+    nio = raid.nio;
+    ncopied = 0;
+
+    for (s = nextstripe(0); s < raid.nstripe; s = nextstripe(s + 1)) {
+        stripelock();
+        pb = &pg[NPBUF - 1];
+        rebuild(pg, m, s, pb->cache);
+        mbuf(pb, m, s, 0, 1);
+        ideio(&pb, 1);
+        raid.rsnext = s + 1;
+        raid.nresilvered++;
+        stripeunlock();
+
+        throttle(&nio, &ncopied);
+    }
+
+    stripelock();
+    wlabel(pg, m, 1);
+    raid.failed = -1;
+    raid.resilvering = 0;
+    stripeunlock();
+
+    cprintf("raid: member %d resilvered, %d stripes copied\n", m, raid.nresilvered);
+    kfree((char*) pg);
+    return raid.nresilvered;
+}
@@ -0,0 +1,32 @@
+// Show or set the record size of files (see fs.c).
+//
+//   recsize path          show the record size of path
+//   recsize bytes path    set it: path must be an empty file, or
+//                         a directory, whose new files take it
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fcntl.h"
+
+int
+main(int argc, char *argv[])
+{
+  int fd, size, r;
+
+  if(argc != 2 && argc != 3){
+    printf(2, "usage: recsize [bytes] path\n");
+    exit();
+  }
+
+  size = argc == 3 ? atoi(argv[1]) : 0;
+  if((fd = open(argv[argc-1], O_RDONLY)) < 0){
+    printf(2, "recsize: cannot open %s\n", argv[argc-1]);
+    exit();
+  }
+  if((r = recsize(fd, size)) < 0)
+    printf(2, "recsize: cannot set %s to %d bytes\n", argv[argc-1], size);
+  else
+    printf(1, "%s: %d bytes\n", argv[argc-1], r);
+  close(fd);
+  exit();
+}
@@ -0,0 +1,267 @@
+// Apply a stream written by snapsend() (see snapshot.c) to a
+// copy of the file system:
+//
+//   recv fs.img [stream]
+//
+// A full stream makes a new fs.img.  An incremental one applies
+// only to the copy of the snapshot it starts from, unchanged since
+// it was received (the kernel clears snaptab.recvseq when the file
+// system changes).  The stream has no bitmap, so recv rebuilds it
+// from the inodes once the blocks are in.  A stream cut short
+// leaves the copy unusable.
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define stat xv6_stat  // avoid clash with host struct stat
+#include "types.h"
+#include "fs.h"
+#include "stat.h"
+#include "param.h"
+
+int fsfd;
+struct superblock sb;
+uint bmapstart;   // layout, as fs.c works it out from sb
+uint datastart;
+uint logstart;
+uchar *bitmap;    // the bitmap being rebuilt
+
+// convert to intel byte order
+ushort
+xshort(ushort x)
+{
+  ushort y;
+  uchar *a = (uchar*)&y;
+  a[0] = x;
+  a[1] = x >> 8;
+  return y;
+}
+
+uint
+xint(uint x)
+{
+  uint y;
+  uchar *a = (uchar*)&y;
+  a[0] = x;
+  a[1] = x >> 8;
+  a[2] = x >> 16;
+  a[3] = x >> 24;
+  return y;
+}
+
+void
+fail(char *msg)
+{
+  fprintf(stderr, "recv: %s\n", msg);
+  exit(1);
+}
+
+void
+wsect(uint sec, void *buf)
+{
+  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+    perror("lseek");
+    exit(1);
+  }
+  if(write(fsfd, buf, 512) != 512){
+    perror("write");
+    exit(1);
+  }
+}
+
+void
+rsect(uint sec, void *buf)
+{
+  if(lseek(fsfd, sec * 512L, 0) != sec * 512L){
+    perror("lseek");
+    exit(1);
+  }
+  if(read(fsfd, buf, 512) != 512){
+    perror("read");
+    exit(1);
+  }
+}
+
+// Write the super block and an empty snapshot table that
+// records recvseq.
+void
+wsuper(uint recvseq)
+{
+  uchar buf[BSIZE];
+  struct snaptab tab;
+
+  memset(buf, 0, sizeof(buf));
+  memset(&tab, 0, sizeof(tab));
+  tab.recvseq = xint(recvseq);
+  memmove(buf, &sb, sizeof(sb));
+  memmove(buf + sizeof(sb), &tab, sizeof(tab));
+  wsect(1, buf);
+}
+
+void
+mark(uint b)
+{
+  if(b >= xint(sb.size))
+    fail("block out of range");
+  bitmap[b / 8] |= 1 << (b % 8);
+}
+
+// Mark an indirect block at level (1 = single) and what it maps.
+void
+markind(uint b, int level)
+{
+  uint a[NINDIRECT];
+  int i;
+
+  if(b == 0)
+    return;
+  mark(b);
+  rsect(b, a);
+  for(i = 0; i < NINDIRECT; i++){
+    if(a[i] == 0)
+      continue;
+    if(level > 1)
+      markind(xint(a[i]), level - 1);
+    else
+      mark(xint(a[i]));
+  }
+}
+
+// Mark the blocks of an extent tree node and those below it.
+void
+markext(struct extenthdr *h)
+{
+  struct extent *e;
+  uint node[BSIZE / sizeof(uint)];
+  uint i, j, len;
+
+  for(i = 0; i < xshort(h->nent); i++){
+    e = &EXTENTS(h)[i];
+    if(xshort(h->depth) == 0){
+      len = xint(e->len) & ~EXT_FLAGS;
+      for(j = 0; j < len; j++)
+        mark(xint(e->pblk) + j);
+    } else {
+      mark(xint(e->pblk));
+      rsect(xint(e->pblk), node);
+      markext((struct extenthdr*)node);
+    }
+  }
+}
+
+// Rebuild the bitmap: the metadata, dedup table and log, and
+// every block an inode uses.
+void
+rebuild(void)
+{
+  struct dinode din[IPB], *dp;
+  uint nbitmap, b, inum, i;
+
+  nbitmap = datastart - bmapstart;
+  if((bitmap = calloc(nbitmap, BSIZE)) == 0)
+    fail("out of memory");
+
+  for(b = 0; b < datastart; b++)
+    mark(b);
+  for(b = 0; b < xint(sb.nddt); b++)
+    mark(xint(sb.ddtstart) + b);
+  for(b = logstart; b < xint(sb.size); b++)
+    mark(b);
+
+  for(inum = 1; inum < xint(sb.ninodes); inum++){
+    if(inum == 1 || inum % IPB == 0)
+      rsect(2 + inum / IPB, din);
+    dp = &din[inum % IPB];
+    if(dp->type == 0 || xshort(dp->type) == T_DEV || (xint(dp->iflags) & IF_INLINE))
+      continue;
+    if(xint(dp->iflags) & IF_EXTENT){
+      markext((struct extenthdr*)dp->addrs);
+      continue;
+    }
+    for(i = 0; i < NDIRECT; i++)
+      if(dp->addrs[i] != 0)
+        mark(xint(dp->addrs[i]));
+    for(i = 0; i < 3; i++)
+      markind(xint(dp->addrs[NDIRECT + i]), i + 1);
+  }
+
+  for(b = 0; b < nbitmap; b++)
+    wsect(bmapstart + b, bitmap + b * BSIZE);
+}
+
+int
+main(int argc, char *argv[])
+{
+  FILE *in;
+  struct sendhdr hdr;
+  struct sendrec rec;
+  uchar buf[BSIZE];
+  struct snaptab tab;
+  uint n, i;
+
+  if(argc < 2 || argc > 3){
+    fprintf(stderr, "Usage: recv fs.img [stream]\n");
+    exit(1);
+  }
+
+  in = stdin;
+  if(argc == 3 && (in = fopen(argv[2], "r")) == 0){
+    perror(argv[2]);
+    exit(1);
+  }
+
+  if(fread(&hdr, sizeof(hdr), 1, in) != 1 || xint(hdr.magic) != SENDMAGIC)
+    fail("not a stream");
+
+  sb = hdr.sb;
+  bmapstart = xint(sb.ninodes) / IPB + 3;
+  datastart = bmapstart + xint(sb.size) / BPB + 1;
+  logstart = xint(sb.size) - xint(sb.nlog);
+
+  if(hdr.fromseq == 0){
+    fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
+    if(fsfd < 0 || ftruncate(fsfd, xint(sb.size) * 512L) < 0){
+      perror(argv[1]);
+      exit(1);
+    }
+  } else {
+    if((fsfd = open(argv[1], O_RDWR)) < 0){
+      perror(argv[1]);
+      exit(1);
+    }
+    rsect(1, buf);
+    memmove(&tab, buf + sizeof(sb), sizeof(tab));
+    if(memcmp(buf, &sb, sizeof(sb)) != 0)
+      fail("different file system");
+    for(i = 0; i < NSNAP; i++)
+      if(tab.snap[i].flags != 0)
+        fail("copy has snapshots of its own");
+    if(xint(tab.recvseq) != xint(hdr.fromseq))
+      fail("copy is not at the snapshot the stream starts from");
+    rsect(logstart, buf);
+    if(*(int*)buf != 0)
+      fail("copy has a log to recover; boot it first");
+  }
+
+  // Until the stream is all in, the copy takes no other.
+  wsuper(0);
+
+  for(n = 0; ; n++){
+    if(fread(&rec, sizeof(rec), 1, in) != 1)
+      fail("stream cut short");
+    if(xint(rec.bno) == SENDEND)
+      break;
+    if(xint(rec.bno) < 2 || (xint(rec.bno) >= bmapstart && xint(rec.bno) < datastart)
+       || xint(rec.bno) >= logstart)
+      fail("block out of range");
+    wsect(xint(rec.bno), rec.data);
+  }
+
+  rebuild();
+  wsuper(xint(hdr.toseq));
+
+  printf("recv: %u blocks\n", n);
+  return 0;
+}
@@ -0,0 +1,60 @@
+// Rebuild a member of the disk set onto its disk (see raid.c).
+//
+//   resilver [member]   resilver member, by default the missing
+//                       one, and show progress until it is done
+//   resilver -s         show the progress of a running resilver
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+void
+progress(void)
+{
+  struct fsstat st;
+
+  fsstat(&st);
+  if(st.nresilver == 0)
+    printf(1, "resilver: not running\n");
+  else
+    printf(1, "resilver: %d of %d stripes in use copied\n",
+           st.nresilvered, st.nresilver);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct fsstat st;
+  int m, pid, t0;
+
+  if(argc > 1 && strcmp(argv[1], "-s") == 0){
+    progress();
+    exit();
+  }
+
+  m = argc > 1 ? atoi(argv[1]) : -1;
+  t0 = uptime();
+
+  // The child does the work; the parent reports on it.
+  if((pid = fork()) < 0){
+    printf(2, "resilver: fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    if(resilver(m) < 0)
+      printf(2, "resilver: nothing to resilver onto\n");
+    exit();
+  }
+
+  for(;;){
+    sleep(100);
+    fsstat(&st);
+    if(st.nresilver == 0)
+      break;
+    progress();
+  }
+  wait();
+  fsstat(&st);
+  printf(1, "resilver: done, %d stripes copied in %d ticks\n",
+         st.nresilvered, uptime() - t0);
+  exit();
+}
@@ -0,0 +1,86 @@
+// Manage snapshots of the file system.
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "fs.h"
+#include "fcntl.h"
+
+void
+usage(void)
+{
+  printf(2, "Usage: snap create name | destroy name | list\n");
+  printf(2, "       snap mount name dir | umount dir\n");
+  printf(2, "       snap send [from] to file|-\n");
+  exit();
+}
+
+void
+list(void)
+{
+  struct snapent se;
+  int i;
+
+  printf(1, "name           state   blocks\n");
+  for(i = 0; snapinfo(i, &se) == 0; i++){
+    if(se.flags == 0)
+      continue;
+    printf(1, "%s\t%s\t%d\n", se.name,
+           (se.flags & SNAP_LIVE) ? "live" : "freeing", se.nblocks);
+  }
+}
+
+// Write the stream from snapshot from (all of to if from is "")
+// to snapshot to into path, or standard output if path is "-".
+void
+send(char *from, char *to, char *path)
+{
+  int fd, n;
+
+  if(strcmp(path, "-") == 0)
+    fd = 1;
+  else {
+    unlink(path);
+    if((fd = open(path, O_CREATE|O_WRONLY)) < 0){
+      printf(2, "snap: cannot create %s\n", path);
+      return;
+    }
+  }
+
+  n = snapsend(from, to, fd);
+  if(fd != 1)
+    close(fd);
+  if(n < 0)
+    printf(2, "snap: cannot send %s\n", to);
+  else
+    printf(2, "snap: sent %d blocks\n", n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 2)
+    usage();
+
+  if(strcmp(argv[1], "list") == 0){
+    list();
+  } else if(strcmp(argv[1], "create") == 0 && argc == 3){
+    if(snapshot(argv[2]) < 0)
+      printf(2, "snap: cannot create %s\n", argv[2]);
+  } else if(strcmp(argv[1], "destroy") == 0 && argc == 3){
+    if(snapdestroy(argv[2]) < 0)
+      printf(2, "snap: cannot destroy %s\n", argv[2]);
+  } else if(strcmp(argv[1], "mount") == 0 && argc == 4){
+    if(snapmount(argv[2], argv[3]) < 0)
+      printf(2, "snap: cannot mount %s on %s\n", argv[2], argv[3]);
+  } else if(strcmp(argv[1], "send") == 0 && argc == 4){
+    send("", argv[2], argv[3]);
+  } else if(strcmp(argv[1], "send") == 0 && argc == 5){
+    send(argv[2], argv[3], argv[4]);
+  } else if(strcmp(argv[1], "umount") == 0 && argc == 3){
+    if(snapumount(argv[2]) < 0)
+      printf(2, "snap: cannot unmount %s\n", argv[2]);
+  } else {
+    usage();
+  }
+  exit();
+}
@@ -0,0 +1,930 @@
+// Snapshots.
+//
+// A snapshot is a read-only image of the whole file system as
+// it was after some commit.  Taking one writes a table entry
+// (block 1, after the super block) and an empty block map, so it
+// costs the same whatever the size of the disk.
+//
+// Old contents are kept the first time they would be lost,
+// by the newest snapshot, the recipient:
+//   * commit() calls snapcommit() before it writes the log.
+//     Each logged block that was in use at the last commit and
+//     has no entry in the recipient's map is copied from its
+//     home location to a new block, and the map records the
+//     copy.  The copies go into the same transaction.
+//   * Blocks allocated by the transaction get the entry SNAPNEW,
+//     so they are never copied.
+//   * bfree() of a block the recipient still needs leaves it
+//     allocated and adds it to the recipient's dead list
+//     (snapkeep()), so the file system does not reuse it.
+// A snapshot reads block b from its own map, or from the map of
+// the next newer snapshot that has an entry for b, or else from
+// the live block, which has not changed since.
+//
+// Destroying a snapshot marks it dying.  Once no older snapshot
+// is left, each later commit frees a few of its blocks until
+// none is left (snapreap()).
+//
+// A snapshot mounted on a directory is device SNAPDEV + slot,
+// and bread() fills its buffers with snapread().
+//
+// snapsend() writes what changed between two snapshots as a
+// stream for recv to apply to a copy (see below).
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "stat.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+#include "mount.h"
+
+extern struct inode* iget (uint dev, uint inum);
+
+#define NMAP NINDIRECT  // entries in a block map block
+#define NREAP 64        // blocks snapreap() frees per commit
+
+enum { SNAP_NONE, SNAP_CREATE, SNAP_DESTROY };
+
+struct {
+    struct spinlock lock;
+    struct mount *mp;
+    struct snaptab tab;     // the table in block 1
+    int dirty;              // tab changed since it was written
+    uint levels;            // height of the block maps
+
+    // The request for the next commit (snapcreate/snapdestroy).
+    int op;
+    char name[DIRSIZ];
+    int done;
+    int result;
+
+    struct inode *covered[NSNAP];   // directory a snapshot is mounted on
+    int sends[NSNAP];               // snapsend() calls using a snapshot
+
+    uint oldbno;            // bitmap block in old[], or 0
+    uchar old[BSIZE];       // its content as of the last commit
+    uchar cur[BSIZE];       // scratch copy of a logged bitmap block
+} snap;
+
+// Read the snapshot table of mp.  Called from fsinit().
+void snapinit (struct mount *mp)
+{
+    struct buf *bp;
+    uint span;
+
+    initlock(&snap.lock, "snap");
+    snap.mp = mp;
+
+    bp = bread(mp->dev, 1);
+    memmove(&snap.tab, bp->data + sizeof(struct superblock), sizeof(snap.tab));
+    brelse(bp);
+
+    for (snap.levels = 1, span = NMAP; span < mp->sb.size; span *= NMAP) {
+        snap.levels++;
+    }
+}
+
+// Does the file system on dev have snapshots?  Only the root's
+// are kept, so a disk with any is not mounted anywhere else.
+int snapany (uint dev)
+{
+    struct snaptab *t;
+    struct buf *bp;
+    int i, r;
+
+    bp = bread(dev, 1);
+    t = (struct snaptab*) (bp->data + sizeof(struct superblock));
+    r = 0;
+    for (i = 0; i < NSNAP; i++) {
+        if (t->snap[i].flags != 0) {
+            r = 1;
+        }
+    }
+    brelse(bp);
+
+    return r;
+}
+
+static struct snapent* snapfind (char *name)
+{
+    struct snapent *s;
+
+    for (s = snap.tab.snap; s < &snap.tab.snap[NSNAP]; s++) {
+        if ((s->flags & SNAP_LIVE) && namecmp(s->name, name) == 0) {
+            return s;
+        }
+    }
+
+    return 0;
+}
+
+// The oldest snapshot newer than seq, or 0.
+static struct snapent* snapafter (uint seq)
+{
+    struct snapent *s, *t;
+
+    t = 0;
+    for (s = snap.tab.snap; s < &snap.tab.snap[NSNAP]; s++) {
+        if (s->flags != 0 && s->seq > seq && (t == 0 || s->seq < t->seq)) {
+            t = s;
+        }
+    }
+
+    return t;
+}
+
+// The snapshot that keeps old blocks: the newest one, as long as
+// some snapshot is live.  0 if nothing needs to be kept.
+static struct snapent* recipient (void)
+{
+    struct snapent *s, *r;
+    int live;
+
+    r = 0;
+    live = 0;
+    for (s = snap.tab.snap; s < &snap.tab.snap[NSNAP]; s++) {
+        if (s->flags != 0 && (r == 0 || s->seq > r->seq)) {
+            r = s;
+        }
+        live |= s->flags & SNAP_LIVE;
+    }
+
+    return live ? r : 0;
+}
+
+// How many times the usual log space an operation needs.  While
+// there are snapshots, commit() may add for each logged block
+// its copy, the map blocks below the root on the way to its
+// entry, and a bitmap block to allocate them in; the map's
+// root and block 1 come once per commit on top (begin_op()).
+// The map of the largest disk has 4 levels (MAXSNAPCOST).
+int snapcost (void)
+{
+    struct snapent *s;
+
+    for (s = snap.tab.snap; s < &snap.tab.snap[NSNAP]; s++) {
+        if (s->flags != 0) {
+            return 2 + snap.levels;
+        }
+    }
+
+    return 1;
+}
+
+// Keys under one entry of a map block at level (1 = leaf).
+static uint mapspan (uint level)
+{
+    uint span;
+
+    for (span = 1; level > 1; level--) {
+        span *= NMAP;
+    }
+
+    return span;
+}
+
+// The entry for block b in the map under root: a copy, SNAPNEW,
+// or 0 if there is none.
+static uint mapget (uint root, uint b)
+{
+    struct buf *bp;
+    uint level, x;
+
+    x = root;
+    for (level = snap.levels; level > 0 && x != 0; level--) {
+        bp = bread(snap.mp->dev, x);
+        x = ((uint*)bp->data)[b / mapspan(level) % NMAP];
+        brelse(bp);
+    }
+
+    return x;
+}
+
+// Allocate a zeroed block held by snapshot s.
+static uint snapalloc (struct snapent *s)
+{
+    s->nblocks++;
+    snap.dirty = 1;
+    return balloc(snap.mp->dev, 0);
+}
+
+// Set the entry for block b in s's map to v.
+static void mapset (struct snapent *s, uint b, uint v)
+{
+    struct buf *bp;
+    uint level, x, *a, i;
+
+    x = s->root;
+    for (level = snap.levels; ; level--) {
+        bp = bread(snap.mp->dev, x);
+        a = (uint*)bp->data;
+        i = b / mapspan(level) % NMAP;
+
+        if (level == 1) {
+            bcow(bp);
+            a[i] = v;
+            log_write(bp);
+            brelse(bp);
+            return;
+        }
+
+        if ((x = a[i]) == 0) {
+            x = snapalloc(s);
+            bcow(bp);
+            a[i] = x;
+            log_write(bp);
+        }
+
+        brelse(bp);
+    }
+}
+
+// Was block b in use at the last commit?  The disk bitmap has
+// not been touched since; the cache may have been.
+static int oldbit (uint b)
+{
+    uint bno, bi;
+
+    bno = MBBLOCK(snap.mp, b);
+    if (snap.oldbno != bno) {
+        bdiskread(snap.mp->dev, bno, snap.old);
+        snap.oldbno = bno;
+    }
+
+    bi = b % BPB;
+    return (snap.old[bi / 8] >> (bi % 8)) & 1;
+}
+
+// Add block b to the dead list of s.
+static void deadadd (struct snapent *s, uint b)
+{
+    struct buf *bp;
+    struct deadhdr *h;
+    struct deadrun *r;
+    uint d;
+
+    if (s->dead != 0) {
+        bp = bread(snap.mp->dev, s->dead);
+        h = (struct deadhdr*)bp->data;
+        r = (struct deadrun*)(h + 1);
+
+        if (h->n > 0 && r[h->n - 1].start + r[h->n - 1].len == b) {
+            bcow(bp);
+            r[h->n - 1].len++;
+            goto out;
+        }
+
+        if (h->n < NDEADRUN) {
+            bcow(bp);
+            r[h->n].start = b;
+            r[h->n].len = 1;
+            h->n++;
+            goto out;
+        }
+
+        brelse(bp);
+    }
+
+    d = snapalloc(s);
+    bp = bread(snap.mp->dev, d);
+    bcow(bp);
+    h = (struct deadhdr*)bp->data;
+    r = (struct deadrun*)(h + 1);
+    h->next = s->dead;
+    h->n = 1;
+    r[0].start = b;
+    r[0].len = 1;
+    s->dead = d;
+
+out:
+    log_write(bp);
+    brelse(bp);
+    s->nblocks++;
+    snap.dirty = 1;
+}
+
+// Called by bfree() for block b of dev.  If a snapshot still
+// needs b, keep it allocated on the recipient's dead list and
+// return 1.  Else return 0 and let bfree() free it.
+int snapkeep (uint dev, uint b)
+{
+    struct snapent *r;
+
+    if (dev != snap.mp->dev || (r = recipient()) == 0) {
+        return 0;
+    }
+
+    // Allocated since, or already copied: not needed.
+    // Written by this transaction: snapcommit() copies it.
+    if (!oldbit(b) || loghas(ROOTDEV, b) || mapget(r->root, b) != 0) {
+        return 0;
+    }
+
+    deadadd(r, b);
+    return 1;
+}
+
+// Is there log space and budget left to free another block?
+// Leaves room to free the map blocks above it as well.
+static int reaproom (int nfreed)
+{
+    return nfreed < NREAP && logn(ROOTDEV) + snap.levels + 2 < LOGSIZE;
+}
+
+// Free the copies and map blocks under node, a map block at
+// level covering keys from base, beyond s->reap.  Returns 1 when
+// all are freed, 0 when out of room.
+static int reapmap (struct snapent *s, uint node, uint level, uint base, int *nfreed)
+{
+    struct buf *bp;
+    uint span, i, x;
+
+    span = mapspan(level);
+    i = s->reap > base ? (s->reap - base) / span : 0;
+
+    for (; i < NMAP; i++) {
+        bp = bread(snap.mp->dev, node);
+        x = ((uint*)bp->data)[i];
+        brelse(bp);
+
+        if (x != 0 && x != SNAPNEW) {
+            if (level > 1) {
+                if (!reapmap(s, x, level - 1, base + i * span, nfreed)) {
+                    return 0;
+                }
+            } else if (!reaproom(*nfreed)) {
+                return 0;
+            }
+
+            bfreenow(snap.mp->dev, x);
+            s->nblocks--;
+            (*nfreed)++;
+        }
+
+        s->reap = base + (i + 1) * span;
+        snap.dirty = 1;
+    }
+
+    return 1;
+}
+
+// Free some of the blocks of the oldest snapshot if it has been
+// destroyed; clear its slot once they are all gone.
+static void snapreap (void)
+{
+    struct snapent *s;
+    struct buf *bp;
+    struct deadhdr *h;
+    struct deadrun *r;
+    int nfreed;
+    uint next;
+
+    if ((s = snapafter(0)) == 0 || !(s->flags & SNAP_DYING)) {
+        return;
+    }
+
+    nfreed = 0;
+    if (s->root != 0) {
+        if (!reapmap(s, s->root, snap.levels, 0, &nfreed)) {
+            return;
+        }
+        bfreenow(snap.mp->dev, s->root);
+        s->nblocks--;
+        s->root = 0;
+        snap.dirty = 1;
+    }
+
+    while (s->dead != 0) {
+        bp = bread(snap.mp->dev, s->dead);
+        bcow(bp);
+        h = (struct deadhdr*)bp->data;
+        r = (struct deadrun*)(h + 1);
+
+        for (; h->n > 0; h->n--) {
+            for (; r[h->n - 1].len > 0; r[h->n - 1].len--) {
+                if (!reaproom(nfreed)) {
+                    log_write(bp);
+                    brelse(bp);
+                    return;
+                }
+                bfreenow(snap.mp->dev, r[h->n - 1].start + r[h->n - 1].len - 1);
+                s->nblocks--;
+                nfreed++;
+            }
+        }
+
+        next = h->next;
+        brelse(bp);
+        bfreenow(snap.mp->dev, s->dead);
+        s->nblocks--;
+        s->dead = next;
+        snap.dirty = 1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    snap.dirty = 1;
+}
+
+// Carry out a pending snapcreate() or snapdestroy().
+static int snaprequest (void)
+{
+    struct snapent *s;
+    int i;
+
+    if (snap.op == SNAP_DESTROY) {
+        acquire(&snap.lock);
+        if ((s = snapfind(snap.name)) == 0 || snap.covered[i = s - snap.tab.snap] != 0
+            || snap.sends[i] != 0) {
+            release(&snap.lock);
+            return -1;
+        }
+        s->flags = SNAP_DYING;
+        s->reap = 0;
+        snap.dirty = 1;
+        release(&snap.lock);
+        return 0;
+    }
+
+    if (snapfind(snap.name) != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < NSNAP; i++) {
+        if (snap.tab.snap[i].flags == 0) {
+            break;
+        }
+    }
+
+    if (i == NSNAP) {
+        return -1;
+    }
+
+    s = &snap.tab.snap[i];
+    memset(s, 0, sizeof(*s));
+    strncpy(s->name, snap.name, DIRSIZ);
+    s->flags = SNAP_LIVE;
+    s->seq = ++snap.tab.seq;
+    s->root = snapalloc(s);
+    return i;
+}
+
+// Called by commit() before it writes the log, with no file
+// system calls outstanding.  Copies the blocks the recipient
+// needs into the transaction, frees blocks of a destroyed
+// snapshot, and takes or destroys a snapshot on request.
+void snapcommit (void)
+{
+    struct snapent *r;
+    struct buf *bp;
+    uint n0, i, j, b, x, c;
+
+    n0 = logn(ROOTDEV);
+
+    // A received copy that changes can take no more streams.
+    if (n0 > 0 && snap.tab.recvseq != 0) {
+        snap.tab.recvseq = 0;
+        snap.dirty = 1;
+    }
+
+    if ((r = recipient()) != 0) {
+        // Blocks this transaction allocated are new to r.
+        for (i = 0; i < n0; i++) {
+            b = logblockno(i);
+            if (b < snap.mp->bmapstart || b >= snap.mp->datastart) {
+                continue;
+            }
+
+            bp = bread(snap.mp->dev, b);
+            memmove(snap.cur, bp->data, BSIZE);
+            brelse(bp);
+            oldbit((b - snap.mp->bmapstart) * BPB);
+
+            for (j = 0; j < BPB; j++) {
+                if (j % 8 == 0 && snap.cur[j / 8] == snap.old[j / 8]) {
+                    j += 7;
+                    continue;
+                }
+                x = (b - snap.mp->bmapstart) * BPB + j;
+                if ((snap.cur[j / 8] >> (j % 8)) & 1 && !((snap.old[j / 8] >> (j % 8)) & 1)
+                    && mapget(r->root, x) == 0) {
+                    mapset(r, x, SNAPNEW);
+                }
+            }
+        }
+
+        // Copy what the transaction overwrites.  Blocks logged
+        // from here on (i >= n0) belong to snapshots.
+        for (i = 0; i < n0; i++) {
+            b = logblockno(i);
+            if (b < snap.mp->inodestart || b >= snap.mp->logstart) {
+                continue;
+            }
+            if ((b >= snap.mp->datastart && !oldbit(b)) || mapget(r->root, b) != 0) {
+                continue;
+            }
+
+            c = snapalloc(r);
+            bp = bread(snap.mp->dev, c);
+            bcow(bp);
+            bdiskread(snap.mp->dev, b, bp->data);
+            log_write(bp);
+            brelse(bp);
+            mapset(r, b, c);
+        }
+    }
+
+    snapreap();
+
+    acquire(&snap.lock);
+    if (snap.op != SNAP_NONE && !snap.done) {
+        release(&snap.lock);
+        i = snaprequest();
+        acquire(&snap.lock);
+        snap.result = i;
+        snap.done = 1;
+        wakeup(&snap);
+    }
+    release(&snap.lock);
+
+    if (snap.dirty) {
+        bp = bread(snap.mp->dev, 1);
+        bcow(bp);
+        memmove(bp->data + sizeof(struct superblock), &snap.tab, sizeof(snap.tab));
+        log_write(bp);
+        brelse(bp);
+        snap.dirty = 0;
+    }
+
+    snap.oldbno = 0;  // the log is about to be installed
+}
+
+// Hand a request to the next commit and wait for its result.
+static int snapop (int op, char *name)
+{
+    int r;
+
+    acquire(&snap.lock);
+    while (snap.op != SNAP_NONE) {
+        sleep(&snap, &snap.lock);
+    }
+    snap.op = op;
+    strncpy(snap.name, name, DIRSIZ);
+    snap.done = 0;
+    release(&snap.lock);
+
+    begin_op();
+    end_op();
+
+    acquire(&snap.lock);
+    while (!snap.done) {
+        sleep(&snap, &snap.lock);
+    }
+    r = snap.result;
+    snap.op = SNAP_NONE;
+    wakeup(&snap);
+    release(&snap.lock);
+
+    return r;
+}
+
+// Take a snapshot of the file system as of the next commit.
+// Returns its slot, or -1 if the name is taken or the table full.
+int snapcreate (char *name)
+{
+    return snapop(SNAP_CREATE, name);
+}
+
+// Destroy an unmounted snapshot.  Its blocks are freed later.
+int snapdestroy (char *name)
+{
+    return snapop(SNAP_DESTROY, name);
+}
+
+// Copy table slot i to *se.
+int snapinfo (int i, struct snapent *se)
+{
+    if (i < 0 || i >= NSNAP) {
+        return -1;
+    }
+
+    acquire(&snap.lock);
+    *se = snap.tab.snap[i];
+    release(&snap.lock);
+    return 0;
+}
+
+// Read block b as snapshot s has it into data.
+static void snapget (struct snapent *s, uint b, uchar *data)
+{
+    struct buf *bp;
+    uint x;
+
+    begin_snapread();
+
+    x = 0;
+    for (; s != 0; s = snapafter(s->seq)) {
+        if (s->root != 0 && (x = mapget(s->root, b)) != 0) {
+            break;
+        }
+    }
+
+    if (x != 0 && x != SNAPNEW) {
+        bp = bread(snap.mp->dev, x);
+        memmove(data, bp->data, BSIZE);
+        brelse(bp);
+    } else {
+        bdiskread(snap.mp->dev, b, data);
+    }
+
+    end_snapread();
+}
+
+// Fill b, a buffer of a mounted snapshot, with its block as it
+// was when the snapshot was taken.
+void snapread (struct buf *b)
+{
+    b->data = b->cache;
+    b->flags &= ~B_MAPPED;
+    snapget(&snap.tab.snap[b->dev - SNAPDEV], b->blockno, b->data);
+    b->flags |= B_VALID;
+}
+
+// Mount snapshot name on directory dp, which keeps the
+// reference the caller passes in.
+int snapmount (char *name, struct inode *dp)
+{
+    struct snapent *s;
+    int i;
+
+    acquire(&snap.lock);
+    if ((s = snapfind(name)) == 0 || snap.covered[i = s - snap.tab.snap] != 0) {
+        release(&snap.lock);
+        return -1;
+    }
+    snap.covered[i] = dp;
+    release(&snap.lock);
+
+    return 0;
+}
+
+// Unmount the snapshot mounted as dev, unless a file or
+// directory in it is still in use.
+int snapumount (uint dev)
+{
+    struct inode *dp;
+
+    if (!ISSNAPDEV(dev) || dev >= SNAPDEV + NSNAP || snap.covered[dev - SNAPDEV] == 0
+        || idevrelease(dev) < 0) {
+        return -1;
+    }
+
+    acquire(&snap.lock);
+    dp = snap.covered[dev - SNAPDEV];
+    snap.covered[dev - SNAPDEV] = 0;
+    release(&snap.lock);
+
+    binval(dev);
+    iput(dp);
+    return 0;
+}
+
+// Is a snapshot mounted on directory ip?  unlink() must not
+// remove it, or the snapshot could not be unmounted.
+int snapcovers (struct inode *ip)
+{
+    int i, r;
+
+    r = 0;
+    acquire(&snap.lock);
+
+    for (i = 0; i < NSNAP; i++) {
+        if (snap.covered[i] == ip) {
+            r = 1;
+        }
+    }
+
+    release(&snap.lock);
+    return r;
+}
+
+// Is dev a snapshot mounted on a directory?
+int snapmounted (uint dev)
+{
+    int r;
+
+    acquire(&snap.lock);
+    r = ISSNAPDEV(dev) && dev < SNAPDEV + NSNAP && snap.covered[dev - SNAPDEV] != 0;
+    release(&snap.lock);
+
+    return r;
+}
+
+// If ip is a directory with a snapshot mounted on it, return
+// the snapshot's root instead.
+struct inode* snapcross (struct inode *ip)
+{
+    int i;
+
+    for (i = 0; i < NSNAP; i++) {
+        if (snap.covered[i] == ip) {
+            iput(ip);
+            return iget(SNAPDEV + i, ROOTINO);
+        }
+    }
+
+    return ip;
+}
+
+// Sending.
+//
+// A block that changed between snapshots from and to changed
+// while from, or a snapshot taken after it and before to, was
+// the recipient, so it is a key in one of their maps.  Walking
+// those maps finds every change without reading anything else:
+// the work follows the amount of change, not the size of the
+// disk.  Each block goes out as to has it.  A stream without
+// from has every block in use in to instead.
+//
+// Neither the bitmap nor block 1 is sent.  recv rebuilds the
+// bitmap from the inodes, which also frees the blocks that held
+// snapshots here, and leaves the copy's snapshot table empty
+// except for the seq of to.
+
+// State of one snapsend(), in a page from kalloc().
+struct sendst {
+    struct file *f;
+    struct snapent *from, *to;
+    uint nsent;
+    uint bitbno;            // bitmap block in bits[], or 0
+    uchar bits[BSIZE];      // as to has it
+    struct sendrec rec;
+};
+
+// Send block b as to has it, unless it is not file system
+// content.
+static int sendblock (struct sendst *st, uint b)
+{
+    if (b < snap.mp->inodestart || (b >= snap.mp->bmapstart && b < snap.mp->datastart)
+        || b >= snap.mp->logstart) {
+        return 0;
+    }
+
+    st->rec.bno = b;
+    snapget(st->to, b, st->rec.data);
+    st->nsent++;
+
+    if (filewrite(st->f, (char*)&st->rec, sizeof(st->rec)) != sizeof(st->rec)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Is block b a key in the map of a snapshot from st->from up to,
+// but not including, s?  Then it has been sent.
+static int sentbefore (struct sendst *st, struct snapent *s, uint b)
+{
+    struct snapent *t;
+
+    for (t = st->from; t != s; t = snapafter(t->seq)) {
+        if (t->root != 0 && mapget(t->root, b) != 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Send the keys of s's map under node, a map block at level
+// covering keys from base.
+static int sendmap (struct sendst *st, struct snapent *s, uint node, uint level, uint base)
+{
+    struct buf *bp;
+    uint span, i, x;
+
+    span = mapspan(level);
+
+    for (i = 0; i < NMAP; i++) {
+        bp = bread(snap.mp->dev, node);
+        x = ((uint*)bp->data)[i];
+        brelse(bp);
+
+        if (x == 0) {
+            continue;
+        }
+
+        if (level > 1) {
+            if (sendmap(st, s, x, level - 1, base + i * span) < 0) {
+                return -1;
+            }
+        } else if (!sentbefore(st, s, base + i) && sendblock(st, base + i) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Send every block in use in to.
+static int sendall (struct sendst *st)
+{
+    uint b, bi;
+
+    for (b = snap.mp->inodestart; b < snap.mp->logstart; b++) {
+        if (b >= snap.mp->datastart) {
+            if (st->bitbno != MBBLOCK(snap.mp, b)) {
+                st->bitbno = MBBLOCK(snap.mp, b);
+                snapget(st->to, st->bitbno, st->bits);
+            }
+
+            bi = b % BPB;
+            if (!((st->bits[bi / 8] >> (bi % 8)) & 1)) {
+                continue;
+            }
+        }
+
+        if (sendblock(st, b) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Write to f the stream that brings a copy of snapshot from,
+// or an empty disk if from is 0, up to snapshot to.  Neither can
+// be destroyed meanwhile.  Returns the number of blocks sent, or
+// -1.
+int snapsend (char *from, char *to, struct file *f)
+{
+    struct sendst *st;
+    struct sendhdr hdr;
+    struct snapent *s;
+    int r;
+
+    if ((st = (struct sendst*) kalloc()) == 0) {
+        return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    st->f = f;
+
+    acquire(&snap.lock);
+    st->to = snapfind(to);
+    st->from = from != 0 ? snapfind(from) : 0;
+
+    if (st->to == 0 || (from != 0 && (st->from == 0 || st->from->seq >= st->to->seq))) {
+        release(&snap.lock);
+        kfree((char*) st);
+        return -1;
+    }
+
+    snap.sends[st->to - snap.tab.snap]++;
+    if (st->from != 0) {
+        snap.sends[st->from - snap.tab.snap]++;
+    }
+    release(&snap.lock);
+
+    r = -1;
+
+    hdr.magic = SENDMAGIC;
+    hdr.fromseq = st->from != 0 ? st->from->seq : 0;
+    hdr.toseq = st->to->seq;
+    hdr.sb = snap.mp->sb;
+
+    if (filewrite(f, (char*)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+        goto out;
+    }
+
+    if (st->from == 0) {
+        if (sendall(st) < 0) {
+            goto out;
+        }
+    } else {
+        for (s = st->from; s != st->to; s = snapafter(s->seq)) {
+            if (s->root != 0 && sendmap(st, s, s->root, snap.levels, 0) < 0) {
+                goto out;
+            }
+        }
+    }
+
+    st->rec.bno = SENDEND;
+    memset(st->rec.data, 0, BSIZE);
+
+    if (filewrite(f, (char*)&st->rec, sizeof(st->rec)) == sizeof(st->rec)) {
+        r = st->nsent;
+    }
+
+out:
+    acquire(&snap.lock);
+    snap.sends[st->to - snap.tab.snap]--;
+    if (st->from != 0) {
+        snap.sends[st->from - snap.tab.snap]--;
+    }
+    release(&snap.lock);
+
+    kfree((char*) st);
+    return r;
+}
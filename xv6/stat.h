@@ -13,4 +13,23 @@ struct stat {
     short child1;
     short child2;
     uint checksum;
+    uint gen;      // Generation, bumped on each inode write
+    uint blocks;   // Disk blocks holding the content
+};
+
+// File system activity since boot, from fsstat().
+struct fsstat {
+    uint ncommit;  // log transactions committed
+    uint nlogged;  // blocks written to the log by them
+    uint niwrite;  // inode updates written
+    uint niskip;   // inode updates skipped: nothing changed
+    uint nfree;    // free disk blocks
+    uint ndedup;   // records stored as references to identical ones
+    uint ndedupblk; // disk blocks those did not need
+    uint ndisk;    // data disks the blocks are striped across
+    uint nrebuilt; // blocks rebuilt from parity
+    uint nresilver; // stripes in use a running resilver copies, or 0
+    uint nresilvered; // stripes it has copied so far
+    uint nl2hit;   // cache misses read from the cache disk
+    uint nl2fill;  // evicted blocks written to the cache disk
 };
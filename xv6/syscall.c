@@ -102,6 +102,18 @@ extern int sys_iopen(void);
 extern int sys_ichecksum(void);
 extern int sys_duplicate(void);
 extern int sys_forceopen(void);
+extern int sys_lseek(void);
+extern int sys_fsstat(void);
+extern int sys_snapshot(void);
+extern int sys_snapdestroy(void);
+extern int sys_snapinfo(void);
+extern int sys_snapmount(void);
+extern int sys_snapumount(void);
+extern int sys_snapsend(void);
+extern int sys_resilver(void);
+extern int sys_recsize(void);
+extern int sys_mount(void);
+extern int sys_umount(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -129,6 +141,18 @@ static int (*syscalls[])(void) = {
 [SYS_ichecksum]   sys_ichecksum,
 [SYS_duplicate]   sys_duplicate,
 [SYS_forceopen]   sys_forceopen,
+[SYS_lseek]   sys_lseek,
+[SYS_fsstat]  sys_fsstat,
+[SYS_snapshot] sys_snapshot,
+[SYS_snapdestroy] sys_snapdestroy,
+[SYS_snapinfo] sys_snapinfo,
+[SYS_snapmount] sys_snapmount,
+[SYS_snapumount] sys_snapumount,
+[SYS_snapsend] sys_snapsend,
+[SYS_resilver] sys_resilver,
+[SYS_recsize] sys_recsize,
+[SYS_mount]   sys_mount,
+[SYS_umount]  sys_umount,
 };
 
 void
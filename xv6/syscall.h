@@ -24,3 +24,15 @@
 #define SYS_ichecksum 23
 #define SYS_duplicate 24
 #define SYS_forceopen 25
+#define SYS_lseek  26
+#define SYS_fsstat 27
+#define SYS_snapshot 28
+#define SYS_snapdestroy 29
+#define SYS_snapinfo 30
+#define SYS_snapmount 31
+#define SYS_snapumount 32
+#define SYS_snapsend 33
+#define SYS_resilver 34
+#define SYS_recsize 35
+#define SYS_mount  36
+#define SYS_umount 37
@@ -10,9 +10,11 @@
 #include "stat.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
 #include "fs.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mount.h"
 
 
 extern struct inode* iget (uint dev, uint inum);
@@ -132,6 +134,253 @@ int sys_fstat(void)
     return filestat(f, st);
 }
 
+int sys_lseek(void)
+{
+    struct file *f;
+    int off, whence;
+
+    if(argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || argint(2, &whence) < 0) {
+        return -1;
+    }
+
+    return fileseek(f, off, whence);
+}
+
+// Copy the file system activity counters out to the caller.
+int sys_fsstat(void)
+{
+    struct fsstat *st;
+
+    if(argptr(0, (void*)&st, sizeof(*st)) < 0) {
+        return -1;
+    }
+
+    fsstat(st);
+    return 0;
+}
+
+// Resilver a member of the disk set (see raid.c); -1 for the
+// missing one.  Progress shows in fsstat().
+int sys_resilver(void)
+{
+    int m;
+
+    if(argint(0, &m) < 0) {
+        return -1;
+    }
+
+    return raidresilver(m);
+}
+
+// Set the record size of fd's file, which must have nothing in
+// it yet, or of fd's directory, whose new files and directories
+// take it.  size is in bytes, a power of two from BSIZE to
+// MAXRECBLKS blocks; 0 only asks.  Returns the record size.
+int sys_recsize(void)
+{
+    struct file *f;
+    struct inode *ip;
+    int size, n, r;
+
+    if(argfd(0, 0, &f) < 0 || argint(1, &size) < 0 || f->type != FD_INODE) {
+        return -1;
+    }
+
+    for(n = 1; n < MAXRECBLKS && n * BSIZE < size; n *= 2)
+        ;
+    if(size != 0 && n * BSIZE != size) {
+        return -1;
+    }
+
+    ip = f->ip;
+    if(size == 0) {
+        ilock(ip);
+        r = irecsize(ip);
+        iunlock(ip);
+        return r;
+    }
+
+    if(ISSNAPDEV(ip->dev)) {
+        return -1;
+    }
+
+    begin_op();
+    ilock(ip);
+    r = -1;
+    if(ip->type == T_DIR ||
+       (ip->type == T_FILE && ip->size == 0 && !(ip->iflags & (IF_COMPRESS|IF_DEDUP)))) {
+        ip->recblks = n;
+        iupdate(ip);
+        r = irecsize(ip);
+    }
+    iunlock(ip);
+    end_op();
+    return r;
+}
+
+// Take a snapshot of the whole file system.
+int sys_snapshot(void)
+{
+    char *name;
+
+    if(argstr(0, &name) < 0) {
+        return -1;
+    }
+
+    return snapcreate(name) < 0 ? -1 : 0;
+}
+
+// Destroy a snapshot; its space comes back over later commits.
+int sys_snapdestroy(void)
+{
+    char *name;
+
+    if(argstr(0, &name) < 0) {
+        return -1;
+    }
+
+    return snapdestroy(name);
+}
+
+// Copy entry i of the snapshot table to the caller.
+int sys_snapinfo(void)
+{
+    int i;
+    struct snapent *se;
+
+    if(argint(0, &i) < 0 || argptr(1, (void*)&se, sizeof(*se)) < 0) {
+        return -1;
+    }
+
+    return snapinfo(i, se);
+}
+
+// Mount snapshot name, read-only, on the directory path.
+int sys_snapmount(void)
+{
+    char *name, *path;
+    struct inode *ip;
+
+    if(argstr(0, &name) < 0 || argstr(1, &path) < 0 || (ip = namei(path)) == 0) {
+        return -1;
+    }
+
+    if(ilock(ip) != 0) {
+        iput(ip);
+        return -1;
+    }
+
+    if(ip->type != T_DIR || ISSNAPDEV(ip->dev) || ip->inum == ROOTINO){
+        iunlockput(ip);
+        return -1;
+    }
+
+    iunlock(ip);
+
+    if(snapmount(name, ip) < 0){
+        iput(ip);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Mount the file system on IDE disk dev on the directory path.
+int sys_mount(void)
+{
+    char *path;
+    struct inode *ip;
+    int dev;
+
+    if(argint(0, &dev) < 0 || argstr(1, &path) < 0 || (ip = namei(path)) == 0) {
+        return -1;
+    }
+
+    if(ilock(ip) != 0) {
+        iput(ip);
+        return -1;
+    }
+
+    if(ip->type != T_DIR || ISSNAPDEV(ip->dev) || ip->inum == ROOTINO){
+        iunlockput(ip);
+        return -1;
+    }
+
+    iunlock(ip);
+
+    if(dev <= 0 || ISSNAPDEV(dev) || fsmount(dev, ip) < 0){
+        iput(ip);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Unmount the disk mounted on path.
+int sys_umount(void)
+{
+    char *path;
+    struct inode *ip;
+    uint dev;
+
+    if(argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
+        return -1;
+    }
+
+    dev = ip->dev;
+    if(ip->inum != ROOTINO) {
+        dev = 0;  // not the root of a disk
+    }
+    iput(ip);
+
+    if(dev == 0 || (ip = fsumount(dev)) == 0) {
+        return -1;
+    }
+
+    begin_op();
+    iput(ip);
+    end_op();
+
+    return 0;
+}
+
+// Unmount the snapshot mounted on path.
+int sys_snapumount(void)
+{
+    char *path;
+    struct inode *ip;
+    uint dev;
+    int r;
+
+    if(argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
+        return -1;
+    }
+
+    dev = ip->dev;
+    iput(ip);
+
+    begin_op();
+    r = snapumount(dev);
+    end_op();
+
+    return r;
+}
+
+// Write the stream that brings a copy of snapshot from up to
+// snapshot to on fd; from "" sends all of to.  Returns the number
+// of blocks sent.
+int sys_snapsend(void)
+{
+    char *from, *to;
+    struct file *f;
+
+    if(argstr(0, &from) < 0 || argstr(1, &to) < 0 || argfd(2, 0, &f) < 0 || !f->writable) {
+        return -1;
+    }
+
+    return snapsend(*from != 0 ? from : 0, to, f);
+}
+
 // Create the path new as a link to the same inode as old.
 int sys_link(void)
 {
@@ -151,7 +400,7 @@ int sys_link(void)
     begin_op();
 
 
-    if(ip->type == T_DIR){
+    if(ip->type == T_DIR || ISSNAPDEV(ip->dev)){
         iunlockput(ip);
         end_op();
         return -1;
@@ -233,8 +482,8 @@ int sys_unlink(void)
 		panic("sys_unlink");
     }
 
-    // Cannot unlink "." or "..".
-    if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0) {
+    // Cannot unlink "." or "..", or from a snapshot.
+    if(namecmp(name, ".") == 0 || namecmp(name, "..") == 0 || ISSNAPDEV(dp->dev)) {
         goto bad;
     }
 
@@ -251,7 +500,7 @@ int sys_unlink(void)
         panic("unlink: nlink < 1");
     }
 
-    if(ip->type == T_DIR && !isdirempty(ip)){
+    if(ip->type == T_DIR && (!isdirempty(ip) || ismounted(ip) || snapcovers(ip))){
         iunlockput(ip);
         goto bad;
     }
@@ -261,6 +510,7 @@ int sys_unlink(void)
     if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de)) {
         panic("unlink: writei");
     }
+    dcinval(dp, name);
 
     if(ip->type == T_DIR){
         dp->nlink--;
@@ -287,6 +537,7 @@ static struct inode* create(char *path, short type, short major, short minor)
 {
     uint off;
     struct inode *ip, *dp;
+    struct inode *child1 = 0, *child2 = 0;
     char name[DIRSIZ];
     int d2r; // distance to root directory
 
@@ -296,6 +547,11 @@ static struct inode* create(char *path, short type, short major, short minor)
     d2r = dist2root(path);
     ilock(dp);
 
+    if(ISSNAPDEV(dp->dev)){  // snapshots are read-only
+        iunlockput(dp);
+        return 0;
+    }
+
     if((ip = dirlookup(dp, name, &off)) != 0){
         iunlockput(dp);
         ilock(ip);
@@ -317,10 +573,10 @@ static struct inode* create(char *path, short type, short major, short minor)
     ip->major = major;
     ip->minor = minor;
     ip->nlink = 1;
+    ip->recblks = dp->recblks;  // the directory's record size
 
     // hgp: add for ditto inodes
     if (type == T_DIR && d2r < DITTO_HIGHER) {
-    	struct inode *child1, *child2;
     	if (d2r < DITTO_LOWER) {  // close to root, create 2 dittos
     		child1 = ialloc(dp->dev, T_DITTO);
     		child2 = ialloc(dp->dev, T_DITTO);
@@ -337,6 +593,10 @@ static struct inode* create(char *path, short type, short major, short minor)
 
     iupdate(ip);
 
+    // iupdate() gave the dittos a link; ialloc()'s references can go.
+    if (child1) iput(child1);
+    if (child2) iput(child2);
+
     if(type == T_DIR){  // Create . and .. entries.
         dp->nlink++;  // for ".."
         iupdate(dp);
@@ -370,6 +630,16 @@ int sys_open(void)
     if(omode & O_CREATE){
         begin_op();
         ip = create(path, T_FILE, 1, 0);  // hgp: change major to 1
+
+        // Only a file with nothing in it yet can switch to
+        // records (see fs.c).
+        if(ip && ip->type == T_FILE && ip->size == 0 && !(ip->iflags & (IF_COMPRESS|IF_DEDUP))){
+            if(omode & O_COMPRESS)
+                ip->iflags |= IF_COMPRESS;
+            if(omode & O_DEDUP)
+                ip->iflags |= IF_DEDUP;
+            iupdate(ip);
+        }
         end_op();
 
         if(ip == 0) {
@@ -385,7 +655,7 @@ int sys_open(void)
         if (ilock_trans(ip) == E_CORRUPTED)
         	return E_CORRUPTED;
 
-        if(ip->type == T_DIR && omode != O_RDONLY){
+        if((ip->type == T_DIR || ISSNAPDEV(ip->dev)) && omode != O_RDONLY){
             iunlockput(ip);
             return -1;
         }
@@ -442,7 +712,7 @@ int sys_forceopen(void)
 		// use ilock_ext() with checksum 0
 		// read data from inode
 		ilock_ext(ip, 0);
-		if (ip->type == T_DIR && omode != O_RDONLY) {
+		if ((ip->type == T_DIR || ISSNAPDEV(ip->dev)) && omode != O_RDONLY) {
 			iunlockput(ip);
 			return -1;
 		}
@@ -479,7 +749,9 @@ int sys_iopen(void)
 		return -1;
 	}
 
-	if ((ip = iget((uint)dev, inum)) == 0) {
+	// A device that is not mounted has no struct mount to
+	// find its inode blocks with.
+	if (!ismountdev((uint)dev) || (ip = iget((uint)dev, inum)) == 0) {
 		return -2;
 	}
 
@@ -521,7 +793,9 @@ uint sys_ichecksum(void)
 		return -1;
 	}
 
-	if ((ip = iget((uint)dev, inum)) == 0) {
+	// A device that is not mounted has no struct mount to
+	// find its inode blocks with.
+	if (!ismountdev((uint)dev) || (ip = iget((uint)dev, inum)) == 0) {
 		return -2;
 	}
 
@@ -558,7 +832,7 @@ uint sys_ichecksum(void)
 
 static void ipropagate(struct inode *ip)
 {
-	int max = ((LOGSIZE - 1 -1 -2) / 2) * 512;
+	int max = ((LOGSIZE/snapcost() - 1 -1 -2) / 2) * 512;
 	int i = 0;
 	int n = ip->size, n1;
 	uint off = 0;
@@ -575,7 +849,7 @@ static void ipropagate(struct inode *ip)
 			ic = iget(ip->dev, ip->child1);
 			ilock_ext(ic, 0);
 			iduplicate(ip, ic, off, n1);  // from fs.c
-			iunlock(ic);
+			iunlockput(ic);
 		}
 
 		end_op();
@@ -585,7 +859,7 @@ static void ipropagate(struct inode *ip)
 			ic = iget(ip->dev, ip->child2);
 			ilock_ext(ic, 0);
 			iduplicate(ip, ic, off, n1);
-			iunlock(ic);
+			iunlockput(ic);
 		  }
 		end_op();
 
@@ -597,7 +871,7 @@ static void ipropagate(struct inode *ip)
 static struct inode* duplicate(char *path, int nditto)
 {
 	struct inode *ip;
-	struct inode *child1, *child2;
+	struct inode *child1 = 0, *child2 = 0;
 	if ((ip = namei_trans(path)) == 0) {
 		return 0;
 	}
@@ -606,6 +880,11 @@ static struct inode* duplicate(char *path, int nditto)
 		return 0;
 	}
 
+	if (ISSNAPDEV(ip->dev)) {
+		iunlockput(ip);
+		return 0;
+	}
+
 	begin_op();
 	if (nditto > 0) {
 		if (ip->child1) {
@@ -628,6 +907,9 @@ static struct inode* duplicate(char *path, int nditto)
 	begin_op();
 	iupdate(ip);
 	iunlockput(ip);
+	// The dittos have a link now; ialloc()'s references can go.
+	if (child1) iput(child1);
+	if (child2) iput(child2);
 	end_op();
 
 	return ip;
@@ -1,4 +1,6 @@
 struct stat;
+struct fsstat;
+struct snapent;
 
 // system calls
 int fork(void);
@@ -25,6 +27,18 @@ char* sbrk(int);
 int sleep(int);
 int uptime(void);
 int duplicate(char*, int);
+int lseek(int, int, int);
+int fsstat(struct fsstat*);
+int snapshot(char*);
+int snapdestroy(char*);
+int snapinfo(int, struct snapent*);
+int snapmount(char*, char*);
+int snapumount(char*);
+int snapsend(char*, char*, int);
+int resilver(int);
+int recsize(int, int);
+int mount(int, char*);
+int umount(char*);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -8,6 +8,10 @@
 #include "traps.h"
 #include "memlayout.h"
 
+// blocks in the big file tests: the direct blocks plus
+// one full indirect block
+#define BIGFILE (NDIRECT + NINDIRECT)
+
 char buf[8192];
 char name[3];
 char *echoargv[] = { "echo", "ALL", "TESTS", "PASSED", 0 };
@@ -197,7 +201,7 @@ writetest1(void)
     exit();
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < BIGFILE; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, 512) != 512){
       printf(stdout, "error: write big file failed\n", i);
@@ -217,7 +221,7 @@ writetest1(void)
   for(;;){
     i = read(fd, buf, 512);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n == BIGFILE - 1){
         printf(stdout, "read only %d blocks from big", n);
         exit();
       }
@@ -241,6 +245,625 @@ writetest1(void)
   printf(stdout, "big files ok\n");
 }
 
+// files larger than BIGFILE, mapped by extents
+void
+extenttest(void)
+{
+  int i, fd, n;
+  struct stat st;
+
+  printf(stdout, "extent file test\n");
+
+  fd = open("extent", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat extent failed!\n");
+    exit();
+  }
+  for(i = 0; i < 3*BIGFILE; i++){
+    ((int*)buf)[0] = i;
+    if(write(fd, buf, 512) != 512){
+      printf(stdout, "error: write extent file block %d failed\n", i);
+      exit();
+    }
+  }
+  if(fstat(fd, &st) < 0 || st.size != 3*BIGFILE*512){
+    printf(stdout, "error: extent file has the wrong size\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("extent", O_RDONLY);
+  if(fd < 0){
+    printf(stdout, "error: open extent failed!\n");
+    exit();
+  }
+  for(n = 0; (i = read(fd, buf, 512)) == 512; n++){
+    if(((int*)buf)[0] != n){
+      printf(stdout, "read content of extent block %d is %d\n",
+             n, ((int*)buf)[0]);
+      exit();
+    }
+  }
+  if(i != 0 || n != 3*BIGFILE){
+    printf(stdout, "read only %d blocks from extent\n", n);
+    exit();
+  }
+  close(fd);
+  if(unlink("extent") < 0){
+    printf(stdout, "unlink extent failed\n");
+    exit();
+  }
+  printf(stdout, "extent file test ok\n");
+}
+
+// A file whose blocks are in more bitmap blocks than the log
+// holds is freed a transaction at a time.  Its blocks are one
+// every BPB file blocks, and each one's allocation goal is in
+// the next bitmap block.  Needs a big image (mkfs -s).
+void
+bigunlinktest(void)
+{
+  struct fsstat st0, st1;
+  int i, fd, n;
+
+  printf(stdout, "big unlink test\n");
+
+  fsstat(&st0);
+  n = st0.nfree / BPB - 2;
+  if(n < 4){
+    printf(stdout, "big unlink test skipped: image too small\n");
+    return;
+  }
+  if(n > LOGSIZE + 2)
+    n = LOGSIZE + 2;
+
+  fd = open("bigunlink", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat bigunlink failed!\n");
+    exit();
+  }
+  for(i = 0; i < n; i++){
+    ((int*)buf)[0] = i;
+    if(lseek(fd, i * BPB * 512, SEEK_SET) < 0 || write(fd, buf, 512) != 512){
+      printf(stdout, "error: write bigunlink block %d failed\n", i);
+      exit();
+    }
+  }
+  close(fd);
+
+  if(unlink("bigunlink") < 0){
+    printf(stdout, "unlink bigunlink failed\n");
+    exit();
+  }
+  fsstat(&st1);
+  if(st1.nfree != st0.nfree){
+    printf(stdout, "error: bigunlink left %d blocks\n", st0.nfree - st1.nfree);
+    exit();
+  }
+  printf(stdout, "big unlink test ok\n");
+}
+
+// Small files live in the inode until they grow past
+// NINLINE bytes; check both sides of the move to blocks.
+void
+inlinetest(void)
+{
+  int fd, i;
+
+  printf(stdout, "inline file test\n");
+
+  fd = open("inline", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat inline failed!\n");
+    exit();
+  }
+  for(i = 0; i < 600; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, 20) != 20 || write(fd, buf + 20, 20) != 20){
+    printf(stdout, "error: write inline failed\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("inline", O_RDWR);
+  if(read(fd, buf + 1000, 100) != 40 || buf[1000] != 'a' || buf[1039] != 'a' + 39 % 26){
+    printf(stdout, "error: read inline failed\n");
+    exit();
+  }
+  if(write(fd, buf + 40, 560) != 560){
+    printf(stdout, "error: grow inline failed\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("inline", O_RDONLY);
+  if(read(fd, buf + 1000, 1000) != 600 || buf[1039] != 'a' + 39 % 26 ||
+     buf[1040] != 'a' + 40 % 26 || buf[1599] != 'a' + 599 % 26){
+    printf(stdout, "error: inline file wrong after growing\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("inline") < 0){
+    printf(stdout, "unlink inline failed\n");
+    exit();
+  }
+  printf(stdout, "inline file test ok\n");
+}
+
+// A snapshot keeps the old content of a file that is later
+// rewritten, and is read-only.
+void
+snaptest(void)
+{
+  int fd, i;
+
+  printf(stdout, "snapshot test\n");
+
+  fd = open("snapf", O_CREATE|O_RDWR);
+  memset(buf, 'A', 1024);
+  if(fd < 0 || write(fd, buf, 1024) != 1024){
+    printf(stdout, "error: write snapf failed\n");
+    exit();
+  }
+  close(fd);
+
+  if(snapshot("ut") < 0){
+    printf(stdout, "error: snapshot failed\n");
+    exit();
+  }
+
+  fd = open("snapf", O_RDWR);
+  memset(buf, 'B', 1024);
+  if(fd < 0 || write(fd, buf, 1024) != 1024){
+    printf(stdout, "error: rewrite snapf failed\n");
+    exit();
+  }
+  close(fd);
+
+  if(mkdir("snapmnt") < 0 || snapmount("ut", "snapmnt") < 0){
+    printf(stdout, "error: snapmount failed\n");
+    exit();
+  }
+  fd = open("snapmnt/snapf", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 1024){
+    printf(stdout, "error: read snapmnt/snapf failed\n");
+    exit();
+  }
+  for(i = 0; i < 1024; i++){
+    if(buf[i] != 'A'){
+      printf(stdout, "error: snapshot has new content\n");
+      exit();
+    }
+  }
+  close(fd);
+  if(open("snapmnt/snapf", O_RDWR) >= 0 || open("snapmnt/x", O_CREATE|O_RDWR) >= 0 ||
+     unlink("snapmnt/snapf") >= 0){
+    printf(stdout, "error: wrote to a snapshot\n");
+    exit();
+  }
+  if(snapdestroy("ut") >= 0){
+    printf(stdout, "error: destroyed a mounted snapshot\n");
+    exit();
+  }
+
+  if(snapumount("snapmnt") < 0 || snapdestroy("ut") < 0){
+    printf(stdout, "error: snapumount or snapdestroy failed\n");
+    exit();
+  }
+  fd = open("snapf", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 1024 || buf[0] != 'B'){
+    printf(stdout, "error: snapf lost its new content\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("snapf") < 0 || unlink("snapmnt") < 0){
+    printf(stdout, "error: unlink after snapshot failed\n");
+    exit();
+  }
+  printf(stdout, "snapshot test ok\n");
+}
+
+// A file opened with O_COMPRESS reads back what was written,
+// across record boundaries and after a rewrite in the middle,
+// and its repetitive content takes fewer blocks than its size.
+void
+ziptest(void)
+{
+  struct stat st;
+  int fd, i;
+
+  printf(stdout, "compressed file test\n");
+
+  fd = open("zipf", O_CREATE|O_COMPRESS|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat zipf failed\n");
+    exit();
+  }
+  for(i = 0; i < 5000; i++)
+    buf[i] = 'a' + (i / 7) % 26;
+  if(write(fd, buf, 3000) != 3000 || write(fd, buf + 3000, 2000) != 2000){
+    printf(stdout, "error: write zipf failed\n");
+    exit();
+  }
+  for(i = 1500; i < 2600; i++)
+    buf[i] = i * 7;
+  if(lseek(fd, 1500, SEEK_SET) != 1500 || write(fd, buf + 1500, 1100) != 1100){
+    printf(stdout, "error: rewrite zipf failed\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("zipf", O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0 || st.size != 5000 || st.blocks * BSIZE >= 5000){
+    printf(stdout, "error: zipf is not compressed\n");
+    exit();
+  }
+  for(i = 0; i < 5000; i++){
+    if(i % 500 == 0 && read(fd, buf + 6000, 500) != 500){
+      printf(stdout, "error: read zipf failed\n");
+      exit();
+    }
+    if(buf[6000 + i % 500] != buf[i]){
+      printf(stdout, "error: zipf read back wrong at %d\n", i);
+      exit();
+    }
+  }
+  close(fd);
+  if(unlink("zipf") < 0){
+    printf(stdout, "unlink zipf failed\n");
+    exit();
+  }
+  printf(stdout, "compressed file test ok\n");
+}
+
+// A second O_DEDUP file with the same content as the first
+// takes no new blocks, and rewriting one leaves the other be.
+void
+deduptest(void)
+{
+  struct fsstat s0, s1;
+  int fd, i;
+
+  printf(stdout, "dedup test\n");
+
+  memset(buf, 'd', 4096);
+  fd = open("dupa", O_CREATE|O_DEDUP|O_RDWR);
+  if(fd < 0 || write(fd, buf, 4096) != 4096){
+    printf(stdout, "error: write dupa failed\n");
+    exit();
+  }
+  close(fd);
+
+  fsstat(&s0);
+  fd = open("dupb", O_CREATE|O_DEDUP|O_RDWR);
+  if(fd < 0 || write(fd, buf, 4096) != 4096){
+    printf(stdout, "error: write dupb failed\n");
+    exit();
+  }
+  close(fd);
+  fsstat(&s1);
+  if(s1.nfree != s0.nfree || s1.ndedup - s0.ndedup != 2){
+    printf(stdout, "error: dupb was not deduplicated\n");
+    exit();
+  }
+
+  fd = open("dupa", O_RDWR);
+  if(fd < 0 || write(fd, "x", 1) != 1){
+    printf(stdout, "error: rewrite dupa failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("dupb", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != 4096){
+    printf(stdout, "error: read dupb failed\n");
+    exit();
+  }
+  for(i = 0; i < 4096; i++){
+    if(buf[i] != 'd'){
+      printf(stdout, "error: dupb changed with dupa\n");
+      exit();
+    }
+  }
+  close(fd);
+  if(unlink("dupa") < 0 || unlink("dupb") < 0){
+    printf(stdout, "unlink dupa or dupb failed\n");
+    exit();
+  }
+  printf(stdout, "dedup test ok\n");
+}
+
+// A stream between two snapshots holds the blocks that changed
+// and ends with SENDEND.
+void
+sendtest(void)
+{
+  struct sendhdr hdr;
+  struct stat st;
+  int fd, n;
+
+  printf(stdout, "send test\n");
+
+  fd = open("sendf", O_CREATE|O_RDWR);
+  memset(buf, 'A', 1024);
+  if(fd < 0 || write(fd, buf, 1024) != 1024){
+    printf(stdout, "error: write sendf failed\n");
+    exit();
+  }
+  close(fd);
+  if(snapshot("ut1") < 0){
+    printf(stdout, "error: snapshot ut1 failed\n");
+    exit();
+  }
+  fd = open("sendf", O_RDWR);
+  memset(buf, 'B', 1024);
+  if(fd < 0 || write(fd, buf, 1024) != 1024){
+    printf(stdout, "error: rewrite sendf failed\n");
+    exit();
+  }
+  close(fd);
+  if(snapshot("ut2") < 0){
+    printf(stdout, "error: snapshot ut2 failed\n");
+    exit();
+  }
+
+  fd = open("sendout", O_CREATE|O_RDWR);
+  if(fd < 0 || snapsend("ut2", "ut1", fd) >= 0 || snapsend("", "nosuch", fd) >= 0){
+    printf(stdout, "error: bad snapsend succeeded\n");
+    exit();
+  }
+  n = snapsend("ut1", "ut2", fd);
+  if(n < 2 || fstat(fd, &st) < 0 || st.size != sizeof(hdr) + (n + 1) * sizeof(struct sendrec)){
+    printf(stdout, "error: snapsend sent %d blocks\n", n);
+    exit();
+  }
+  close(fd);
+
+  fd = open("sendout", O_RDONLY);
+  if(fd < 0 || read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || hdr.magic != SENDMAGIC ||
+     hdr.fromseq == 0 || hdr.fromseq >= hdr.toseq){
+    printf(stdout, "error: bad stream header\n");
+    exit();
+  }
+  close(fd);
+
+  if(snapdestroy("ut1") < 0 || snapdestroy("ut2") < 0 ||
+     unlink("sendf") < 0 || unlink("sendout") < 0){
+    printf(stdout, "error: cleanup after send failed\n");
+    exit();
+  }
+  printf(stdout, "send test ok\n");
+}
+
+// On a disk set, resilver a member that is not missing and check
+// that a file written before it reads back.  Elsewhere there is
+// nothing to resilver.
+void
+resilvertest(void)
+{
+  struct fsstat st;
+  int fd, i, n;
+
+  printf(stdout, "resilver test\n");
+
+  fsstat(&st);
+  if(resilver(NRAIDDISK) >= 0 || (st.ndisk == 1 && resilver(-1) >= 0)){
+    printf(stdout, "error: bad resilver succeeded\n");
+    exit();
+  }
+
+  fd = open("rsf", O_CREATE|O_RDWR);
+  for(i = 0; i < 8; i++){
+    memset(buf, 'a' + i, 512);
+    if(fd < 0 || write(fd, buf, 512) != 512){
+      printf(stdout, "error: write rsf failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  if(st.ndisk > 1 && ((n = resilver(0)) <= 0 || fsstat(&st) < 0 || st.nresilvered != n)){
+    printf(stdout, "error: resilver failed\n");
+    exit();
+  }
+
+  fd = open("rsf", O_RDONLY);
+  for(i = 0; i < 8; i++){
+    if(fd < 0 || read(fd, buf, 512) != 512 || buf[0] != 'a' + i || buf[511] != 'a' + i){
+      printf(stdout, "error: read rsf failed\n");
+      exit();
+    }
+  }
+  close(fd);
+  unlink("rsf");
+  printf(stdout, "resilver test ok\n");
+}
+
+// Record sizes: set while empty, inherited from the directory,
+// and files written across record boundaries read back intact.
+void
+recsizetest(void)
+{
+  int fd, i, n;
+
+  printf(stdout, "recsize test\n");
+
+  fd = open("rsz", O_CREATE|O_RDWR);
+  if(fd < 0 || recsize(fd, 0) != BSIZE || recsize(fd, 3000) >= 0 ||
+     recsize(fd, 4096) != 4096){
+    printf(stdout, "error: recsize rsz failed\n");
+    exit();
+  }
+  for(i = 0; i < 8; i++){
+    memset(buf, 'a' + i, 3000);
+    if(write(fd, buf, 3000) != 3000){
+      printf(stdout, "error: write rsz failed\n");
+      exit();
+    }
+  }
+  if(recsize(fd, 8192) >= 0){
+    printf(stdout, "error: recsize of a non-empty file succeeded\n");
+    exit();
+  }
+  // Across the boundary of records 1 and 2.
+  memset(buf, 'z', 2000);
+  lseek(fd, 7000, SEEK_SET);
+  write(fd, buf, 2000);
+  close(fd);
+
+  fd = open("rsz", O_RDONLY);
+  for(i = 0; i < 8; i++){
+    if(read(fd, buf, 3000) != 3000){
+      printf(stdout, "error: read rsz failed\n");
+      exit();
+    }
+    for(n = 0; n < 3000; n++){
+      if(buf[n] != (i*3000 + n >= 7000 && i*3000 + n < 9000 ? 'z' : 'a' + i)){
+        printf(stdout, "error: rsz has the wrong data\n");
+        exit();
+      }
+    }
+  }
+  close(fd);
+  unlink("rsz");
+
+  mkdir("rszd");
+  fd = open("rszd", O_RDONLY);
+  if(fd < 0 || recsize(fd, 8192) != 8192){
+    printf(stdout, "error: recsize rszd failed\n");
+    exit();
+  }
+  close(fd);
+  fd = open("rszd/f", O_CREATE|O_RDWR);
+  if(fd < 0 || recsize(fd, 0) != 8192){
+    printf(stdout, "error: rszd/f did not inherit the record size\n");
+    exit();
+  }
+  close(fd);
+  unlink("rszd/f");
+  unlink("rszd");
+  printf(stdout, "recsize test ok\n");
+}
+
+// mount the scratch disk (make qemu-scratch) on a directory.
+// Without one, only check that bad mounts fail.
+void
+mounttest(void)
+{
+  struct stat st, st1;
+  int fd;
+
+  printf(stdout, "mount test\n");
+
+  if(mkdir("mnt") < 0 || (fd = open("mntf", O_CREATE|O_RDWR)) < 0){
+    printf(stdout, "error: mount setup failed\n");
+    exit();
+  }
+  close(fd);
+
+  if(mount(1, "mnt") >= 0 || mount(2, "mntf") >= 0 || mount(2, "nomnt") >= 0 ||
+     umount("mnt") >= 0 || umount("/") >= 0){
+    printf(stdout, "error: bad mount succeeded\n");
+    exit();
+  }
+
+  if(mount(2, "mnt") < 0){
+    printf(stdout, "no scratch disk\n");
+    unlink("mntf");
+    unlink("mnt");
+    return;
+  }
+
+  if(mount(2, "mntf") >= 0 || unlink("mnt") >= 0){
+    printf(stdout, "error: second mount succeeded\n");
+    exit();
+  }
+
+  unlink("mnt/mf");
+  fd = open("mnt/mf", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, "mounted", 7) != 7){
+    printf(stdout, "error: write mnt/mf failed\n");
+    exit();
+  }
+  if(stat(".", &st) < 0 || stat("mnt/..", &st1) < 0 || st.ino != st1.ino){
+    printf(stdout, "error: mnt/.. is not .\n");
+    exit();
+  }
+  if(umount("mnt") >= 0){
+    printf(stdout, "error: umount with a file open succeeded\n");
+    exit();
+  }
+  close(fd);
+
+  if(umount("mnt") < 0 || open("mnt/mf", O_RDONLY) >= 0){
+    printf(stdout, "error: umount failed\n");
+    exit();
+  }
+
+  if(mount(2, "mnt") < 0 || (fd = open("mnt/mf", O_RDONLY)) < 0 ||
+     read(fd, buf, sizeof(buf)) != 7){
+    printf(stdout, "error: mnt/mf lost\n");
+    exit();
+  }
+  close(fd);
+  buf[7] = 0;
+  if(strcmp(buf, "mounted") != 0){
+    printf(stdout, "error: mnt/mf has the wrong data\n");
+    exit();
+  }
+
+  if(unlink("mnt/mf") < 0 || umount("mnt") < 0){
+    printf(stdout, "error: cleanup of mnt failed\n");
+    exit();
+  }
+  unlink("mntf");
+  unlink("mnt");
+  printf(stdout, "mount test ok\n");
+}
+
+// writing past the end of a file leaves a hole that reads as zeros
+void
+sparsetest(void)
+{
+  int fd, i;
+  struct stat st;
+
+  printf(stdout, "sparse file test\n");
+
+  fd = open("sparse", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf(stdout, "error: creat sparse failed!\n");
+    exit();
+  }
+  if(lseek(fd, 100*512 + 7, SEEK_SET) != 100*512 + 7 || write(fd, "x", 1) != 1){
+    printf(stdout, "error: write past end of sparse failed\n");
+    exit();
+  }
+  if(fstat(fd, &st) < 0 || st.size != 100*512 + 8){
+    printf(stdout, "error: sparse file has the wrong size\n");
+    exit();
+  }
+  close(fd);
+
+  fd = open("sparse", O_RDONLY);
+  for(i = 0; i < 100; i++){
+    memset(buf, 'z', 512);
+    if(read(fd, buf, 512) != 512 || buf[0] != 0 || buf[511] != 0){
+      printf(stdout, "error: hole in sparse does not read as zeros\n");
+      exit();
+    }
+  }
+  if(read(fd, buf, 512) != 8 || buf[6] != 0 || buf[7] != 'x'){
+    printf(stdout, "error: sparse file tail is wrong\n");
+    exit();
+  }
+  close(fd);
+  if(unlink("sparse") < 0){
+    printf(stdout, "unlink sparse failed\n");
+    exit();
+  }
+  printf(stdout, "sparse file test ok\n");
+}
+
 void
 createtest(void)
 {
@@ -512,6 +1135,52 @@ sharedfd(void)
   }
 }
 
+// two processes read one file through a shared fd: each
+// int in it must be read once, by one of them.
+void
+sharedread(void)
+{
+  int fd, pid, i, x, n, nc, p[2];
+
+  printf(1, "sharedread test\n");
+
+  unlink("sharedread");
+  fd = open("sharedread", O_CREATE|O_RDWR);
+  for(i = 0; i < 2000; i++){
+    if(fd < 0 || write(fd, &i, sizeof(i)) != sizeof(i)){
+      printf(1, "fstests: write sharedread failed\n");
+      exit();
+    }
+  }
+  close(fd);
+
+  fd = open("sharedread", 0);
+  if(fd < 0 || pipe(p) < 0){
+    printf(1, "fstests: cannot open sharedread for reading\n");
+    exit();
+  }
+  pid = fork();
+  n = 0;
+  while(read(fd, &x, sizeof(x)) == sizeof(x))
+    n++;
+  if(pid == 0){
+    write(p[1], &n, sizeof(n));
+    exit();
+  }
+  wait();
+  if(read(p[0], &nc, sizeof(nc)) != sizeof(nc))
+    nc = -1;
+  close(p[0]);
+  close(p[1]);
+  close(fd);
+  unlink("sharedread");
+  if(n + nc != 2000){
+    printf(1, "sharedread oops %d %d\n", n, nc);
+    exit();
+  }
+  printf(1, "sharedread ok\n");
+}
+
 // four processes write different files at the same
 // time, to test block allocation.
 void
@@ -852,6 +1521,63 @@ concreate(void)
   printf(1, "concreate ok\n");
 }
 
+// Listing a directory, whose reads prefetch the entries'
+// inodes, sees every entry, also after seeking back.
+void
+lsdirtest(void)
+{
+  char name[8];
+  struct dirent de;
+  struct stat st;
+  int fd, i, n, pass;
+
+  printf(1, "lsdir test\n");
+  mkdir("lsd");
+  for(i = 0; i < 40; i++){
+    strcpy(name, "lsd/xx");
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, name, i) != i){
+      printf(1, "lsdir create failed\n");
+      exit();
+    }
+    close(fd);
+  }
+
+  fd = open("lsd", O_RDONLY);
+  for(pass = 0; pass < 2; pass++){
+    lseek(fd, 0, SEEK_SET);
+    n = 0;
+    while(read(fd, &de, sizeof(de)) == sizeof(de)){
+      if(de.inum == 0 || de.name[0] == '.')
+        continue;
+      strcpy(name, "lsd/");
+      memmove(name + 4, de.name, 3);
+      i = (name[4] - '0') * 10 + name[5] - '0';
+      if(stat(name, &st) < 0 || st.type != T_FILE || st.size != i || st.ino != de.inum){
+        printf(1, "lsdir stat %s failed\n", name);
+        exit();
+      }
+      n++;
+    }
+    if(n != 40){
+      printf(1, "lsdir saw %d entries\n", n);
+      exit();
+    }
+  }
+  close(fd);
+
+  for(i = 0; i < 40; i++){
+    strcpy(name, "lsd/xx");
+    name[4] = '0' + i / 10;
+    name[5] = '0' + i % 10;
+    unlink(name);
+  }
+  unlink("lsd");
+  printf(1, "lsdir ok\n");
+}
+
 // another concurrent link/unlink/create test,
 // to look for deadlocks.
 void
@@ -931,6 +1657,71 @@ bigdir(void)
   printf(1, "bigdir ok\n");
 }
 
+// More names than one block of hashed directory index can
+// hold leaves for, so the index grows a level.
+#define NHUGEDIR 2000
+
+void
+hugedir(void)
+{
+  int i, fd;
+  char name[8];
+
+  printf(1, "hugedir test\n");
+
+  if(mkdir("hd") != 0 || chdir("hd") != 0){
+    printf(1, "hugedir mkdir failed\n");
+    exit();
+  }
+  fd = open("hf", O_CREATE);
+  if(fd < 0){
+    printf(1, "hugedir create failed\n");
+    exit();
+  }
+  close(fd);
+
+  name[0] = 'h';
+  name[5] = '\0';
+  for(i = 0; i < NHUGEDIR; i++){
+    name[1] = '0' + i / 1000;
+    name[2] = '0' + (i / 100) % 10;
+    name[3] = '0' + (i / 10) % 10;
+    name[4] = '0' + i % 10;
+    if(link("hf", name) != 0){
+      printf(1, "hugedir link %s failed\n", name);
+      exit();
+    }
+  }
+
+  for(i = 0; i < NHUGEDIR; i++){
+    name[1] = '0' + i / 1000;
+    name[2] = '0' + (i / 100) % 10;
+    name[3] = '0' + (i / 10) % 10;
+    name[4] = '0' + i % 10;
+    if((fd = open(name, 0)) < 0){
+      printf(1, "hugedir open %s failed\n", name);
+      exit();
+    }
+    close(fd);
+    if(unlink(name) != 0){
+      printf(1, "hugedir unlink %s failed\n", name);
+      exit();
+    }
+    if(open(name, 0) >= 0){
+      printf(1, "hugedir %s still there\n", name);
+      exit();
+    }
+  }
+
+  unlink("hf");
+  if(chdir("..") != 0 || unlink("hd") != 0){
+    printf(1, "hugedir rmdir failed\n");
+    exit();
+  }
+
+  printf(1, "hugedir ok\n");
+}
+
 void
 subdir(void)
 {
@@ -1717,8 +2508,10 @@ main(int argc, char *argv[])
   createdelete();
   linkunlink();
   concreate();
+  lsdirtest();
   fourfiles();
   sharedfd();
+  sharedread();
 
   bigargtest();
   bigwrite();
@@ -1730,6 +2523,17 @@ main(int argc, char *argv[])
   opentest();
   writetest();
   writetest1();
+  extenttest();
+  bigunlinktest();
+  sparsetest();
+  inlinetest();
+  snaptest();
+  ziptest();
+  deduptest();
+  sendtest();
+  resilvertest();
+  recsizetest();
+  mounttest();
   createtest();
 
   openiputtest();
@@ -1751,6 +2555,7 @@ main(int argc, char *argv[])
   iref();
   forktest();
   bigdir(); // slow
+  hugedir(); // slow
   exectest();
 
   exit();